@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+/* A power of two. 4096 slots of 512 bytes make a 2 MiB ring. */
+#define SLOTS 4096u
+#define SLOT_SIZE 512
+/* Lines written per writev, well under IOV_MAX. */
+#define BATCH 256
+/* The writer wakes at least this often, and whenever another quarter of
+ * the ring has been claimed. */
+#define FLUSH_MS 100
+#define WAKE_EVERY (SLOTS / 4)
+
+/* Slot i of lap n holds seq == i + n * SLOTS while free for a writer and
+ * i + n * SLOTS + 1 once its line is published (the bounded queue of
+ * D. Vyukov, with a single consumer). Lines are formatted before a slot is
+ * claimed, so a claimed slot is published a memcpy later; the writer waits
+ * for it in order. */
+struct slot {
+  uint64_t seq;
+  uint32_t len;
+  char line[SLOT_SIZE - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct access_log {
+  /* Shared by every process; each on its own cache line. */
+  uint64_t head __attribute__((aligned(64))); /* next slot to claim */
+  uint64_t tail __attribute__((aligned(64))); /* next slot to write out */
+  uint64_t dropped __attribute__((aligned(64)));
+  uint32_t wake; /* futex word, bumped to wake the writer */
+  /* Used only in the process that opened the log. */
+  bool stop;
+  uint64_t reported; /* drops already noted in the log */
+  int fd;
+  pthread_t writer;
+  struct slot slots[SLOTS];
+};
+
+static void wake_writer(struct access_log *l) {
+  __atomic_fetch_add(&l->wake, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &l->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Writes all of iov[0..n), advancing over partial writes. */
+static int writev_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= (size_t)w;
+    }
+  }
+  return 0;
+}
+
+static size_t format_time(char *out, size_t cap) {
+  struct timespec ts;
+  struct tm tm;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+  size_t n = strftime(out, cap, "%Y-%m-%dT%H:%M:%S", &tm);
+  return n + (size_t)snprintf(out + n, cap - n, ".%03ldZ",
+                              ts.tv_nsec / 1000000);
+}
+
+/* Writes out the published lines at the tail, up to a batch, and hands
+ * their slots back. Returns how many it took. */
+static unsigned drain(struct access_log *l) {
+  struct iovec iov[BATCH + 1];
+  char note[96];
+  int n = 0;
+  uint64_t dropped = __atomic_load_n(&l->dropped, __ATOMIC_RELAXED);
+  if (dropped != l->reported) {
+    size_t len = (size_t)snprintf(note, sizeof(note), "{\"time\":\"");
+    len += format_time(note + len, sizeof(note) - len);
+    len += (size_t)snprintf(note + len, sizeof(note) - len,
+                            "\",\"dropped\":%llu}\n",
+                            (unsigned long long)(dropped - l->reported));
+    l->reported = dropped;
+    iov[n++] = (struct iovec){note, len};
+  }
+
+  uint64_t tail = l->tail;
+  unsigned taken = 0;
+  while (taken < BATCH) {
+    struct slot *s = &l->slots[(tail + taken) & (SLOTS - 1)];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + taken + 1)
+      break;
+    iov[n++] = (struct iovec){s->line, s->len};
+    taken++;
+  }
+  /* A failed write loses the batch; there is nowhere to report it. */
+  if (n > 0)
+    writev_all(l->fd, iov, n);
+  for (unsigned i = 0; i < taken; i++)
+    __atomic_store_n(&l->slots[(tail + i) & (SLOTS - 1)].seq,
+                     tail + i + SLOTS, __ATOMIC_RELEASE);
+  __atomic_store_n(&l->tail, tail + taken, __ATOMIC_RELEASE);
+  return taken;
+}
+
+static void *writer_main(void *arg) {
+  struct access_log *l = arg;
+  for (;;) {
+    uint32_t seen = __atomic_load_n(&l->wake, __ATOMIC_ACQUIRE);
+    if (drain(l) == BATCH)
+      continue;
+    if (__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+      break;
+    struct timespec ts = {0, FLUSH_MS * 1000000L};
+    syscall(SYS_futex, &l->wake, FUTEX_WAIT, seen, &ts, NULL, 0);
+  }
+  while (drain(l) > 0)
+    ;
+  return NULL;
+}
+
+struct access_log *access_log_open(const char *path) {
+  int fd = strcmp(path, "-") == 0
+               ? dup(STDOUT_FILENO)
+               : open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return NULL;
+  struct access_log *l = mmap(NULL, sizeof(*l), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (l == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  for (unsigned i = 0; i < SLOTS; i++)
+    l->slots[i].seq = i;
+  l->fd = fd;
+  int err = pthread_create(&l->writer, NULL, writer_main, l);
+  if (err != 0) {
+    close(fd);
+    munmap(l, sizeof(*l));
+    errno = err;
+    return NULL;
+  }
+  return l;
+}
+
+void access_log_close(struct access_log *l) {
+  if (!l)
+    return;
+  __atomic_store_n(&l->stop, true, __ATOMIC_RELEASE);
+  wake_writer(l);
+  pthread_join(l->writer, NULL);
+  close(l->fd);
+  munmap(l, sizeof(*l));
+}
+
+/* Appends s as the inside of a JSON string, escaping as needed, while it
+ * fits below cap; a string that does not fit is cut short. Bytes outside
+ * ASCII are escaped too, as the target need not be valid UTF-8. */
+static size_t put_json(char *out, size_t len, size_t cap, const char *s,
+                       size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c == '"' || c == '\\') {
+      if (len + 2 > cap)
+        break;
+      out[len++] = '\\';
+      out[len++] = (char)c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      if (len + 6 > cap)
+        break;
+      len += (size_t)snprintf(out + len, 7, "\\u%04x", c);
+    } else {
+      if (len + 1 > cap)
+        break;
+      out[len++] = (char)c;
+    }
+  }
+  return len;
+}
+
+void access_log_write(struct access_log *l, const struct access_log_record *r) {
+  if (!l)
+    return;
+  char line[sizeof(l->slots[0].line)];
+  char tail[160];
+  int tail_len = snprintf(
+      tail, sizeof(tail),
+      "\",\"status\":%d,\"bytes\":%llu,\"route\":\"%s\",\"parser_us\":%llu,"
+      "\"duration_us\":%llu}\n",
+      r->status, (unsigned long long)r->bytes, r->route,
+      (unsigned long long)(r->parser_ns / 1000),
+      (unsigned long long)(r->total_ns / 1000));
+  if (tail_len < 0 || (size_t)tail_len >= sizeof(tail))
+    return;
+
+  size_t len = (size_t)snprintf(line, sizeof(line), "{\"time\":\"");
+  len += format_time(line + len, sizeof(line) - len);
+  len += (size_t)snprintf(line + len, sizeof(line) - len, "\",\"method\":\"");
+  size_t cap = sizeof(line) - (size_t)tail_len;
+  len = put_json(line, len, cap, r->method,
+                 r->method_len < 16 ? r->method_len : 16);
+  static const char path_key[] = "\",\"path\":\"";
+  memcpy(line + len, path_key, sizeof(path_key) - 1);
+  len += sizeof(path_key) - 1;
+  len = put_json(line, len, cap, r->target, r->target_len);
+  memcpy(line + len, tail, (size_t)tail_len);
+  len += (size_t)tail_len;
+
+  uint64_t pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+  struct slot *s;
+  for (;;) {
+    s = &l->slots[pos & (SLOTS - 1)];
+    uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&l->head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* Still holding a line from the previous lap: the ring is full. */
+      __atomic_fetch_add(&l->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(s->line, line, len);
+  s->len = (uint32_t)len;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+  if ((pos + 1) % WAKE_EVERY == 0)
+    wake_writer(l);
+}
+
+uint64_t access_log_dropped(const struct access_log *l) {
+  return l ? __atomic_load_n(&l->dropped, __ATOMIC_RELAXED) : 0;
+}
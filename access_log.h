@@ -0,0 +1,39 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Structured access log, one JSON object per line. Handlers format their
+ * line straight into a slot of a lock-free ring in a shared anonymous
+ * mapping, so threads, forked handlers and prefork workers all feed the
+ * one writer thread of the process that opened the log. The writer sends
+ * whole batches of slots with writev. A handler that finds the ring full
+ * drops its line and counts it instead of waiting; the writer reports
+ * drops in the log itself. Every function accepts a NULL log and then does
+ * nothing. */
+struct access_log;
+
+struct access_log_record {
+  const char *method;
+  size_t method_len;
+  const char *target; /* as sent, still percent-encoded */
+  size_t target_len;
+  int status;
+  uint64_t bytes;
+  const char *route;
+  uint64_t parser_ns; /* 0 if nothing was rendered */
+  uint64_t total_ns;
+};
+
+/* Opens path for appending ("-" is stdout) and starts the writer. Must be
+ * called before forking any handler. Returns NULL with errno set. */
+struct access_log *access_log_open(const char *path);
+/* Writes out what is queued, stops the writer and closes the log. */
+void access_log_close(struct access_log *l);
+
+void access_log_write(struct access_log *l, const struct access_log_record *r);
+
+uint64_t access_log_dropped(const struct access_log *l);
+
+#endif
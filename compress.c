@@ -0,0 +1,51 @@
+#include <brotli/encode.h>
+#include <limits.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+/* Pages are compressed once and then served from the cache many times, so
+ * both encoders run at a high setting. */
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9
+
+int gzip_compress(const char *src, size_t len, struct md_buf *out) {
+  if (len > UINT_MAX)
+    return -1;
+  z_stream zs = {0};
+  /* 15 window bits plus 16 selects the gzip wrapper. */
+  if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  size_t bound = deflateBound(&zs, (uLong)len);
+  if (md_buf_reserve(out, bound) < 0) {
+    deflateEnd(&zs);
+    return -1;
+  }
+  zs.next_in = (Bytef *)(uintptr_t)src;
+  zs.avail_in = (uInt)len;
+  zs.next_out = (Bytef *)out->data + out->len;
+  zs.avail_out = (uInt)bound;
+  int rc = deflate(&zs, Z_FINISH);
+  if (rc == Z_STREAM_END) {
+    out->len += zs.total_out;
+    out->data[out->len] = '\0';
+  }
+  deflateEnd(&zs);
+  return rc == Z_STREAM_END ? 0 : -1;
+}
+
+int brotli_compress(const char *src, size_t len, struct md_buf *out) {
+  size_t bound = BrotliEncoderMaxCompressedSize(len);
+  if (bound == 0 || md_buf_reserve(out, bound) < 0)
+    return -1;
+  size_t n = bound;
+  if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_TEXT, len, (const uint8_t *)src, &n,
+                             (uint8_t *)out->data + out->len))
+    return -1;
+  out->len += n;
+  out->data[out->len] = '\0';
+  return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#include "mdparse.h"
+
+/* One-shot compressors for response bodies. Each appends the compressed
+ * form of len bytes at src to out and returns 0, or -1 on failure. */
+int gzip_compress(const char *src, size_t len, struct md_buf *out);
+int brotli_compress(const char *src, size_t len, struct md_buf *out);
+
+#endif
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+#define WATCH_MASK                                                             \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct fc_node {
+  struct file_cache_entry e; /* first, so entries convert back to nodes */
+  char *key;
+  uint64_t hash;
+  int wd; /* -1 for absent paths */
+  /* One reference while in the table, one per request using the entry. */
+  unsigned refs;
+  char *data;
+  struct fc_node *hash_next;
+  struct fc_node *wd_next;
+  struct fc_node *lru_prev;
+  struct fc_node *lru_next;
+};
+
+struct file_cache {
+  pthread_mutex_t lock;
+  char root[PATH_MAX];
+  size_t max_files;
+  size_t nbuckets; /* a power of two */
+  struct fc_node **buckets;
+  struct fc_node **wd_buckets; /* the same nodes by watch descriptor */
+  struct fc_node *lru_head;
+  struct fc_node *lru_tail;
+  size_t entries;
+  size_t bytes;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t batches; /* inotify reads handled by the watcher */
+  int ifd;
+  pthread_t watcher;
+};
+
+static uint64_t hash_key(const char *s) {
+  uint64_t h = 1469598103934665603ULL;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static struct fc_node **wd_bucket(struct file_cache *c, int wd) {
+  return &c->wd_buckets[(size_t)wd & (c->nbuckets - 1)];
+}
+
+static void unref(struct fc_node *n) {
+  if (--n->refs > 0)
+    return;
+  if (n->e.fd >= 0)
+    close(n->e.fd);
+  free(n->data);
+  free(n->key);
+  free(n);
+}
+
+static bool wd_in_use(struct file_cache *c, int wd) {
+  for (struct fc_node *n = *wd_bucket(c, wd); n; n = n->wd_next)
+    if (n->wd == wd)
+      return true;
+  return false;
+}
+
+static void lru_unlink(struct file_cache *c, struct fc_node *n) {
+  if (n->lru_prev)
+    n->lru_prev->lru_next = n->lru_next;
+  else
+    c->lru_head = n->lru_next;
+  if (n->lru_next)
+    n->lru_next->lru_prev = n->lru_prev;
+  else
+    c->lru_tail = n->lru_prev;
+  n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_push(struct file_cache *c, struct fc_node *n) {
+  n->lru_next = c->lru_head;
+  if (c->lru_head)
+    c->lru_head->lru_prev = n;
+  c->lru_head = n;
+  if (!c->lru_tail)
+    c->lru_tail = n;
+}
+
+/* Takes n out of the table, dropping its watch when no other entry shares
+ * the inode. n is freed once the last request lets go. The lock must be
+ * held. */
+static void drop(struct file_cache *c, struct fc_node *n) {
+  struct fc_node **pp = &c->buckets[n->hash & (c->nbuckets - 1)];
+  while (*pp != n)
+    pp = &(*pp)->hash_next;
+  *pp = n->hash_next;
+  if (n->wd >= 0) {
+    pp = wd_bucket(c, n->wd);
+    while (*pp != n)
+      pp = &(*pp)->wd_next;
+    *pp = n->wd_next;
+    if (!wd_in_use(c, n->wd))
+      inotify_rm_watch(c->ifd, n->wd);
+  }
+  lru_unlink(c, n);
+  c->entries--;
+  if (n->data)
+    c->bytes -= (size_t)n->e.st.st_size;
+  unref(n);
+}
+
+static struct fc_node *find(struct file_cache *c, const char *key,
+                            uint64_t h) {
+  for (struct fc_node *n = c->buckets[h & (c->nbuckets - 1)]; n;
+       n = n->hash_next)
+    if (n->hash == h && strcmp(n->key, key) == 0)
+      return n;
+  return NULL;
+}
+
+static void *watch_main(void *arg) {
+  struct file_cache *c = arg;
+  char buf[16 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t n = read(c->ifd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&c->lock);
+    c->batches++;
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        while (c->lru_head) {
+          drop(c, c->lru_head);
+          c->invalidations++;
+        }
+        continue;
+      }
+      struct fc_node *next;
+      for (struct fc_node *e = *wd_bucket(c, ev->wd); e; e = next) {
+        next = e->wd_next;
+        if (e->wd == ev->wd) {
+          drop(c, e);
+          c->invalidations++;
+        }
+      }
+    }
+    pthread_mutex_unlock(&c->lock);
+    pthread_setcancelstate(oldstate, NULL);
+  }
+  return NULL;
+}
+
+struct file_cache *file_cache_create(const char *root, size_t max_files) {
+  if (max_files == 0)
+    return NULL;
+  struct file_cache *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->ifd = -1;
+  c->nbuckets = 16;
+  while (c->nbuckets < 2 * max_files)
+    c->nbuckets *= 2;
+  c->max_files = max_files;
+  c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+  c->wd_buckets = calloc(c->nbuckets, sizeof(*c->wd_buckets));
+  if (!c->buckets || !c->wd_buckets || !realpath(root, c->root))
+    goto fail;
+  /* Keys start with a slash, so the root must not end in one. */
+  if (strcmp(c->root, "/") == 0)
+    c->root[0] = '\0';
+  c->ifd = inotify_init1(IN_CLOEXEC);
+  if (c->ifd < 0)
+    goto fail;
+  pthread_mutex_init(&c->lock, NULL);
+  if (pthread_create(&c->watcher, NULL, watch_main, c) != 0) {
+    pthread_mutex_destroy(&c->lock);
+    goto fail;
+  }
+  return c;
+
+fail:
+  if (c->ifd >= 0)
+    close(c->ifd);
+  free(c->buckets);
+  free(c->wd_buckets);
+  free(c);
+  return NULL;
+}
+
+void file_cache_destroy(struct file_cache *c) {
+  if (!c)
+    return;
+  pthread_cancel(c->watcher);
+  pthread_join(c->watcher, NULL);
+  while (c->lru_head)
+    drop(c, c->lru_head);
+  close(c->ifd);
+  pthread_mutex_destroy(&c->lock);
+  free(c->buckets);
+  free(c->wd_buckets);
+  free(c);
+}
+
+const struct file_cache_entry *file_cache_get(struct file_cache *c,
+                                              const char *key, uint64_t gen) {
+  uint64_t h = hash_key(key);
+  pthread_mutex_lock(&c->lock);
+  struct fc_node *n = find(c, key, h);
+  if (n && n->e.gen != gen) {
+    drop(c, n);
+    c->invalidations++;
+    n = NULL;
+  }
+  if (!n) {
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+  }
+  c->hits++;
+  lru_unlink(c, n);
+  lru_push(c, n);
+  n->refs++;
+  pthread_mutex_unlock(&c->lock);
+  return &n->e;
+}
+
+/* Reads the whole of a small file into n. */
+static int load_data(struct fc_node *n) {
+  size_t size = (size_t)n->e.st.st_size, off = 0;
+  n->data = malloc(size ? size : 1);
+  if (!n->data)
+    return -1;
+  while (off < size) {
+    ssize_t r = pread(n->e.fd, n->data + off, size - off, (off_t)off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    off += (size_t)r;
+  }
+  n->e.data = n->data;
+  return 0;
+}
+
+const struct file_cache_entry *file_cache_put(struct file_cache *c,
+                                              const char *key, uint64_t gen,
+                                              int fd) {
+  pthread_mutex_lock(&c->lock);
+  uint64_t batches = c->batches;
+  pthread_mutex_unlock(&c->lock);
+
+  struct fc_node *n = calloc(1, sizeof(*n));
+  if (!n)
+    return NULL;
+  n->key = strdup(key);
+  n->hash = hash_key(key);
+  n->e.fd = fd;
+  n->e.gen = gen;
+  n->wd = -1;
+  if (!n->key)
+    goto fail;
+  if (fd >= 0) {
+    /* Watch first, then look: a change after this point is reported. */
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", c->root, key) >=
+        (int)sizeof(path))
+      goto fail;
+    n->wd = inotify_add_watch(c->ifd, path, WATCH_MASK);
+    if (n->wd < 0 || fstat(fd, &n->e.st) != 0 || !S_ISREG(n->e.st.st_mode) ||
+        (n->e.st.st_size <= (off_t)FILE_CACHE_SMALL && load_data(n) < 0))
+      goto fail;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  /* An event handled since the watch was added may have been about this
+   * file, and found nothing to drop yet. */
+  if (c->batches != batches) {
+    pthread_mutex_unlock(&c->lock);
+    goto fail;
+  }
+  struct fc_node *old = find(c, key, n->hash);
+  if (old)
+    drop(c, old);
+  while (c->entries >= c->max_files) {
+    drop(c, c->lru_tail);
+    c->evictions++;
+  }
+  struct fc_node **b = &c->buckets[n->hash & (c->nbuckets - 1)];
+  n->hash_next = *b;
+  *b = n;
+  if (n->wd >= 0) {
+    b = wd_bucket(c, n->wd);
+    n->wd_next = *b;
+    *b = n;
+  }
+  lru_push(c, n);
+  n->refs = 2;
+  c->entries++;
+  if (n->data)
+    c->bytes += (size_t)n->e.st.st_size;
+  c->insertions++;
+  pthread_mutex_unlock(&c->lock);
+  return &n->e;
+
+fail:
+  if (n->wd >= 0) {
+    pthread_mutex_lock(&c->lock);
+    if (!wd_in_use(c, n->wd))
+      inotify_rm_watch(c->ifd, n->wd);
+    pthread_mutex_unlock(&c->lock);
+  }
+  free(n->data);
+  free(n->key);
+  free(n);
+  return NULL;
+}
+
+void file_cache_release(struct file_cache *c,
+                        const struct file_cache_entry *e) {
+  pthread_mutex_lock(&c->lock);
+  unref((struct fc_node *)(void *)e);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void file_cache_stats(struct file_cache *c, struct file_cache_stats *out) {
+  memset(out, 0, sizeof(*out));
+  if (!c)
+    return;
+  pthread_mutex_lock(&c->lock);
+  out->hits = c->hits;
+  out->misses = c->misses;
+  out->insertions = c->insertions;
+  out->evictions = c->evictions;
+  out->invalidations = c->invalidations;
+  out->entries = c->entries;
+  out->bytes = c->bytes;
+  pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Per-process LRU cache of open static files, keyed by root-relative path.
+ * Each entry keeps the descriptor and its stat, and the whole contents of
+ * small files, so a hit costs no system call before the response goes
+ * out. Content changes are seen through an inotify watch on every cached
+ * file. Renames, creations and deletions are left to the caller, which
+ * passes a generation that changes with the directory tree (see
+ * tree_index_generation()); entries from another generation are stale. */
+struct file_cache;
+
+/* Files up to this size are kept in memory. */
+#define FILE_CACHE_SMALL (64u << 10)
+
+struct file_cache_entry {
+  int fd; /* -1 records that the path does not exist */
+  struct stat st;
+  const char *data; /* the contents of small files, else NULL */
+  uint64_t gen;     /* generation the entry was made in */
+};
+
+struct file_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t invalidations;
+  size_t entries;
+  size_t bytes; /* of small-file contents */
+};
+
+/* Holds up to max_files entries below root and starts the watcher thread.
+ * Returns NULL if max_files is 0 or inotify is unavailable. */
+struct file_cache *file_cache_create(const char *root, size_t max_files);
+void file_cache_destroy(struct file_cache *c);
+
+/* Returns the entry for key, which stays valid until file_cache_release(),
+ * or NULL on a miss. */
+const struct file_cache_entry *file_cache_get(struct file_cache *c,
+                                              const char *key, uint64_t gen);
+
+/* Caches fd, the open regular file at key, and returns its entry as
+ * file_cache_get() does; fd then belongs to the cache. Returns NULL, with
+ * fd still the caller's, if the file cannot be cached. A negative fd
+ * records that key does not exist. gen must be read before fd was opened. */
+const struct file_cache_entry *file_cache_put(struct file_cache *c,
+                                              const char *key, uint64_t gen,
+                                              int fd);
+
+void file_cache_release(struct file_cache *c,
+                        const struct file_cache_entry *e);
+
+void file_cache_stats(struct file_cache *c, struct file_cache_stats *out);
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_request.h"
+
+/* Throughput benchmark for http_request_parse(). A few typical request
+ * heads are parsed whole and fed in small segments, as they arrive over a
+ * slow connection, and for comparison with the scan mdserve used before:
+ * look for the blank line, sscanf the request line and search the head
+ * once per header read. Results are JSON lines like mdparse_bench's. */
+
+static const char head_curl[] = "GET /articoli/2019/ HTTP/1.1\r\n"
+                                "Host: localhost:8080\r\n"
+                                "User-Agent: curl/8.5.0\r\n"
+                                "Accept: */*\r\n"
+                                "\r\n";
+
+static const char head_browser[] =
+    "GET /articoli/2019/lambda-calcolo.md?ref=home HTTP/1.1\r\n"
+    "Host: archivio.example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/"
+    "avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://archivio.example.org/articoli/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: it-IT,it;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+    "Cookie: session=6f1c0a9e2b7d4e8f; theme=dark\r\n"
+    "\r\n";
+
+static const char head_conditional[] =
+    "GET /pdf/1962/issue_full.pdf HTTP/1.1\r\n"
+    "Host: archivio.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 "
+    "Firefox/125.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"5f3a-1c2b3d-4e\"\r\n"
+    "If-Modified-Since: Tue, 02 Jan 2024 10:00:00 GMT\r\n"
+    "Range: bytes=1048576-\r\n"
+    "If-Range: \"5f3a-1c2b3d-4e\"\r\n"
+    "\r\n";
+
+static const struct {
+  const char *name;
+  const char *head;
+} heads[] = {
+    {"curl", head_curl},
+    {"browser", head_browser},
+    {"conditional", head_conditional},
+};
+
+static const char *const wanted[] = {
+    "Connection",        "Accept-Encoding", "If-None-Match",
+    "If-Modified-Since", "Range",           "If-Range",
+};
+#define NWANTED (sizeof(wanted) / sizeof(wanted[0]))
+
+static volatile size_t sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* The header lookup mdserve used: walk the head's lines for name. */
+static int legacy_header(const char *head, const char *name, char *out,
+                         size_t outsz) {
+  size_t nlen = strlen(name);
+  const char *line = strchr(head, '\n');
+  while (line && *++line) {
+    const char *eol = strchr(line, '\n');
+    size_t llen = eol ? (size_t)(eol - line) : strlen(line);
+    if (llen > nlen && line[nlen] == ':' &&
+        strncasecmp(line, name, nlen) == 0) {
+      const char *v = line + nlen + 1;
+      const char *end = line + llen;
+      while (v < end && (*v == ' ' || *v == '\t'))
+        v++;
+      while (end > v && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+      size_t vlen = (size_t)(end - v);
+      if (vlen >= outsz)
+        vlen = outsz - 1;
+      memcpy(out, v, vlen);
+      out[vlen] = '\0';
+      return 1;
+    }
+    line = eol;
+  }
+  return 0;
+}
+
+static size_t parse_legacy(char *buf, size_t len) {
+  const char *crlf = memmem(buf, len, "\r\n\r\n", 4);
+  if (!crlf)
+    return 0;
+  size_t head = (size_t)(crlf - buf) + 4;
+  char saved = buf[head];
+  buf[head] = '\0';
+  char method[16], target[16384], value[16384];
+  int major = 0, minor = 0;
+  size_t n = (size_t)sscanf(buf, "%15s %16383s HTTP/%d.%d", method, target,
+                            &major, &minor);
+  for (size_t i = 0; i < NWANTED; i++)
+    if (legacy_header(buf, wanted[i], value, sizeof(value)))
+      n += strlen(value);
+  buf[head] = saved;
+  return head + n;
+}
+
+static size_t sum_request(const struct http_request *r) {
+  size_t n = r->head_len + r->target.len;
+  for (int h = 0; h < HTTP_NHEADERS; h++)
+    n += r->headers[h].len;
+  return n;
+}
+
+/* Parses buf once, growing the data seg bytes at a time (0: all at once). */
+static size_t parse_new(const char *buf, size_t len, size_t seg) {
+  struct http_request r;
+  http_request_init(&r, 16383);
+  if (seg == 0)
+    return http_request_parse(&r, buf, len, false) == HTTP_PARSE_DONE
+               ? sum_request(&r)
+               : 0;
+  for (size_t have = seg;; have += seg) {
+    if (have > len)
+      have = len;
+    if (http_request_parse(&r, buf, have, false) != HTTP_PARSE_INCOMPLETE)
+      break;
+    if (have == len)
+      return 0;
+  }
+  return sum_request(&r);
+}
+
+int main(int argc, char **argv) {
+  long iters = 1000000;
+  int runs = 5;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      iters = atol(optarg);
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n iterations] [-r runs]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (iters < 1 || runs < 1) {
+    fputs("http_bench: iterations and runs must be positive\n", stderr);
+    return 1;
+  }
+
+  static const struct {
+    const char *name;
+    size_t seg; /* SIZE_MAX selects the legacy scan */
+  } feeds[] = {{"whole", 0}, {"seg64", 64}, {"seg8", 8}, {"legacy", SIZE_MAX}};
+
+  for (size_t h = 0; h < sizeof(heads) / sizeof(heads[0]); h++) {
+    size_t len = strlen(heads[h].head);
+    char *buf = malloc(len + 1);
+    if (!buf)
+      return 1;
+    memcpy(buf, heads[h].head, len + 1);
+
+    for (size_t f = 0; f < sizeof(feeds) / sizeof(feeds[0]); f++) {
+      double best = 0;
+      for (int r = 0; r < runs; r++) {
+        size_t acc = 0;
+        double t0 = now();
+        for (long i = 0; i < iters; i++)
+          acc += feeds[f].seg == SIZE_MAX ? parse_legacy(buf, len)
+                                          : parse_new(buf, len, feeds[f].seg);
+        double t = now() - t0;
+        sink += acc;
+        if (r == 0 || t < best)
+          best = t;
+      }
+      printf("{\"head\":\"%s\",\"feed\":\"%s\",\"bytes\":%zu,"
+             "\"iterations\":%ld,\"ns_per_request\":%.1f,"
+             "\"mb_per_s\":%.1f}\n",
+             heads[h].name, feeds[f].name, len, iters,
+             best * 1e9 / (double)iters,
+             (double)len * (double)iters / best / 1e6);
+      fflush(stdout);
+    }
+    free(buf);
+  }
+  return 0;
+}
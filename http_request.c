@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_request.h"
+
+static const struct {
+  const char *name;
+  size_t len;
+} header_names[HTTP_NHEADERS] = {
+    [HTTP_HOST] = {"Host", 4},
+    [HTTP_CONNECTION] = {"Connection", 10},
+    [HTTP_ACCEPT_ENCODING] = {"Accept-Encoding", 15},
+    [HTTP_IF_NONE_MATCH] = {"If-None-Match", 13},
+    [HTTP_IF_MODIFIED_SINCE] = {"If-Modified-Since", 17},
+    [HTTP_RANGE] = {"Range", 5},
+    [HTTP_IF_RANGE] = {"If-Range", 8},
+};
+
+void http_request_init(struct http_request *r, size_t max_head) {
+  memset(r, 0, sizeof(*r));
+  r->max_head = max_head;
+}
+
+bool http_slice_eq(struct http_slice s, const char *str) {
+  size_t n = strlen(str);
+  return s.p && s.len == n && strncasecmp(s.p, str, n) == 0;
+}
+
+/* Token characters of RFC 9110, visible ASCII but the delimiters
+ * "(),/:;<=>?@[\]{}, as a bitmap of the codes below 64 and above. */
+static const uint64_t tchar_lo = 0x03ff6cfa00000000ULL;
+static const uint64_t tchar_hi = 0x57ffffffc7fffffeULL;
+
+static bool is_tchar(unsigned char c) {
+  return c < 64 ? (tchar_lo >> c) & 1 : c < 128 && (tchar_hi >> (c - 64)) & 1;
+}
+
+static bool is_space(char c) { return c == ' ' || c == '\t'; }
+
+/* method SP target [SP HTTP/d.d]; the version may be left out, as
+ * HTTP/0.9 clients do. */
+static enum http_parse_result parse_request_line(struct http_request *r,
+                                                 const char *p, size_t n) {
+  size_t i = 0;
+  while (i < n && is_tchar((unsigned char)p[i]))
+    i++;
+  if (i == 0 || i == n || !is_space(p[i]))
+    return HTTP_PARSE_BAD;
+  r->method = (struct http_slice){p, i};
+  while (i < n && is_space(p[i]))
+    i++;
+
+  size_t t = i;
+  while (i < n && !is_space(p[i]))
+    i++;
+  if (i == t)
+    return HTTP_PARSE_BAD;
+  r->target = (struct http_slice){p + t, i - t};
+  const char *q = memchr(r->target.p, '?', r->target.len);
+  size_t plen = q ? (size_t)(q - r->target.p) : r->target.len;
+  r->path = (struct http_slice){r->target.p, plen};
+  if (q)
+    r->query = (struct http_slice){q + 1, r->target.len - plen - 1};
+
+  while (i < n && is_space(p[i]))
+    i++;
+  if (i == n) {
+    r->major = 0;
+    r->minor = 9;
+    return HTTP_PARSE_DONE;
+  }
+  if (n - i < 8 || memcmp(p + i, "HTTP/", 5) != 0 ||
+      p[i + 5] < '0' || p[i + 5] > '9' || p[i + 6] != '.' ||
+      p[i + 7] < '0' || p[i + 7] > '9')
+    return HTTP_PARSE_BAD;
+  r->major = p[i + 5] - '0';
+  r->minor = p[i + 7] - '0';
+  for (i += 8; i < n; i++)
+    if (!is_space(p[i]))
+      return HTTP_PARSE_BAD;
+  return HTTP_PARSE_DONE;
+}
+
+/* name ":" OWS value OWS. Folded continuation lines and whitespace before
+ * the colon are refused (RFC 9112, section 5). */
+static enum http_parse_result parse_field(struct http_request *r,
+                                          const char *p, size_t n) {
+  size_t i = 0;
+  while (i < n && is_tchar((unsigned char)p[i]))
+    i++;
+  if (i == 0 || i == n || p[i] != ':')
+    return HTTP_PARSE_BAD;
+  if (++r->fields > HTTP_MAX_FIELDS)
+    return HTTP_PARSE_TOO_LARGE;
+  size_t name_len = i++;
+  while (i < n && is_space(p[i]))
+    i++;
+  while (n > i && is_space(p[n - 1]))
+    n--;
+
+  for (int h = 0; h < HTTP_NHEADERS; h++) {
+    if (header_names[h].len == name_len && !r->headers[h].p &&
+        strncasecmp(p, header_names[h].name, name_len) == 0) {
+      r->headers[h] = (struct http_slice){p + i, n - i};
+      break;
+    }
+  }
+  return HTTP_PARSE_DONE;
+}
+
+enum http_parse_result http_request_parse(struct http_request *r,
+                                          const char *buf, size_t len,
+                                          bool eof) {
+  if (r->error)
+    return r->error;
+  for (;;) {
+    const char *nl = memchr(buf + r->scanned, '\n', len - r->scanned);
+    size_t end = nl ? (size_t)(nl - buf) : len;
+    if (end >= r->max_head)
+      return r->error = HTTP_PARSE_TOO_LARGE;
+    if (!nl) {
+      r->scanned = len;
+      if (!eof)
+        return HTTP_PARSE_INCOMPLETE;
+      /* At EOF the data ends the head, and an unterminated last line
+       * still counts. */
+      if (end == r->line_start) {
+        if (!r->in_headers)
+          return HTTP_PARSE_INCOMPLETE;
+        r->head_len = len;
+        return HTTP_PARSE_DONE;
+      }
+    }
+    size_t next = nl ? end + 1 : len;
+
+    const char *line = buf + r->line_start;
+    size_t n = end - r->line_start;
+    if (n > 0 && line[n - 1] == '\r')
+      n--;
+    enum http_parse_result rc = HTTP_PARSE_DONE;
+    if (!r->in_headers) {
+      /* Blank lines ahead of the request line are ignored. */
+      if (n > 0 && (rc = parse_request_line(r, line, n)) == HTTP_PARSE_DONE)
+        r->in_headers = true;
+    } else if (n == 0) {
+      r->head_len = next;
+      return HTTP_PARSE_DONE;
+    } else {
+      rc = parse_field(r, line, n);
+    }
+    if (rc != HTTP_PARSE_DONE)
+      return r->error = rc;
+    r->scanned = r->line_start = next;
+    if (!nl) {
+      r->head_len = len;
+      return HTTP_PARSE_DONE;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Incremental HTTP/1.x request head parser. It is fed the growing receive
+ * buffer and picks up where it stopped, so every byte is looked at once
+ * however the head is split across reads. Nothing is copied: the request
+ * line, its parts and the headers handlers care about are recorded as
+ * slices of the buffer, which must stay put until the request is served. */
+
+struct http_slice {
+  const char *p; /* NULL when absent */
+  size_t len;
+};
+
+/* Headers recorded by name; the first of repeated fields wins. */
+enum http_header {
+  HTTP_HOST,
+  HTTP_CONNECTION,
+  HTTP_ACCEPT_ENCODING,
+  HTTP_IF_NONE_MATCH,
+  HTTP_IF_MODIFIED_SINCE,
+  HTTP_RANGE,
+  HTTP_IF_RANGE,
+  HTTP_NHEADERS
+};
+
+/* Bounds on a head; larger ones get HTTP_PARSE_TOO_LARGE. */
+#define HTTP_MAX_FIELDS 100
+
+enum http_parse_result {
+  HTTP_PARSE_INCOMPLETE = 0, /* feed it more */
+  HTTP_PARSE_DONE = 1,       /* the head is complete, see head_len */
+  HTTP_PARSE_BAD = -1,       /* malformed: 400 */
+  HTTP_PARSE_TOO_LARGE = -2, /* over max_head or HTTP_MAX_FIELDS: 431 */
+};
+
+struct http_request {
+  struct http_slice method;
+  struct http_slice target; /* as sent, still percent-encoded */
+  struct http_slice path;   /* target up to '?' */
+  struct http_slice query;  /* after '?', p NULL without one */
+  int major, minor;         /* 0.9 when the version is left out */
+  struct http_slice headers[HTTP_NHEADERS];
+  size_t head_len; /* bytes of head, blank line included, once done */
+  /* Parser state. */
+  size_t max_head;
+  size_t scanned;    /* bytes of buf already looked at */
+  size_t line_start; /* where the line being scanned begins */
+  unsigned fields;
+  bool in_headers; /* the request line is behind us */
+  /* HTTP_PARSE_BAD or TOO_LARGE once the head has failed, returned again
+   * by later calls instead of parsing the failed line anew. */
+  enum http_parse_result error;
+};
+
+/* Starts a new request whose head may take up to max_head bytes. */
+void http_request_init(struct http_request *r, size_t max_head);
+
+/* Parses the head at the start of buf[0..len), resuming from the last
+ * call; buf may only have grown since, at the same address. At eof the end
+ * of the data also ends the head. Once it fails, it keeps failing the
+ * same way. */
+enum http_parse_result http_request_parse(struct http_request *r,
+                                          const char *buf, size_t len,
+                                          bool eof);
+
+/* Case-insensitive comparison of a slice with a C string. */
+bool http_slice_eq(struct http_slice s, const char *str);
+
+#endif
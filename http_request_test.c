@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "http_request.h"
+
+/* Checks the request head parser where it is called more than once on the
+ * same buffer, as the reactor and then a worker do: a head that failed has
+ * to fail the same way again, not be read anew from the line it failed
+ * on. */
+
+#define MAX_HEAD 8191
+
+static size_t ncases, nfailed;
+
+static const char *result_name(enum http_parse_result rc) {
+  switch (rc) {
+  case HTTP_PARSE_INCOMPLETE:
+    return "incomplete";
+  case HTTP_PARSE_DONE:
+    return "done";
+  case HTTP_PARSE_BAD:
+    return "bad";
+  case HTTP_PARSE_TOO_LARGE:
+    return "too large";
+  }
+  return "?";
+}
+
+/* Parses head twice with the same state, as a whole and then again, and
+ * expects want both times. */
+static void check(const char *what, const char *head, size_t len,
+                  enum http_parse_result want) {
+  struct http_request r;
+  http_request_init(&r, MAX_HEAD);
+  ncases++;
+  for (int pass = 1; pass <= 2; pass++) {
+    enum http_parse_result rc = http_request_parse(&r, head, len, false);
+    if (rc != want) {
+      fprintf(stderr, "%s: pass %d gave %s, not %s\n", what, pass,
+              result_name(rc), result_name(want));
+      nfailed++;
+      return;
+    }
+  }
+}
+
+static void check_str(const char *what, const char *head,
+                      enum http_parse_result want) {
+  check(what, head, strlen(head), want);
+}
+
+int main(void) {
+  check_str("valid head", "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+            HTTP_PARSE_DONE);
+  check_str("partial head", "GET / HTTP/1.1\r\nHost: a\r\n",
+            HTTP_PARSE_INCOMPLETE);
+  check_str("bad request line", "a:b / HTTP/1.1\r\nHost: a\r\n\r\n",
+            HTTP_PARSE_BAD);
+  check_str("bad version", "GET / HTTP/x\r\n\r\n", HTTP_PARSE_BAD);
+  check_str("bad field", "GET / HTTP/1.1\r\nHost a\r\n\r\n", HTTP_PARSE_BAD);
+  check_str("folded field", "GET / HTTP/1.1\r\nHost: a\r\n b\r\n\r\n",
+            HTTP_PARSE_BAD);
+
+  /* Counted fields: a malformed one among the most allowed is bad, one
+   * more than allowed too large. */
+  static char head[MAX_HEAD];
+  for (unsigned extra = 0; extra < 2; extra++) {
+    size_t n = (size_t)snprintf(head, sizeof(head), "GET / HTTP/1.1\r\n");
+    for (unsigned i = 0; i < HTTP_MAX_FIELDS - 1 + extra; i++)
+      n += (size_t)snprintf(head + n, sizeof(head) - n, "X-%u: v\r\n", i);
+    n += (size_t)snprintf(head + n, sizeof(head) - n, "%s\r\n\r\n",
+                          extra ? "X: v" : "malformed");
+    check(extra ? "one field too many" : "malformed last field", head, n,
+          extra ? HTTP_PARSE_TOO_LARGE : HTTP_PARSE_BAD);
+  }
+
+  /* A head longer than allowed, without a line end in sight. */
+  memset(head, 'a', sizeof(head));
+  memcpy(head, "GET /", 5);
+  check("overlong head", head, sizeof(head), HTTP_PARSE_TOO_LARGE);
+
+  if (nfailed) {
+    printf("http_request_test: %zu of %zu cases failed\n", nfailed, ncases);
+    return 1;
+  }
+  printf("http_request_test: %zu cases parsed alike twice\n", ncases);
+  return 0;
+}
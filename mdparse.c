@@ -1,218 +1,497 @@
 #define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define BUFFER_SIZE 8192
+#include "mdparse.h"
 
-static void html_escape(const char *in, char *out, size_t out_sz) {
-  size_t i = 0, j = 0;
-  while (in[i] && j + 7 < out_sz) {
-    switch (in[i]) {
-    case '&':
-      if (j + 5 < out_sz) {
-        memcpy(out + j, "&amp;", 5);
-        j += 5;
+int md_buf_reserve(struct md_buf *b, size_t extra) {
+  if (b->len + extra + 1 <= b->cap)
+    return 0;
+  size_t ncap = b->cap ? b->cap : 4096;
+  while (ncap < b->len + extra + 1)
+    ncap *= 2;
+  char *p = realloc(b->data, ncap);
+  if (!p)
+    return -1;
+  b->data = p;
+  b->cap = ncap;
+  return 0;
+}
+
+int md_buf_append(struct md_buf *b, const char *s, size_t n) {
+  if (md_buf_reserve(b, n) < 0)
+    return -1;
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+  return 0;
+}
+
+int md_buf_printf(struct md_buf *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0 || md_buf_reserve(b, (size_t)n) < 0)
+    return -1;
+  va_start(ap, fmt);
+  vsnprintf(b->data + b->len, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  b->len += (size_t)n;
+  return 0;
+}
+
+void md_buf_free(struct md_buf *b) {
+  free(b->data);
+  b->data = NULL;
+  b->len = b->cap = 0;
+}
+
+/* Lines are rendered straight into the output buffer: each line reserves
+ * its worst case up front and is then written without further checks. A
+ * lone "*" becomes "<em></em>", the largest growth of any source byte. */
+#define LINE_EXPANSION 9
+#define LINE_SLACK 64
+
+/* Text scanning: the renderer copies runs of plain text in bulk and only
+ * looks at the bytes below one at a time. The scanners return the length
+ * of the run at s free of them. The SSE2 scanner is the x86-64 baseline,
+ * AVX2 is used when the CPU has it, and MDPARSE_SIMD=scalar|sse2|avx2 in
+ * the environment overrides the choice. */
+static const bool special[256] = {
+    ['&'] = true, ['<'] = true, ['>'] = true, ['"'] = true, ['*'] = true,
+    ['['] = true, [']'] = true, ['('] = true, [')'] = true, ['\\'] = true,
+};
+
+static size_t scan_scalar(const char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && !special[(unsigned char)s[i]])
+    i++;
+  return i;
+}
+
+#ifdef __SSE2__
+#include <immintrin.h>
+
+static int special_mask_sse2(__m128i v) {
+  __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('&'));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  return _mm_movemask_epi8(m);
+}
+
+static size_t scan_sse2(const char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    int mask = special_mask_sse2(
+        _mm_loadu_si128((const __m128i *)(const void *)(s + i)));
+    if (mask)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return i + scan_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static unsigned
+special_mask_avx2(__m256i v) {
+  __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&'));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+  return (unsigned)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *s,
+                                                        size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned mask = special_mask_avx2(
+        _mm256_loadu_si256((const __m256i *)(const void *)(s + i)));
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  /* The SSE2 tail is not VEX-encoded; clear the upper halves first to
+   * avoid the AVX-SSE transition stall. */
+  _mm256_zeroupper();
+  return i + scan_sse2(s + i, n - i);
+}
+#endif
+
+struct scanner {
+  const char *name;
+  size_t (*scan)(const char *s, size_t n);
+};
+
+static const struct scanner scanners[] = {
+    {"scalar", scan_scalar},
+#ifdef __SSE2__
+    {"sse2", scan_sse2},
+    {"avx2", scan_avx2},
+#endif
+};
+
+static const struct scanner *scanner = &scanners[0];
+
+static bool scanner_usable(const struct scanner *sc) {
+#ifdef __SSE2__
+  if (sc->scan == scan_avx2)
+    return __builtin_cpu_supports("avx2");
+#endif
+  (void)sc;
+  return true;
+}
+
+int md_select_scanner(const char *name) {
+  size_t count = sizeof(scanners) / sizeof(scanners[0]);
+  if (!name) {
+    /* The best usable scanner comes last. */
+    for (size_t i = count; i-- > 0;)
+      if (scanner_usable(&scanners[i])) {
+        scanner = &scanners[i];
+        return 0;
       }
+  }
+  for (size_t i = 0; name && i < count; i++)
+    if (strcmp(scanners[i].name, name) == 0 && scanner_usable(&scanners[i])) {
+      scanner = &scanners[i];
+      return 0;
+    }
+  return -1;
+}
+
+const char *md_scanner_name(void) { return scanner->name; }
+
+__attribute__((constructor)) static void init_scanner(void) {
+  const char *env = getenv("MDPARSE_SIMD");
+  if (!env || md_select_scanner(env) < 0)
+    md_select_scanner(NULL);
+}
+
+static size_t text_run(const char *s, const char *end) {
+  return scanner->scan(s, (size_t)(end - s));
+}
+
+static char *put(char *w, const char *s, size_t n) {
+  memcpy(w, s, n);
+  return w + n;
+}
+
+#define PUT_LIT(w, lit) put((w), (lit), sizeof(lit) - 1)
+
+static char *escape_char(char *w, char c) {
+  switch (c) {
+  case '&':
+    return PUT_LIT(w, "&amp;");
+  case '<':
+    return PUT_LIT(w, "&lt;");
+  case '>':
+    return PUT_LIT(w, "&gt;");
+  case '"':
+    return PUT_LIT(w, "&quot;");
+  default:
+    *w = c;
+    return w + 1;
+  }
+}
+
+/* Writes [s, end) with backslash escapes removed and HTML specials
+ * escaped, as used for emphasis bodies and link targets. */
+static char *escape_unescaped(char *w, const char *s, const char *end) {
+  while (s < end) {
+    size_t run = text_run(s, end);
+    w = put(w, s, run);
+    s += run;
+    if (s == end)
       break;
-    case '<':
-      if (j + 4 < out_sz) {
-        memcpy(out + j, "&lt;", 4);
-        j += 4;
-      }
+    if (*s == '\\' && s + 1 < end)
+      s++;
+    w = escape_char(w, *s++);
+  }
+  return w;
+}
+
+/* Returns the first ch in [s, end) that no backslash escapes, or NULL.
+ * Escapes are counted from s, which must not follow a backslash. */
+static const char *find_unescaped(const char *s, const char *end, char ch) {
+  for (const char *p = s; p < end; p++) {
+    p = memchr(p, ch, (size_t)(end - p));
+    if (!p)
+      return NULL;
+    const char *k = p;
+    while (k > s && k[-1] == '\\')
+      k--;
+    if ((p - k) % 2 == 0)
+      return p;
+  }
+  return NULL;
+}
+
+static size_t escaped_len(const char *s, const char *end) {
+  size_t n = 0;
+  for (; s < end; s++) {
+    if (*s == '\\' && s + 1 < end)
+      s++;
+    switch (*s) {
+    case '&':
+      n += 5;
       break;
+    case '<':
     case '>':
-      if (j + 4 < out_sz) {
-        memcpy(out + j, "&gt;", 4);
-        j += 4;
-      }
+      n += 4;
       break;
     case '"':
-      if (j + 6 < out_sz) {
-        memcpy(out + j, "&quot;", 6);
-        j += 6;
-      }
+      n += 6;
       break;
     default:
-      out[j++] = in[i];
+      n++;
       break;
     }
-    i++;
   }
-  out[j] = '\0';
+  return n;
 }
 
-static int is_escaped_at(const char *s, size_t pos) {
-  if (pos == 0)
-    return 0;
-  size_t k = pos, backslashes = 0;
-  while (k > 0 && s[k - 1] == '\\') {
-    backslashes++;
-    k--;
-  }
-  return (backslashes % 2) == 1;
-}
+/* Inline Markdown is tokenized in one pass. Emphasis and link openers go
+ * on a small stack: an emphasis tag is written when it opens, since an
+ * unclosed one runs to the end of the span anyway, while a "[" is written
+ * literally and turned into <a href="..."> once its "](url)" shows up. */
+#define MAX_OPEN 64
 
-static const char *find_unescaped(const char *s, size_t idx, char ch) {
-  for (size_t i = idx; s[i]; i++) {
-    if (s[i] == ch && !is_escaped_at(s, i))
-      return s + i;
-  }
-  return NULL;
+enum opener { OPEN_EM, OPEN_STRONG, OPEN_LINK, OPEN_DEAD };
+
+struct inline_state {
+  struct {
+    enum opener kind;
+    char *at; /* where a link's "[" was written */
+  } open[MAX_OPEN];
+  int depth;
+  /* No unescaped ')' follows this point, so link targets starting here
+   * or later need not be searched for again. */
+  const char *no_paren;
+  bool has_link;
+};
+
+static int find_open(const struct inline_state *st, enum opener kind) {
+  for (int i = st->depth; i-- > 0;)
+    if (st->open[i].kind == kind)
+      return i;
+  return -1;
 }
 
-static void unescape_backslashes(const char *src, char *dest, size_t dest_sz) {
-  size_t i = 0, j = 0;
-  while (src[i] && j + 1 < dest_sz) {
-    if (src[i] == '\\' && src[i + 1] != '\0') {
-      dest[j++] = src[++i];
-      i++;
-    } else {
-      dest[j++] = src[i++];
+/* Pops the openers from index i up, closing emphasis tags. Unmatched
+ * link openers simply stay the "[" already written. */
+static char *pop_to(struct inline_state *st, int i, char *w) {
+  while (st->depth > i) {
+    switch (st->open[--st->depth].kind) {
+    case OPEN_EM:
+      w = PUT_LIT(w, "</em>");
+      break;
+    case OPEN_STRONG:
+      w = PUT_LIT(w, "</strong>");
+      break;
+    case OPEN_LINK:
+    case OPEN_DEAD:
+      break;
     }
   }
-  dest[j] = '\0';
-}
-
-static void inline_format(const char *src, char *dest, size_t dest_sz) {
-  char esc[BUFFER_SIZE];
-  size_t i = 0, j = 0;
-
-  while (src[i] && j + 16 < dest_sz) {
-    if (src[i] == '\\' && src[i + 1]) {
-      char tmp[2] = {src[i + 1], 0};
-      html_escape(tmp, esc, sizeof(esc));
-      size_t el = strlen(esc);
-      if (j + el >= dest_sz)
-        break;
-      memcpy(dest + j, esc, el);
-      j += el;
-      i += 2;
-      continue;
-    }
+  return w;
+}
 
-    if (src[i] == '*' && src[i + 1] == '*' && !is_escaped_at(src, i)) {
-      size_t start = i + 2;
-      const char *endp = NULL;
-      for (size_t k = start; src[k]; k++) {
-        if (src[k] == '*' && src[k + 1] == '*' && !is_escaped_at(src, k)) {
-          endp = src + k;
-          break;
-        }
-      }
-      size_t len = endp ? (size_t)(endp - (src + start)) : strlen(src + start);
-      char inner[BUFFER_SIZE], unesc[BUFFER_SIZE];
-      snprintf(inner, sizeof(inner), "%.*s", (int)len, src + start);
-      unescape_backslashes(inner, unesc, sizeof(unesc));
-      html_escape(unesc, esc, sizeof(esc));
-      int n = snprintf(dest + j, dest_sz - j, "<strong>%s</strong>", esc);
-      if (n < 0)
-        break;
-      j += (size_t)n;
-      if (endp)
-        i = (size_t)(endp - src) + 2;
-      else
-        break;
-      continue;
-    }
+static char *push(struct inline_state *st, enum opener kind, char *w) {
+  if (st->depth == MAX_OPEN)
+    return kind == OPEN_STRONG ? PUT_LIT(w, "**")
+                               : put(w, kind == OPEN_EM ? "*" : "[", 1);
+  st->open[st->depth].kind = kind;
+  st->open[st->depth++].at = w;
+  switch (kind) {
+  case OPEN_EM:
+    return PUT_LIT(w, "<em>");
+  case OPEN_STRONG:
+    return PUT_LIT(w, "<strong>");
+  case OPEN_LINK:
+  case OPEN_DEAD:
+    break;
+  }
+  return PUT_LIT(w, "[");
+}
 
-    if (src[i] == '*' && !is_escaped_at(src, i)) {
-      size_t start = i + 1;
-      const char *endp = find_unescaped(src, start, '*');
-      size_t len = endp ? (size_t)(endp - (src + start)) : strlen(src + start);
-      char inner[BUFFER_SIZE], unesc[BUFFER_SIZE];
-      snprintf(inner, sizeof(inner), "%.*s", (int)len, src + start);
-      unescape_backslashes(inner, unesc, sizeof(unesc));
-      html_escape(unesc, esc, sizeof(esc));
-      int n = snprintf(dest + j, dest_sz - j, "<em>%s</em>", esc);
-      if (n < 0)
-        break;
-      j += (size_t)n;
-      if (endp)
-        i = (size_t)(endp - src) + 1;
-      else
-        break;
-      continue;
-    }
+/* Handles a run of n '*' at s and sets *used to how many it consumed.
+ * "**" closes an open strong or opens one; a single '*' does the same for
+ * em, and in a longer run an open em innermost is closed first, so
+ * "***a***" nests cleanly. */
+static char *emphasis(struct inline_state *st, size_t n, size_t *used,
+                      char *w) {
+  bool em_on_top = st->depth && st->open[st->depth - 1].kind == OPEN_EM;
+  enum opener kind = n >= 2 && !(em_on_top && n != 2) ? OPEN_STRONG : OPEN_EM;
+  *used = kind == OPEN_STRONG ? 2 : 1;
+  int i = find_open(st, kind);
+  return i >= 0 ? pop_to(st, i, w) : push(st, kind, w);
+}
 
-    char tmp[2] = {src[i++], 0};
-    html_escape(tmp, esc, sizeof(esc));
-    size_t el = strlen(esc);
-    if (j + el >= dest_sz)
-      break;
-    memcpy(dest + j, esc, el);
-    j += el;
+/* Handles the ']' at *sp. If it closes an open "[" and is followed by
+ * "(url)", the link text written since the "[" is moved right to make room
+ * for the start tag. Links do not nest, so older openers die. */
+static char *close_link(struct inline_state *st, const char **sp,
+                        const char *end, char *w) {
+  const char *s = *sp;
+  int i = find_open(st, OPEN_LINK);
+  const char *url = s + 1;
+  while (url < end && (*url == ' ' || *url == '\t'))
+    url++;
+  const char *close = NULL;
+  if (i >= 0 && url < end && *url == '(' &&
+      !(st->no_paren && url >= st->no_paren)) {
+    close = find_unescaped(url + 1, end, ')');
+    if (!close)
+      st->no_paren = url;
+  }
+  if (!close) {
+    if (i >= 0)
+      st->open[i].kind = OPEN_DEAD;
+    *sp = s + 1;
+    return PUT_LIT(w, "]");
   }
 
-  dest[j] = '\0';
-}
+  url++;
+  w = pop_to(st, i + 1, w);
+  char *at = st->open[i].at;
+  st->depth = i;
+  for (int k = 0; k < i; k++)
+    if (st->open[k].kind == OPEN_LINK)
+      st->open[k].kind = OPEN_DEAD;
 
-static void markdown_to_html(FILE *in, FILE *out) {
-  char line[BUFFER_SIZE], buf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+  size_t tag = strlen("<a href=\"\">") + escaped_len(url, close);
+  memmove(at + tag, at + 1, (size_t)(w - (at + 1)));
+  w += tag - 1;
+  char *t = PUT_LIT(at, "<a href=\"");
+  t = escape_unescaped(t, url, close);
+  PUT_LIT(t, "\">");
+  st->has_link = true;
+  *sp = close + 1;
+  return PUT_LIT(w, "</a>");
+}
 
-  while (fgets(line, sizeof(line), in)) {
-    line[strcspn(line, "\r\n")] = '\0';
+/* Formats the inline Markdown in [s, end): backslash escapes, **strong**,
+ * *em* and [text](url) links, which may nest in one another. Emphasis left
+ * open is closed at the end of the span. Runs in time linear in the span,
+ * whatever it holds. */
+static char *format_span(struct inline_state *st, char *w, const char *s,
+                         const char *end) {
+  while (s < end) {
+    size_t run = text_run(s, end);
+    w = put(w, s, run);
+    s += run;
+    if (s == end)
+      break;
 
-    if (line[0] == '#') {
-      int lvl = 0;
-      while (line[lvl] == '#')
-        lvl++;
-      const char *txt = line + lvl;
-      while (*txt == ' ')
-        txt++;
-      inline_format(txt, buf, sizeof(buf));
-      fprintf(out, "<h%d>%s</h%d>\n", lvl, buf, lvl);
-      continue;
+    switch (*s) {
+    case '\\':
+      if (s + 1 < end)
+        s++;
+      w = escape_char(w, *s++);
+      break;
+    case '*': {
+      size_t n = 1, used;
+      while (s + n < end && s[n] == '*' && n < 3)
+        n++;
+      w = emphasis(st, n, &used, w);
+      s += used;
+      break;
     }
-
-    if (line[0] == '\0') {
-      fputc('\n', out);
-      continue;
+    case '[':
+      w = push(st, OPEN_LINK, w);
+      s++;
+      break;
+    case ']':
+      w = close_link(st, &s, end, w);
+      break;
+    default:
+      w = escape_char(w, *s++);
+      break;
     }
+  }
+  return pop_to(st, 0, w);
+}
 
-    size_t i = 0;
-    const char *p = find_unescaped(line, i, '[');
-    if (p) {
-      const char *q = find_unescaped(line, (size_t)(p - line) + 1, ']');
-      size_t after_q = q ? (size_t)(q - line) + 1 : 0;
-      while (q && (line[after_q] == ' ' || line[after_q] == '\t'))
-        after_q++;
-      const char *r = q ? find_unescaped(line, after_q, '(') : NULL;
-      const char *s =
-          r ? find_unescaped(line, (size_t)(r - line) + 1, ')') : NULL;
-
-      if (q && r && s && q < r && r < s) {
-        char before[BUFFER_SIZE];
-        snprintf(before, sizeof(before), "%.*s", (int)(p - line), line);
-        inline_format(before, outbuf, sizeof(outbuf));
-        fputs(outbuf, out);
-
-        char linktxt[BUFFER_SIZE], linktxt_fmt[BUFFER_SIZE];
-        snprintf(linktxt, sizeof(linktxt), "%.*s", (int)(q - p - 1), p + 1);
-        inline_format(linktxt, linktxt_fmt, sizeof(linktxt_fmt));
-
-        char urlraw[BUFFER_SIZE], url_unesc[BUFFER_SIZE], url_attr[BUFFER_SIZE];
-        snprintf(urlraw, sizeof(urlraw), "%.*s", (int)(s - r - 1), r + 1);
-        unescape_backslashes(urlraw, url_unesc, sizeof(url_unesc));
-        html_escape(url_unesc, url_attr, sizeof(url_attr));
-        fprintf(out, "<a href=\"%s\">%s</a>", url_attr, linktxt_fmt);
-
-        char after[BUFFER_SIZE];
-        snprintf(after, sizeof(after), "%s", s + 1);
-        inline_format(after, outbuf, sizeof(outbuf));
-        fputs(outbuf, out);
-
-        fputc('\n', out);
-        continue;
-      }
-    }
+void inline_format(const char *src, char *dest, size_t dest_sz) {
+  if (dest_sz == 0)
+    return;
+  struct md_buf b = {0};
+  struct inline_state st = {0};
+  size_t n = strlen(src);
+  size_t len = 0;
+  if (md_buf_reserve(&b, n * LINE_EXPANSION) == 0) {
+    len = (size_t)(format_span(&st, b.data, src, src + n) - b.data);
+    if (len >= dest_sz)
+      len = dest_sz - 1;
+    memcpy(dest, b.data, len);
+  }
+  dest[len] = '\0';
+  md_buf_free(&b);
+}
 
-    inline_format(line, buf, sizeof(buf));
-    fprintf(out, "<p>%s</p>\n", buf);
+/* Renders one line, without its terminator, at w. */
+static char *render_line(char *w, const char *l, const char *e) {
+  struct inline_state st = {0};
+  if (l < e && *l == '#') {
+    const char *txt = l;
+    while (txt < e && *txt == '#')
+      txt++;
+    int lvl = (int)(txt - l);
+    while (txt < e && *txt == ' ')
+      txt++;
+    w += sprintf(w, "<h%d>", lvl);
+    w = format_span(&st, w, txt, e);
+    return w + sprintf(w, "</h%d>\n", lvl);
   }
+
+  if (l == e)
+    return PUT_LIT(w, "\n");
+
+  /* A line holding a link is written without the paragraph wrapper. */
+  char *start = PUT_LIT(w, "<p>");
+  w = format_span(&st, start, l, e);
+  if (!st.has_link)
+    return PUT_LIT(w, "</p>\n");
+  memmove(start - 3, start, (size_t)(w - start));
+  return PUT_LIT(w - 3, "\n");
 }
 
-int main(void) {
-  markdown_to_html(stdin, stdout);
+int markdown_to_html(const char *src, size_t len, struct md_buf *out) {
+  const char *end = src + len;
+  while (src < end) {
+    const char *nl = memchr(src, '\n', (size_t)(end - src));
+    const char *next = nl ? nl + 1 : end;
+    /* A line stops at its first CR or NUL as well. */
+    const char *e = nl ? nl : end;
+    const char *cut = memchr(src, '\r', (size_t)(e - src));
+    if (cut)
+      e = cut;
+    cut = memchr(src, '\0', (size_t)(e - src));
+    if (cut)
+      e = cut;
+
+    if (md_buf_reserve(out, (size_t)(e - src) * LINE_EXPANSION + LINE_SLACK) <
+        0)
+      return -1;
+    char *w = render_line(out->data + out->len, src, e);
+    out->len = (size_t)(w - out->data);
+    out->data[out->len] = '\0';
+    src = next;
+  }
   return 0;
 }
@@ -0,0 +1,35 @@
+#ifndef MDPARSE_H
+#define MDPARSE_H
+
+#include <stddef.h>
+
+/* Growable output buffer filled by the renderer. Zero-initialise before use
+ * and release with md_buf_free(). */
+struct md_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+int md_buf_reserve(struct md_buf *b, size_t extra);
+int md_buf_append(struct md_buf *b, const char *s, size_t n);
+int md_buf_printf(struct md_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void md_buf_free(struct md_buf *b);
+
+/* Formats a single line of inline Markdown (emphasis, escapes) into dest,
+ * always NUL-terminating it. */
+void inline_format(const char *src, char *dest, size_t dest_sz);
+
+/* Renders len bytes of Markdown from src and appends the HTML to out.
+ * Returns 0 on success, -1 if the output buffer could not grow. */
+int markdown_to_html(const char *src, size_t len, struct md_buf *out);
+
+/* Chooses the text scanner by name ("scalar", "sse2", "avx2"), or the best
+ * one the CPU supports for NULL. By default MDPARSE_SIMD from the
+ * environment decides. Not thread-safe: call before rendering. Returns -1
+ * if the scanner is unknown or unsupported here. */
+int md_select_scanner(const char *name);
+const char *md_scanner_name(void);
+
+#endif
@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdparse.h"
+
+/* Throughput benchmark for markdown_to_html(). Each corpus is generated
+ * from a fixed seed, rendered with every text scanner the CPU supports
+ * (whose outputs must match byte for byte) and timed over several runs.
+ * Results are written as one JSON object per line, so two commits can be
+ * compared with diff or jq. Linked with --wrap=malloc,realloc so the
+ * renderer's allocations can be counted. */
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t n);
+void *__real_realloc(void *p, size_t n);
+void *__wrap_malloc(size_t n);
+void *__wrap_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n) {
+  allocs++;
+  return __real_malloc(n);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+  allocs++;
+  return __real_realloc(p, n);
+}
+
+static uint64_t rng;
+
+static uint64_t next_rand(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t pick(size_t n) { return (size_t)(next_rand() % n); }
+
+static const char *const words[] = {
+    "lambda", "calcolo",   "funzione",   "termine",      "riduzione", "beta",
+    "tipo",   "the",       "of",         "and",          "normal",    "form",
+    "a",      "variabile", "astrazione", "applicazione", "is",        "in",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static void put_words(struct md_buf *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (i)
+      md_buf_append(b, " ", 1);
+    const char *w = words[pick(NWORDS)];
+    md_buf_append(b, w, strlen(w));
+  }
+}
+
+/* Paragraphs of plain sentences with the odd emphasis. */
+static void gen_prose(struct md_buf *b, size_t size) {
+  while (b->len < size) {
+    for (size_t s = 0, n = 3 + pick(4); s < n; s++) {
+      put_words(b, 8 + pick(10));
+      switch (pick(8)) {
+      case 0:
+        md_buf_append(b, " *", 2);
+        put_words(b, 2);
+        md_buf_append(b, "*", 1);
+        break;
+      case 1:
+        md_buf_append(b, " **", 3);
+        put_words(b, 1);
+        md_buf_append(b, "**", 2);
+        break;
+      default:
+        break;
+      }
+      md_buf_append(b, ". ", 2);
+    }
+    md_buf_append(b, "\n\n", 2);
+  }
+}
+
+static void gen_headings(struct md_buf *b, size_t size) {
+  while (b->len < size) {
+    md_buf_append(b, "######", 1 + pick(6));
+    md_buf_append(b, " ", 1);
+    put_words(b, 2 + pick(4));
+    md_buf_append(b, "\n", 1);
+    if (pick(3) == 0) {
+      put_words(b, 10);
+      md_buf_append(b, "\n", 1);
+    }
+  }
+}
+
+static void gen_links(struct md_buf *b, size_t size) {
+  while (b->len < size) {
+    for (size_t i = 0, n = 2 + pick(5); i < n; i++) {
+      put_words(b, 1 + pick(3));
+      md_buf_append(b, " [", 2);
+      put_words(b, 1 + pick(2));
+      md_buf_printf(b, "](https://lambdawiki.org/%s/%zu) ",
+                    words[pick(NWORDS)], pick(100000));
+    }
+    md_buf_append(b, "\n", 1);
+  }
+}
+
+/* Text where most bytes need escaping or are backslash escapes. */
+static void gen_escaped(struct md_buf *b, size_t size) {
+  static const char *const bits[] = {"\\*", "\\\\", "\\[", "\\]", "&",
+                                     "<",   ">",    "\"",  "\\(", "x"};
+  while (b->len < size) {
+    for (size_t i = 0, n = 20 + pick(40); i < n; i++) {
+      const char *s = bits[pick(sizeof(bits) / sizeof(bits[0]))];
+      md_buf_append(b, s, strlen(s));
+    }
+    md_buf_append(b, "\n", 1);
+  }
+}
+
+/* 256 KB lines of prose with inline markup. */
+static void gen_long_lines(struct md_buf *b, size_t size) {
+  while (b->len < size) {
+    size_t line_end = b->len + (256u << 10);
+    while (b->len < line_end) {
+      put_words(b, 12);
+      const char *tail = pick(4) ? ". " : " *e* [l](u) ";
+      md_buf_append(b, tail, strlen(tail));
+    }
+    md_buf_append(b, "\n", 1);
+  }
+}
+
+struct corpus {
+  const char *name;
+  void (*gen)(struct md_buf *b, size_t size);
+};
+
+static const struct corpus corpora[] = {
+    {"prose", gen_prose},         {"headings", gen_headings},
+    {"links", gen_links},         {"escaped", gen_escaped},
+    {"long_lines", gen_long_lines},
+};
+
+static const char *const scanner_names[] = {"scalar", "sse2", "avx2"};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  size_t size = 16u << 20;
+  int runs = 5;
+  const char *out_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:o:")) != -1) {
+    switch (opt) {
+    case 's':
+      size = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s corpus_mb] [-r runs] [-o results]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (size == 0 || runs < 1) {
+    fputs("mdparse_bench: corpus size and runs must be positive\n", stderr);
+    return 1;
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (!out) {
+    perror(out_path);
+    return 1;
+  }
+
+  int status = 0;
+  for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+    struct md_buf src = {0}, ref = {0};
+    rng = 0x9e3779b97f4a7c15ULL + c; /* same corpus whatever runs before */
+    corpora[c].gen(&src, size);
+
+    for (size_t s = 0; s < sizeof(scanner_names) / sizeof(scanner_names[0]);
+         s++) {
+      if (md_select_scanner(scanner_names[s]) < 0)
+        continue;
+
+      double best = 0;
+      unsigned long run_allocs = 0;
+      size_t out_len = 0;
+      for (int r = 0; r < runs; r++) {
+        struct md_buf html = {0};
+        unsigned long before = allocs;
+        double t0 = now();
+        if (markdown_to_html(src.data, src.len, &html) < 0) {
+          fputs("mdparse_bench: out of memory\n", stderr);
+          return 1;
+        }
+        double t = now() - t0;
+        run_allocs = allocs - before;
+        if (r == 0 || t < best)
+          best = t;
+        out_len = html.len;
+
+        /* Every scanner has to produce the first one's output. */
+        if (r == 0 && !ref.data) {
+          ref = html;
+          continue;
+        }
+        if (r == 0 && (html.len != ref.len ||
+                       memcmp(html.data, ref.data, html.len) != 0)) {
+          fprintf(stderr, "mdparse_bench: %s output differs with %s\n",
+                  corpora[c].name, scanner_names[s]);
+          status = 1;
+        }
+        md_buf_free(&html);
+      }
+
+      fprintf(out,
+              "{\"corpus\":\"%s\",\"scanner\":\"%s\",\"bytes\":%zu,"
+              "\"output_bytes\":%zu,\"runs\":%d,\"mb_per_s\":%.1f,"
+              "\"ns_per_byte\":%.3f,\"allocs_per_run\":%lu}\n",
+              corpora[c].name, scanner_names[s], src.len, out_len, runs,
+              (double)src.len / best / 1e6, best * 1e9 / (double)src.len,
+              run_allocs);
+      fflush(out);
+    }
+    md_buf_free(&src);
+    md_buf_free(&ref);
+  }
+  md_select_scanner(NULL);
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mdparse.h"
+
+/* Framed mode (-f, or MDSERVE_FRAMED=1 as set by mdserve's parser pool):
+ * each document arrives as "<length>\n" and that many bytes, and its HTML
+ * goes out the same way. Returns at EOF between documents. */
+static int serve_framed(void) {
+  struct md_buf in = {0}, out = {0};
+  size_t len;
+  while (scanf("%zu", &len) == 1 && getchar() == '\n') {
+    in.len = out.len = 0;
+    if (md_buf_reserve(&in, len) < 0 || fread(in.data, 1, len, stdin) != len)
+      return 1;
+    if (markdown_to_html(in.data, len, &out) < 0)
+      return 1;
+    printf("%zu\n", out.len);
+    if ((out.len && fwrite(out.data, 1, out.len, stdout) != out.len) ||
+        fflush(stdout) != 0)
+      return 1;
+  }
+  md_buf_free(&in);
+  md_buf_free(&out);
+  return feof(stdin) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  const char *framed = getenv("MDSERVE_FRAMED");
+  if ((argc > 1 && strcmp(argv[1], "-f") == 0) ||
+      (framed && strcmp(framed, "1") == 0))
+    return serve_framed();
+
+  struct md_buf in = {0}, out = {0};
+  size_t n;
+
+  do {
+    if (md_buf_reserve(&in, 65536) < 0) {
+      fputs("mdparse: out of memory\n", stderr);
+      return 1;
+    }
+    n = fread(in.data + in.len, 1, in.cap - in.len - 1, stdin);
+    in.len += n;
+  } while (n > 0);
+
+  if (markdown_to_html(in.data ? in.data : "", in.len, &out) < 0) {
+    fputs("mdparse: out of memory\n", stderr);
+    return 1;
+  }
+  if (out.len)
+    fwrite(out.data, 1, out.len, stdout);
+  md_buf_free(&in);
+  md_buf_free(&out);
+  return 0;
+}
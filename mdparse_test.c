@@ -0,0 +1,186 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mdparse.h"
+
+/* Checks that every text scanner the CPU supports renders the same HTML as
+ * the scalar one. Each document is placed so that it ends right before an
+ * unmapped page, so a scanner reading past the end of its input faults
+ * instead of passing. The cases put every special byte at every offset
+ * within two vector widths, in plain text, emphasis and links, end the
+ * document 0..63 bytes after it, try
+ * every other byte value the same way, and finish with random lines of
+ * mixed ASCII, specials and UTF-8. */
+
+#define MAX_DOC 4096
+
+static const char *const scanner_names[] = {"scalar", "sse2", "avx2"};
+#define NSCANNERS (sizeof(scanner_names) / sizeof(scanner_names[0]))
+
+static const char specials[] = "&<>\"*[]()\\";
+
+/* Plain text with one-, two-, three- and four-byte UTF-8 sequences; cut
+ * anywhere, so partial sequences occur as well. */
+static const char filler[] = "abc\xc3\xa8" "d\xe2\x82\xac" "e\xf0\x9d\x9b\x8c"
+                             "f g";
+
+static char *page_end; /* first byte of the guard page */
+static size_t ndocs, nfailed; /* documents, and mismatched renders */
+static int usable[NSCANNERS];
+
+static uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+static uint64_t next_rand(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t put_fill(char *p, size_t n, size_t phase) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = filler[(phase + i) % (sizeof(filler) - 1)];
+  return n;
+}
+
+static int render(const char *doc, size_t len, const char *name,
+                  struct md_buf *out) {
+  out->len = 0;
+  if (md_select_scanner(name) < 0 || markdown_to_html(doc, len, out) < 0)
+    return -1;
+  return 0;
+}
+
+/* Renders doc[0..len) with every usable scanner and compares each output
+ * with the scalar one. */
+static void check(const char *doc, size_t len, const char *what) {
+  static struct md_buf ref, out;
+  if (len > MAX_DOC)
+    abort();
+  /* The copy ends at the guard page. */
+  char *src = memcpy(page_end - len, doc, len);
+  ndocs++;
+  if (render(src, len, "scalar", &ref) < 0) {
+    fprintf(stderr, "%s: scalar render failed\n", what);
+    nfailed++;
+    return;
+  }
+  for (size_t s = 1; s < NSCANNERS; s++) {
+    if (!usable[s])
+      continue;
+    if (render(src, len, scanner_names[s], &out) < 0 || out.len != ref.len ||
+        memcmp(out.data, ref.data, ref.len) != 0) {
+      if (nfailed++ < 10)
+        fprintf(stderr, "%s: %s output differs from scalar (%zu vs %zu "
+                        "bytes)\n",
+                what, scanner_names[s], out.len, ref.len);
+    }
+  }
+}
+
+int main(void) {
+  long pagesz = sysconf(_SC_PAGESIZE);
+  size_t span = ((MAX_DOC + (size_t)pagesz - 1) / (size_t)pagesz + 1) *
+                (size_t)pagesz;
+  char *map = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  page_end = map + span - (size_t)pagesz;
+  if (mprotect(page_end, (size_t)pagesz, PROT_NONE) != 0) {
+    perror("mprotect");
+    return 1;
+  }
+
+  int checked = 0;
+  for (size_t s = 0; s < NSCANNERS; s++) {
+    usable[s] = md_select_scanner(scanner_names[s]) == 0;
+    if (usable[s])
+      checked++;
+    else
+      printf("mdparse_test: %s unsupported here, skipped\n",
+             scanner_names[s]);
+  }
+
+  char doc[MAX_DOC], what[128];
+  /* A special byte at offset k of a run, followed by tail more bytes of
+   * text, in plain text, emphasis, link text and a link target. */
+  static const char *const contexts[][2] = {
+      {"", ""}, {"*", ""}, {"[", "](u)"}, {"[a](", ")"}};
+  for (size_t x = 0; x < sizeof(contexts) / sizeof(contexts[0]); x++)
+    for (const char *c = specials; *c; c++)
+      for (size_t k = 0; k < 64; k++)
+        for (size_t tail = 0; tail < 64; tail++) {
+          size_t n = strlen(contexts[x][0]);
+          memcpy(doc, contexts[x][0], n);
+          n += put_fill(doc + n, k, tail);
+          doc[n++] = *c;
+          n += put_fill(doc + n, tail, k);
+          memcpy(doc + n, contexts[x][1], strlen(contexts[x][1]));
+          n += strlen(contexts[x][1]);
+          snprintf(what, sizeof(what),
+                   "special 0x%02x at %zu, %zu after, in \"%s...%s\"",
+                   (unsigned char)*c, k, tail, contexts[x][0],
+                   contexts[x][1]);
+          check(doc, n, what);
+        }
+
+  /* Every other byte value, to catch vector compares that match too much
+   * or sign-extend high bytes. */
+  for (int b = 1; b < 256; b++)
+    for (size_t k = 0; k < 64; k++)
+      for (size_t tail = 0; tail < 64; tail += 21) {
+        size_t n = put_fill(doc, k, 0);
+        doc[n++] = (char)b;
+        n += put_fill(doc + n, tail, 0);
+        snprintf(what, sizeof(what), "byte 0x%02x at %zu, %zu after", b, k,
+                 tail);
+        check(doc, n, what);
+      }
+
+  /* Runs with nothing special in them, up to the end of the input. */
+  for (size_t n = 0; n < 128; n++) {
+    put_fill(doc, n, n);
+    snprintf(what, sizeof(what), "plain run of %zu", n);
+    check(doc, n, what);
+  }
+
+  /* Random documents of several lines. */
+  static const char *const bits[] = {
+      "&",  "<",        ">",           "\"",  "*",  "**", "[",
+      "]",  "(",        ")",           "\\",  "\\*", "\n", "\n\n",
+      "# ", "\xc3\xa8", "\xe2\x82\xac", " ",  "x",  "[a](b)",
+  };
+  for (int d = 0; d < 2000; d++) {
+    size_t n = 0, want = 1 + (size_t)(next_rand() % 600);
+    while (n < want) {
+      if (next_rand() % 3 == 0) {
+        const char *b = bits[next_rand() % (sizeof(bits) / sizeof(bits[0]))];
+        size_t l = strlen(b);
+        memcpy(doc + n, b, l);
+        n += l;
+      } else {
+        n += put_fill(doc + n, (size_t)(next_rand() % 70), next_rand() % 64);
+      }
+    }
+    snprintf(what, sizeof(what), "random document %d", d);
+    check(doc, n, what);
+  }
+
+  munmap(map, span);
+  if (nfailed) {
+    printf("mdparse_test: %zu mismatched renders in %zu documents\n",
+           nfailed, ndocs);
+    return 1;
+  }
+  printf("mdparse_test: %zu documents identical across %d scanners\n", ndocs,
+         checked);
+  return 0;
+}
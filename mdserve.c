@@ -1,26 +1,458 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "compress.h"
+#include "file_cache.h"
+#include "http_request.h"
+#include "mdparse.h"
+#include "parser_pool.h"
+#include "render_cache.h"
+#include "search_index.h"
+#include "stats.h"
+#include "tree_index.h"
+#include "uring.h"
+
 #define BUFFER_SIZE 16384
+#define MAX_EVENTS 256
+#define URING_ENTRIES 1024
+#define URING_READ_SIZE 65536
+#define RESPONSE_MAX_IOV 16
+#define OUT_MAX_IOV 32
+#define MAX_RANGES 16
+#define REQUEST_TIMEOUT_SEC 10
+#define SEND_TIMEOUT_SEC 30
+#define ACCEPT_BACKOFF_SEC 1
+#define KEEPALIVE_TIMEOUT_SEC 5
+#define KEEPALIVE_MAX_REQUESTS 1000
+#define PARSER_TIMEOUT_SEC 10
+#define FILE_CACHE_FILES 1024
+#define STATS_PATH "/__stats"
+#define SEARCH_PATH "/search"
+#define SEARCH_RESULTS 20
+#define MAX_STATS_ALLOW 16
 #define CUSTOM_MSG                                                             \
   "<footer><hr><p>Fornito da... Assolutamente niente! Non c'è di "             \
   "che.</p><hr></footer>"
+#define HTML_HEAD                                                              \
+  "<!DOCTYPE html>\r\n"                                                        \
+  "<head>\r\n<meta charset=\"utf-8\"/>\r\n"                                    \
+  "</head>\r\n"
+#define BACK_LINK "<p><a href=\"/\">Ritorna all'inizio</a></p><hr>\n"
+#define PARSER_ERROR_MSG                                                       \
+  "<p>Errore: il parser markdown sembra avere problemi.</p>\n"
+
+/* An IPv4 network allowed to read the stats, in host byte order. */
+struct allow_rule {
+  uint32_t net;
+  uint32_t mask;
+};
+
+struct server_config {
+  const char *root;
+  int root_fd; /* O_PATH descriptor of root, requests resolve beneath it */
+  char *const *parser_argv; /* NULL selects the built-in renderer */
+  struct render_cache *cache;
+  struct tree_index *tree; /* per process, see tree_index_open() */
+  /* Full-text index behind SEARCH_PATH, watched per process. */
+  struct search_index *search;
+  /* Open static files, per process; NULL when off. */
+  struct file_cache *files;
+  size_t max_files;
+  /* Persistent parser processes, per process; NULL forks the parser for
+   * every document. */
+  struct parser_pool *pool;
+  int pool_size;
+  int parser_timeout; /* seconds per document in the pool */
+  int keepalive_timeout; /* seconds; 0 closes after every response */
+  /* Metrics shared by every process, NULL when -S is not given; served
+   * at STATS_PATH to the allowed networks. */
+  struct stats *stats;
+  struct allow_rule stats_allow[MAX_STATS_ALLOW];
+  int nstats_allow;
+  /* Access log shared by every process, NULL when -L is not given. */
+  struct access_log *log;
+  bool uring; /* the event loop waits on io_uring rather than epoll */
+};
+
+/* Output for a client, queued by the handlers in order and written by
+ * whoever owns the socket at the time: the handler itself in -m fork,
+ * otherwise a worker as far as the socket takes it without blocking and
+ * the reactor for the rest. Bytes are copied in or borrowed, files are
+ * sent from their descriptor, and a streaming parser's pipe yields its
+ * output until EOF. */
+enum out_kind {
+  OUT_BYTES,  /* p[0..len), or bytes.data[at..at+len) when copied */
+  OUT_FILE,   /* len bytes of fd from off */
+  OUT_SPLICE, /* len bytes known to be waiting in the pipe fd */
+  OUT_PIPE,   /* the pipe fd up to EOF, framed as chunks when chunked */
+};
+
+struct out_seg {
+  enum out_kind kind;
+  bool copied;
+  bool chunked;
+  const char *p;
+  size_t at;
+  int fd;
+  off_t off;
+  size_t len;
+};
+
+/* Released once the queue has been written: memory is freed, a file cache
+ * entry released and a plain fd closed. */
+struct out_hold {
+  char *mem;
+  int fd;
+  const struct file_cache_entry *entry;
+};
+
+struct out_queue {
+  struct out_seg *segs;
+  size_t head; /* first segment not yet written */
+  size_t nsegs;
+  size_t segs_cap;
+  struct md_buf bytes; /* copied bytes */
+  struct out_hold *holds;
+  size_t nholds;
+  size_t holds_cap;
+  bool failed; /* an allocation failed, the output is incomplete */
+};
+
+enum out_status {
+  OUT_DONE,      /* everything was written */
+  OUT_BLOCKED,   /* the socket is full */
+  OUT_PIPE_WAIT, /* the parser has not written anything more yet */
+  OUT_PIPE_EOF,  /* the parser's output is all out */
+  OUT_FAILED,
+};
+
+static struct out_seg *out_queue_add(struct out_queue *q, enum out_kind kind) {
+  if (q->failed)
+    return NULL;
+  if (q->nsegs == q->segs_cap) {
+    size_t cap = q->segs_cap ? q->segs_cap * 2 : 16;
+    struct out_seg *segs = realloc(q->segs, cap * sizeof(*segs));
+    if (!segs) {
+      q->failed = true;
+      return NULL;
+    }
+    q->segs = segs;
+    q->segs_cap = cap;
+  }
+  struct out_seg *s = &q->segs[q->nsegs++];
+  *s = (struct out_seg){.kind = kind, .fd = -1};
+  return s;
+}
+
+/* Inserts a segment ahead of everything not yet written. */
+static struct out_seg *out_queue_add_front(struct out_queue *q,
+                                           enum out_kind kind) {
+  if (q->head == 0) {
+    if (!out_queue_add(q, kind))
+      return NULL;
+    memmove(q->segs + 1, q->segs, (q->nsegs - 1) * sizeof(*q->segs));
+  } else {
+    q->head--;
+  }
+  struct out_seg *s = &q->segs[q->head];
+  *s = (struct out_seg){.kind = kind, .fd = -1};
+  return s;
+}
+
+/* Queues p[0..len) without copying it; it has to stay valid until the
+ * queue is reset, as string literals and held memory do. */
+static void out_queue_ref(struct out_queue *q, const void *p, size_t len) {
+  struct out_seg *s = len ? out_queue_add(q, OUT_BYTES) : NULL;
+  if (s) {
+    s->p = p;
+    s->len = len;
+  }
+}
+
+static void out_queue_copy(struct out_queue *q, const void *p, size_t len) {
+  if (len == 0 || q->failed)
+    return;
+  size_t at = q->bytes.len;
+  if (md_buf_append(&q->bytes, p, len) < 0) {
+    q->failed = true;
+    return;
+  }
+  /* Consecutive copies go out as one segment. */
+  struct out_seg *last = q->nsegs > q->head ? &q->segs[q->nsegs - 1] : NULL;
+  if (last && last->copied && last->at + last->len == at) {
+    last->len += len;
+    return;
+  }
+  struct out_seg *s = out_queue_add(q, OUT_BYTES);
+  if (s) {
+    s->copied = true;
+    s->at = at;
+    s->len = len;
+  }
+}
+
+static void out_queue_file(struct out_queue *q, int fd, off_t off,
+                           size_t len) {
+  struct out_seg *s = len ? out_queue_add(q, OUT_FILE) : NULL;
+  if (s) {
+    s->fd = fd;
+    s->off = off;
+    s->len = len;
+  }
+}
+
+static void out_queue_pipe(struct out_queue *q, int fd, bool chunked) {
+  struct out_seg *s = out_queue_add(q, OUT_PIPE);
+  if (s) {
+    s->fd = fd;
+    s->chunked = chunked;
+  }
+}
+
+static void out_hold_release(const struct server_config *cfg,
+                             const struct out_hold *h) {
+  free(h->mem);
+  if (h->entry)
+    file_cache_release(cfg->files, h->entry);
+  else if (h->fd >= 0)
+    close(h->fd);
+}
+
+/* Keeps mem, fd or entry until the queue is reset. */
+static void out_queue_hold(const struct server_config *cfg,
+                           struct out_queue *q, char *mem, int fd,
+                           const struct file_cache_entry *entry) {
+  struct out_hold h = {mem, fd, entry};
+  if (q->nholds == q->holds_cap) {
+    size_t cap = q->holds_cap ? q->holds_cap * 2 : 4;
+    struct out_hold *holds = realloc(q->holds, cap * sizeof(*holds));
+    if (!holds) {
+      /* Nothing of the queue goes out any more, so nothing borrows h. */
+      q->failed = true;
+      out_hold_release(cfg, &h);
+      return;
+    }
+    q->holds = holds;
+    q->holds_cap = cap;
+  }
+  q->holds[q->nholds++] = h;
+}
+
+/* Empties q for the next response and releases what it held. */
+static void out_queue_reset(const struct server_config *cfg,
+                            struct out_queue *q) {
+  for (size_t i = 0; i < q->nholds; i++)
+    out_hold_release(cfg, &q->holds[i]);
+  q->nholds = 0;
+  q->head = q->nsegs = 0;
+  q->failed = false;
+  /* An idle connection keeps no more than a small buffer. */
+  if (q->bytes.cap > BUFFER_SIZE)
+    md_buf_free(&q->bytes);
+  q->bytes.len = 0;
+}
+
+static void out_queue_free(const struct server_config *cfg,
+                           struct out_queue *q) {
+  out_queue_reset(cfg, q);
+  md_buf_free(&q->bytes);
+  free(q->segs);
+  free(q->holds);
+}
+
+/* Gathers the byte segments at the head of q into iov. Sets *more when
+ * other output follows them. */
+static int out_queue_iov(const struct out_queue *q, struct iovec *iov,
+                         int max, bool *more) {
+  int n = 0;
+  size_t i = q->head;
+  for (; i < q->nsegs && q->segs[i].kind == OUT_BYTES && n < max; i++) {
+    const struct out_seg *s = &q->segs[i];
+    iov[n].iov_base = (void *)(s->copied ? q->bytes.data + s->at : s->p);
+    iov[n++].iov_len = s->len;
+  }
+  *more = i < q->nsegs;
+  return n;
+}
+
+/* Drops n written bytes from the byte segments at the head of q. */
+static void out_queue_consume(struct out_queue *q, size_t n) {
+  while (n > 0) {
+    struct out_seg *s = &q->segs[q->head];
+    size_t k = n < s->len ? n : s->len;
+    if (s->copied)
+      s->at += k;
+    else
+      s->p += k;
+    s->len -= k;
+    n -= k;
+    if (s->len == 0)
+      q->head++;
+  }
+}
+
+/* Turns what the parser at the head of q has written so far into a splice
+ * of exactly that many bytes, sized with FIONREAD and framed as a chunk
+ * when chunked, so the data itself never passes through userspace. */
+static enum out_status out_queue_take_pipe(struct out_queue *q) {
+  struct out_seg *s = &q->segs[q->head];
+  int fd = s->fd;
+  bool chunked = s->chunked;
+  int avail = 0;
+  if (ioctl(fd, FIONREAD, &avail) < 0)
+    return OUT_FAILED;
+  if (avail <= 0) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) < 0)
+      return errno == EINTR ? OUT_DONE : OUT_FAILED;
+    if (pfd.revents & POLLIN)
+      return OUT_DONE; /* written meanwhile, look again */
+    if (!(pfd.revents & (POLLHUP | POLLERR)))
+      return OUT_PIPE_WAIT;
+    q->head++; /* hung up with nothing left: the parser is done */
+    return OUT_PIPE_EOF;
+  }
+  if (chunked && (s = out_queue_add_front(q, OUT_BYTES))) {
+    s->p = "\r\n";
+    s->len = 2;
+  }
+  if ((s = out_queue_add_front(q, OUT_SPLICE))) {
+    s->fd = fd;
+    s->len = (size_t)avail;
+  }
+  if (chunked) {
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%x\r\n", avail);
+    size_t at = q->bytes.len;
+    if (md_buf_append(&q->bytes, size, (size_t)n) < 0)
+      q->failed = true;
+    else if ((s = out_queue_add_front(q, OUT_BYTES))) {
+      s->copied = true;
+      s->at = at;
+      s->len = (size_t)n;
+    }
+  }
+  return q->failed ? OUT_FAILED : OUT_DONE;
+}
+
+/* Writes q to fd, adding the bytes to *sent: all of it on a blocking
+ * socket, as much as goes without blocking otherwise. Stops with
+ * OUT_PIPE_EOF once a parser's output is through, for the caller to
+ * finish the response. A short file fails the write, as anything less
+ * than the promised length would desynchronise a kept-alive connection. */
+static enum out_status out_queue_write(struct out_queue *q, int fd,
+                                       uint64_t *sent) {
+  while (!q->failed && q->head < q->nsegs) {
+    struct out_seg *s = &q->segs[q->head];
+    bool more = q->head + 1 < q->nsegs;
+    ssize_t w = 0;
+    switch (s->kind) {
+    case OUT_BYTES: {
+      struct iovec iov[OUT_MAX_IOV];
+      struct msghdr msg = {.msg_iov = iov};
+      msg.msg_iovlen = (size_t)out_queue_iov(q, iov, OUT_MAX_IOV, &more);
+      w = sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      if (w > 0)
+        out_queue_consume(q, (size_t)w);
+      break;
+    }
+    case OUT_FILE:
+      w = sendfile(fd, s->fd, &s->off, s->len);
+      if (w > 0 && (s->len -= (size_t)w) == 0)
+        q->head++;
+      break;
+    case OUT_SPLICE:
+      w = splice(s->fd, NULL, fd, NULL, s->len,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                     (more ? SPLICE_F_MORE : 0));
+      if (w > 0 && (s->len -= (size_t)w) == 0)
+        q->head++;
+      break;
+    case OUT_PIPE: {
+      enum out_status st = out_queue_take_pipe(q);
+      if (st != OUT_DONE)
+        return st;
+      continue;
+    }
+    }
+    if (w > 0) {
+      *sent += (uint64_t)w;
+      continue;
+    }
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return OUT_BLOCKED;
+    return OUT_FAILED;
+  }
+  return q->failed ? OUT_FAILED : OUT_DONE;
+}
+
+/* A forked parser whose output is streamed as the response body: its pipe
+ * is queued, and tail goes out once the parser is done. */
+struct parser_stream {
+  pid_t pid; /* 0 when there is none */
+  int pipe;
+  uint64_t start;
+  struct md_buf tail;
+};
+
+/* Per-request response state threaded through the handlers. */
+struct request {
+  int fd;
+  const struct server_config *cfg;
+  struct out_queue *out; /* where the response is queued */
+  int minor;       /* HTTP/1.<minor> from the request line */
+  bool keep_alive; /* the connection stays open after this response */
+  bool chunked;    /* the body goes out with Transfer-Encoding: chunked */
+  bool failed;     /* a write failed, the connection must be dropped */
+  const struct http_request *http; /* the parsed head */
+  char etag[96];          /* validators for the response, "" if none */
+  char last_modified[40];
+  const char *encoding; /* Content-Encoding of the body, NULL for none */
+  bool vary;            /* the body depends on Accept-Encoding */
+  bool ranges;          /* advertise Accept-Ranges: bytes */
+  char content_range[96]; /* Content-Range of a 206 or 416, "" if none */
+  int status;               /* of the response, for the stats */
+  enum stats_route route;
+  uint64_t sent; /* bytes written to the client */
+  uint64_t parser_ns; /* spent rendering Markdown, for the access log */
+  struct parser_stream stream;
+};
+
+/* Content codings mdserve can send, in order of preference. */
+enum encoding { ENC_IDENTITY, ENC_GZIP, ENC_BR };
 
 static void die(const char *fmt, ...) {
   va_list ap;
@@ -31,34 +463,187 @@ static void die(const char *fmt, ...) {
   exit(1);
 }
 
-static void send_header(int fd, int code, const char *status, const char *ctype,
-                        ssize_t length) {
-  char header[BUFFER_SIZE];
-  int n = snprintf(header, sizeof(header),
+/* Queues a copy of buf[0..len) as part of the response. */
+static void req_send(struct request *req, const char *buf, size_t len) {
+  out_queue_copy(req->out, buf, len);
+}
+
+static int format_header(struct request *req, char *header, size_t cap,
+                         int code, const char *status, const char *ctype,
+                         ssize_t length) {
+  /* A body of unknown length is chunked on HTTP/1.1 and delimited by
+   * closing the connection on HTTP/1.0. */
+  if (length < 0 && req->keep_alive) {
+    if (req->minor >= 1)
+      req->chunked = true;
+    else
+      req->keep_alive = false;
+  }
+  req->status = code;
+  /* multipart/byteranges carries its own boundary parameter instead. */
+  bool multipart = strncmp(ctype, "multipart/", 10) == 0;
+  int n = snprintf(header, cap,
                    "HTTP/1.1 %d %s\r\n"
-                   "Content-Type: %s; charset=utf-8\r\n"
-                   "Connection: close\r\n",
-                   code, status, ctype);
+                   "Content-Type: %s%s\r\n"
+                   "Connection: %s\r\n",
+                   code, status, ctype, multipart ? "" : "; charset=utf-8",
+                   req->keep_alive ? "keep-alive" : "close");
   if (length >= 0)
-    n += snprintf(header + n, sizeof(header) - n, "Content-Length: %zd\r\n",
-                  length);
-  n += snprintf(header + n, sizeof(header) - n, "\r\n");
-  send(fd, header, n, 0);
+    n += snprintf(header + n, cap - n, "Content-Length: %zd\r\n", length);
+  if (req->chunked)
+    n += snprintf(header + n, cap - n, "Transfer-Encoding: chunked\r\n");
+  if (req->etag[0])
+    n += snprintf(header + n, cap - n, "ETag: %s\r\nLast-Modified: %s\r\n",
+                  req->etag, req->last_modified);
+  if (req->encoding)
+    n += snprintf(header + n, cap - n, "Content-Encoding: %s\r\n",
+                  req->encoding);
+  if (req->vary)
+    n += snprintf(header + n, cap - n, "Vary: Accept-Encoding\r\n");
+  if (req->ranges)
+    n += snprintf(header + n, cap - n, "Accept-Ranges: bytes\r\n");
+  if (req->content_range[0])
+    n += snprintf(header + n, cap - n, "Content-Range: %s\r\n",
+                  req->content_range);
+  n += snprintf(header + n, cap - n, "\r\n");
+  return n;
+}
+
+/* Queues the header of a response whose body follows in separate parts. */
+static void send_header(struct request *req, int code, const char *status,
+                        const char *ctype, ssize_t length) {
+  char header[BUFFER_SIZE];
+  int n = format_header(req, header, sizeof(header), code, status, ctype,
+                        length);
+  req_send(req, header, (size_t)n);
+}
+
+/* Queues part of a response body, framed as a chunk when chunked. */
+static void send_body(struct request *req, const char *buf, size_t len) {
+  if (!req->chunked) {
+    req_send(req, buf, len);
+    return;
+  }
+  if (len == 0)
+    return;
+  char size[32];
+  int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+  req_send(req, size, (size_t)n);
+  req_send(req, buf, len);
+  out_queue_ref(req->out, "\r\n", 2);
+}
+
+static void end_body(struct request *req) {
+  if (req->chunked)
+    out_queue_ref(req->out, "0\r\n\r\n", 5);
 }
 
-static void send_html_head(int fd) {
+/* A complete response gathered as a header and a list of body segments,
+ * queued with an exact Content-Length. Segments given to response_add()
+ * are borrowed and must stay valid until the response has been written,
+ * as string literals and held file contents do; response_add_buf() hands
+ * a buffer over instead. */
+struct response {
+  struct iovec iov[RESPONSE_MAX_IOV]; /* iov[0] is the header */
+  char *owned[RESPONSE_MAX_IOV]; /* freed once written, or NULL */
+  int niov;
+  size_t body_len;
+  bool overflow; /* a segment did not fit, the body is incomplete */
   char header[BUFFER_SIZE];
+};
+
+static void response_init(struct response *r) {
+  r->niov = 1;
+  r->body_len = 0;
+  r->overflow = false;
+}
+
+/* Returns -1 if the segment does not fit; response_send() then answers
+ * 500 rather than send a truncated body. */
+static int response_add(struct response *r, const void *data, size_t len) {
+  if (len == 0)
+    return 0;
+  if (r->niov == RESPONSE_MAX_IOV) {
+    r->overflow = true;
+    return -1;
+  }
+  r->iov[r->niov].iov_base = (void *)data;
+  r->iov[r->niov].iov_len = len;
+  r->owned[r->niov] = NULL;
+  r->niov++;
+  r->body_len += len;
+  return 0;
+}
+
+static int response_add_str(struct response *r, const char *s) {
+  return response_add(r, s, strlen(s));
+}
+
+/* Adds the contents of b and takes them over, leaving b empty. */
+static int response_add_buf(struct response *r, struct md_buf *b) {
+  char *data = b->data;
+  size_t len = b->len;
+  *b = (struct md_buf){0};
+  if (len == 0 || response_add(r, data, len) < 0) {
+    free(data);
+    return len == 0 ? 0 : -1;
+  }
+  r->owned[r->niov - 1] = data;
+  return 0;
+}
+
+static void response_send(struct request *req, struct response *r, int code,
+                          const char *status, const char *ctype) {
+  if (r->overflow) {
+    /* Nothing of the intended response goes out, validators included. */
+    for (int i = 1; i < r->niov; i++)
+      free(r->owned[i]);
+    response_init(r);
+    req->encoding = NULL;
+    req->etag[0] = '\0';
+    req->content_range[0] = '\0';
+    code = 500;
+    status = "Internal Server Error";
+    ctype = "text/plain";
+  }
+  int n = format_header(req, r->header, sizeof(r->header), code, status,
+                        ctype, (ssize_t)r->body_len);
+  req_send(req, r->header, (size_t)n);
+  for (int i = 1; i < r->niov; i++) {
+    out_queue_ref(req->out, r->iov[i].iov_base, r->iov[i].iov_len);
+    if (r->owned[i])
+      out_queue_hold(req->cfg, req->out, r->owned[i], -1, NULL);
+  }
+}
+
+static void send_error(struct request *req, int code, const char *status,
+                       const char *msg) {
+  struct response resp;
+  response_init(&resp);
+  if (msg)
+    response_add_str(&resp, msg);
+  response_send(req, &resp, code, status, "text/plain");
+}
+
+static void send_not_modified(struct request *req) {
+  req->status = 304;
+  char header[512];
   int n = snprintf(header, sizeof(header),
-                   "<!DOCTYPE html>\r\n"
-                   "<head>\r\n<meta charset=\"utf-8\"/>\r\n"
-                   "</head>\r\n");
-  send(fd, header, n, 0);
+                   "HTTP/1.1 304 Not Modified\r\n"
+                   "ETag: %s\r\n"
+                   "Last-Modified: %s\r\n"
+                   "%s"
+                   "Connection: %s\r\n\r\n",
+                   req->etag, req->last_modified,
+                   req->vary ? "Vary: Accept-Encoding\r\n" : "",
+                   req->keep_alive ? "keep-alive" : "close");
+  req_send(req, header, (size_t)n);
 }
 
-static void url_decode(const char *src, char *dest, size_t dsz) {
+static void url_decode(const char *src, size_t len, char *dest, size_t dsz) {
   size_t i = 0, j = 0;
-  while (src[i] && j + 1 < dsz) {
-    if (src[i] == '%' && isxdigit((unsigned char)src[i + 1]) &&
+  while (i < len && j + 1 < dsz) {
+    if (src[i] == '%' && i + 2 < len && isxdigit((unsigned char)src[i + 1]) &&
         isxdigit((unsigned char)src[i + 2])) {
       char hex[3] = {src[i + 1], src[i + 2], 0};
       dest[j++] = (char)strtol(hex, NULL, 16);
@@ -154,35 +739,205 @@ static int path_join(char *dst, size_t dstsz, const char *a, const char *b,
   return (int)pos;
 }
 
-static int path_is_within_root(const char *path, const char *root) {
-  if (!path || !root)
-    return 0;
-  size_t rootlen = strlen(root);
-  if (rootlen == 0)
-    return 0;
-  if (rootlen == 1 && root[0] == '/')
-    return 1;
-  if (root[rootlen - 1] == '/')
-    return strncmp(path, root, rootlen) == 0;
-  if (strncmp(path, root, rootlen) != 0)
-    return 0;
-  return path[rootlen] == '\0' || path[rootlen] == '/';
+/* Request paths are resolved against a directory fd for the root, opened
+ * once at startup, instead of realpath() on strings. Resolution never
+ * leaves the root, symlinks inside it are followed, and the caller gets
+ * both the open file and its canonical root-relative name ("/" or
+ * "/a/b.md"), which is what the tree index and render cache are keyed
+ * on. */
+#define MAX_SYMLINKS 40
+#define MAX_WALK_DEPTH 128
+
+/* Lexically normalizes path into rel. Fails if ".." climbs above the
+ * root or rel would not fit. */
+static int normalize_rel(const char *path, char *rel, size_t relsz) {
+  size_t len = 0;
+  for (const char *p = path; *p;) {
+    while (*p == '/')
+      p++;
+    const char *c = p;
+    while (*p && *p != '/')
+      p++;
+    size_t n = (size_t)(p - c);
+    if (n == 0 || (n == 1 && c[0] == '.'))
+      continue;
+    if (n == 2 && c[0] == '.' && c[1] == '.') {
+      if (len == 0)
+        return -1;
+      while (rel[--len] != '/')
+        ;
+      continue;
+    }
+    if (len + 1 + n >= relsz)
+      return -1;
+    rel[len++] = '/';
+    memcpy(rel + len, c, n);
+    len += n;
+  }
+  if (len == 0)
+    rel[len++] = '/';
+  rel[len] = '\0';
+  return 0;
+}
+
+/* Component-wise resolution with openat(), for paths through symlinks and
+ * kernels without openat2(). Every component is opened with O_NOFOLLOW;
+ * symlinks are expanded in place, and absolute targets or ".." above the
+ * root are refused as RESOLVE_BENEATH would. */
+static int walk_beneath(int root_fd, const char *path, int flags, char *rel,
+                        size_t relsz) {
+  char todo[BUFFER_SIZE], tmp[BUFFER_SIZE], name[NAME_MAX + 1];
+  int fds[MAX_WALK_DEPTH];
+  size_t names[MAX_WALK_DEPTH]; /* offset of each component in rel */
+  int depth = 0, links = 0, err = 0;
+  size_t len = 0;
+  bool want_dir = ends_with_slash(path);
+  if (safe_copy(todo, sizeof(todo), path) < 0) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  const char *p = todo;
+  while (*p) {
+    while (*p == '/')
+      p++;
+    const char *c = p;
+    while (*p && *p != '/')
+      p++;
+    size_t n = (size_t)(p - c);
+    if (n == 0 || (n == 1 && c[0] == '.'))
+      continue;
+    if (n == 2 && c[0] == '.' && c[1] == '.') {
+      if (depth == 0) {
+        err = EXDEV;
+        break;
+      }
+      close(fds[--depth]);
+      len = names[depth];
+      continue;
+    }
+    if (n > NAME_MAX || depth == MAX_WALK_DEPTH || len + 1 + n >= relsz) {
+      err = ENAMETOOLONG;
+      break;
+    }
+    memcpy(name, c, n);
+    name[n] = '\0';
+
+    int dir = depth ? fds[depth - 1] : root_fd;
+    int fd = openat(dir, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      err = errno;
+      if (fd >= 0)
+        close(fd);
+      break;
+    }
+    if (S_ISLNK(st.st_mode)) {
+      ssize_t tl = readlinkat(fd, "", tmp, sizeof(tmp) - 1);
+      close(fd);
+      if (tl <= 0 || ++links > MAX_SYMLINKS || tmp[0] == '/') {
+        err = tl <= 0 ? errno : links > MAX_SYMLINKS ? ELOOP : EXDEV;
+        break;
+      }
+      /* The rest of the walk becomes the target followed by the remainder,
+       * which is empty or starts with a slash. */
+      size_t rest = strlen(p);
+      if ((size_t)tl + rest >= sizeof(todo)) {
+        err = ENAMETOOLONG;
+        break;
+      }
+      memcpy(tmp + tl, p, rest + 1);
+      memcpy(todo, tmp, (size_t)tl + rest + 1);
+      p = todo;
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode) && (*p || want_dir)) {
+      close(fd);
+      err = ENOTDIR;
+      break;
+    }
+    names[depth] = len;
+    fds[depth++] = fd;
+    rel[len++] = '/';
+    memcpy(rel + len, name, n + 1);
+    len += n;
+  }
+
+  int fd = -1;
+  if (!err) {
+    /* O_PATH descriptors cannot be read, so the last component is opened
+     * again from its parent, refusing a symlink swapped in meanwhile. */
+    if (depth == 0)
+      fd = openat(root_fd, ".", flags);
+    else
+      fd = openat(depth > 1 ? fds[depth - 2] : root_fd,
+                  rel + names[depth - 1] + 1, flags | O_NOFOLLOW);
+    err = fd < 0 ? errno : 0;
+  }
+  while (depth > 0)
+    close(fds[--depth]);
+  if (len == 0)
+    rel[len++] = '/';
+  rel[len] = '\0';
+  errno = err;
+  return fd;
 }
 
-static void send_redirect_code(int fd, int code, const char *reason,
-                               const char *location) {
+/* Opens path (a request path, leading slash optional) beneath root_fd and
+ * stores its canonical root-relative name in rel. The common case is a
+ * single openat2() that refuses symlinks, so the lexical name is the
+ * canonical one; anything else takes the walk. Returns the fd or -1 with
+ * errno set. */
+static int open_beneath(int root_fd, const char *path, char *rel,
+                        size_t relsz) {
+  int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+  static bool no_openat2;
+  if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+    const char *p = path;
+    while (*p == '/')
+      p++;
+    struct open_how how = {
+        .flags = (uint64_t)flags,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS |
+                   RESOLVE_NO_SYMLINKS,
+    };
+    int fd = (int)syscall(SYS_openat2, root_fd, *p ? p : ".", &how,
+                          sizeof(how));
+    if (fd >= 0) {
+      if (normalize_rel(path, rel, relsz) == 0)
+        return fd;
+      close(fd);
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    if (errno == ENOSYS || errno == EPERM || errno == E2BIG)
+      __atomic_store_n(&no_openat2, true, __ATOMIC_RELAXED);
+    else if (errno != ELOOP && errno != EAGAIN)
+      return -1;
+  }
+  return walk_beneath(root_fd, path, flags, rel, relsz);
+}
+
+static void send_redirect_code(struct request *req, int code,
+                               const char *reason, const char *location) {
+  req->status = code;
   char hdr[BUFFER_SIZE];
   int n = snprintf(hdr, sizeof(hdr),
                    "HTTP/1.1 %d %s\r\n"
                    "Location: %s\r\n"
                    "Content-Length: 0\r\n"
-                   "Connection: close\r\n\r\n",
-                   code, reason, location);
-  send(fd, hdr, n, 0);
+                   "Connection: %s\r\n\r\n",
+                   code, reason, location,
+                   req->keep_alive ? "keep-alive" : "close");
+  if (n >= (int)sizeof(hdr)) {
+    req->keep_alive = false;
+    n = (int)sizeof(hdr) - 1;
+  }
+  req_send(req, hdr, (size_t)n);
 }
 
-static void send_redirect(int fd, const char *location) {
-  send_redirect_code(fd, 301, "Moved Permanently", location);
+static void send_redirect(struct request *req, const char *location) {
+  send_redirect_code(req, 301, "Moved Permanently", location);
 }
 
 static int parse_date_ymd(const char *s, char y[5], char m[3], char d[3]) {
@@ -206,27 +961,25 @@ static int parse_date_ymd(const char *s, char y[5], char m[3], char d[3]) {
   return 1;
 }
 
-static int query_get_param(const char *qs, const char *key, char *out,
-                           size_t outsz) {
+/* Finds key in the raw query string qs[0..len) and decodes its value into
+ * out. Returns 1 if it is present. */
+static int query_get_param(const char *qs, size_t len, const char *key,
+                           char *out, size_t outsz) {
   if (!qs || !key || !out || outsz == 0)
     return 0;
 
   size_t klen = strlen(key);
-  const char *p = qs;
+  const char *p = qs, *end = qs + len;
 
-  while (*p) {
-    const char *amp = strchr(p, '&');
-    size_t seglen = amp ? (size_t)(amp - p) : strlen(p);
+  while (p < end) {
+    const char *amp = memchr(p, '&', (size_t)(end - p));
+    size_t seglen = amp ? (size_t)(amp - p) : (size_t)(end - p);
 
     const char *eq = memchr(p, '=', seglen);
     if (eq) {
       size_t name_len = (size_t)(eq - p);
       if (name_len == klen && strncmp(p, key, klen) == 0) {
-        size_t vlen = seglen - name_len - 1;
-        if (vlen >= outsz)
-          vlen = outsz - 1;
-        memcpy(out, eq + 1, vlen);
-        out[vlen] = '\0';
+        url_decode(eq + 1, seglen - name_len - 1, out, outsz);
         return 1;
       }
     }
@@ -238,51 +991,22 @@ static int query_get_param(const char *qs, const char *key, char *out,
   return 0;
 }
 
-static void split_path_query(const char *in, char *path_out, size_t path_sz,
-                             char *query_out, size_t query_sz) {
-  if (query_out && query_sz)
-    query_out[0] = '\0';
-  if (!in) {
-    if (path_out && path_sz)
-      safe_copy(path_out, path_sz, "/");
-    return;
-  }
-
-  const char *q = strchr(in, '?');
-  if (!q) {
-    safe_copy(path_out, path_sz, in);
-    return;
-  }
-
-  size_t plen = (size_t)(q - in);
-  if (plen >= path_sz)
-    plen = path_sz - 1;
-  memcpy(path_out, in, plen);
-  path_out[plen] = '\0';
-
-  if (query_out && query_sz)
-    safe_copy(query_out, query_sz, q + 1);
-}
-
-static void maybe_handle_go_redirect(int fd, const char *path_only,
-                                     const char *query_only) {
+static bool maybe_handle_go_redirect(struct request *req, const char *path_only,
+                                     struct http_slice query) {
   if (strcmp(path_only, "/go") != 0)
-    return;
+    return false;
+  req->route = STATS_GO;
 
   char dval[64];
-  if (!query_get_param(query_only, "d", dval, sizeof(dval))) {
-    send_header(fd, 400, "Bad Request", "text/plain", -1);
-    send(fd, "missing d\n", 10, 0);
-    close(fd);
-    _exit(0);
+  if (!query_get_param(query.p, query.len, "d", dval, sizeof(dval))) {
+    send_error(req, 400, "Bad Request", "missing d\n");
+    return true;
   }
 
   char yyyy[5], mm[3], dd[3];
   if (!parse_date_ymd(dval, yyyy, mm, dd)) {
-    send_header(fd, 400, "Bad Request", "text/plain", -1);
-    send(fd, "invalid d (expected YYYY-MM-DD)\n", 32, 0);
-    close(fd);
-    _exit(0);
+    send_error(req, 400, "Bad Request", "invalid d (expected YYYY-MM-DD)\n");
+    return true;
   }
 
   char loc[BUFFER_SIZE];
@@ -290,345 +1014,838 @@ static void maybe_handle_go_redirect(int fd, const char *path_only,
            "https://archivio.unita.news/assets/derived/%s/%s/%s/issue_full.pdf",
            yyyy, mm, dd);
 
-  send_redirect(fd, loc);
-  close(fd);
-  _exit(0);
+  send_redirect(req, loc);
+  return true;
 }
 
-static int pick_page(const char *dirpath, char chosen[BUFFER_SIZE],
-                     bool *is_markdown) {
-  DIR *d = opendir(dirpath);
-  if (!d)
-    return 0;
-  struct dirent *ent;
-  char first_md[BUFFER_SIZE] = {0};
-  char first_html[BUFFER_SIZE] = {0};
-  bool has_index_md = false;
-  bool has_index_html = false;
-  while ((ent = readdir(d))) {
-    if (ent->d_name[0] == '.')
-      continue;
-    const char *dot = strrchr(ent->d_name, '.');
-    if (!dot)
-      continue;
-    if (strcmp(dot, ".md") == 0) {
-      if (strcmp(ent->d_name, "index.md") == 0) {
-        has_index_md = true;
-        continue;
-      }
-      if (!first_md[0] || strcmp(ent->d_name, first_md) < 0) {
-        safe_copy(first_md, sizeof(first_md), ent->d_name);
-      }
-    } else if (strcmp(dot, ".html") == 0) {
-      if (strcmp(ent->d_name, "index.html") == 0) {
-        has_index_html = true;
-        continue;
-      }
-      if (!first_html[0] || strcmp(ent->d_name, first_html) < 0) {
-        safe_copy(first_html, sizeof(first_html), ent->d_name);
-      }
-    }
-  }
-  closedir(d);
-  const char *pick = NULL;
-  bool pick_md = false;
-  if (has_index_md) {
-    pick = "index.md";
-    pick_md = true;
-  } else if (has_index_html) {
-    pick = "index.html";
-    pick_md = false;
-  } else if (first_md[0]) {
-    pick = first_md;
-    pick_md = true;
-  } else if (first_html[0]) {
-    pick = first_html;
-    pick_md = false;
-  }
-  if (pick) {
-    if (path_join(chosen, BUFFER_SIZE, dirpath, pick, false) < 0)
-      return 0;
+/* Looks up the page served for the directory rel_dir in the tree index and
+ * writes its root-relative path into chosen. */
+static int pick_page(struct tree_index *tree, const char *rel_dir,
+                     char chosen[BUFFER_SIZE], bool *is_markdown) {
+  int found = 0;
+  tree_index_rdlock(tree);
+  const struct tree_dir *d = tree_index_find(tree, rel_dir);
+  if (d && d->index_page &&
+      path_join(chosen, BUFFER_SIZE, rel_dir, d->index_page, false) >= 0) {
     if (is_markdown)
-      *is_markdown = pick_md;
-    return 1;
+      *is_markdown = d->index_is_markdown;
+    found = 1;
   }
-  return 0;
+  tree_index_unlock(tree);
+  return found;
 }
 
-static int stream_parser_output(int out_fd, const char *filepath,
-                                char *const parser_argv[]) {
-  int inpipe[2], outpipe[2];
-  if (pipe(inpipe) || pipe(outpipe))
+/* Appends everything readable from f to out. */
+static int read_fd(int f, struct md_buf *out) {
+  struct stat st;
+  if (fstat(f, &st) != 0 || md_buf_reserve(out, (size_t)st.st_size) < 0)
     return -1;
+  for (;;) {
+    if (md_buf_reserve(out, BUFFER_SIZE) < 0)
+      return -1;
+    ssize_t r = read(f, out->data + out->len, out->cap - out->len - 1);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return r == 0 ? 0 : -1;
+    out->len += (size_t)r;
+  }
+}
 
-  pid_t pid = fork();
-  if (pid < 0)
+/* Starts the external parser over in_fd, which becomes its stdin as is:
+ * the parser reads the file itself, so nothing is copied on the way in and
+ * there is no input pipe to fill while the output one backs up. Returns
+ * the read end of its output pipe and sets *pid, or returns -1. */
+static int spawn_parser(int in_fd, char *const parser_argv[], pid_t *pid) {
+  int outpipe[2];
+  /* CLOEXEC keeps parsers forked by other worker threads from inheriting
+   * our pipe end and holding the parser's stdout open. */
+  if (pipe2(outpipe, O_CLOEXEC))
     return -1;
 
-  if (pid == 0) {
-    dup2(inpipe[0], STDIN_FILENO);
+  *pid = fork();
+  if (*pid < 0) {
+    close(outpipe[0]);
+    close(outpipe[1]);
+    return -1;
+  }
+
+  if (*pid == 0) {
+    dup2(in_fd, STDIN_FILENO);
     dup2(outpipe[1], STDOUT_FILENO);
-    close(inpipe[0]);
-    close(inpipe[1]);
     close(outpipe[0]);
     close(outpipe[1]);
     execvp(parser_argv[0], parser_argv);
     _exit(127);
   }
 
-  close(inpipe[0]);
   close(outpipe[1]);
+  return outpipe[0];
+}
 
-  FILE *in = fopen(filepath, "rb");
-  if (!in) {
-    close(inpipe[1]);
-    close(outpipe[0]);
-    waitpid(pid, NULL, 0);
-    return -1;
-  }
-
-  char buf[BUFFER_SIZE];
-  size_t n;
-  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-    ssize_t off = 0;
-    while (off < (ssize_t)n) {
-      ssize_t w = write(inpipe[1], buf + off, n - off);
-      if (w < 0) {
-        fclose(in);
-        close(inpipe[1]);
-        close(outpipe[0]);
-        waitpid(pid, NULL, 0);
-        return -1;
-      }
-      off += w;
-    }
-  }
-  fclose(in);
-  close(inpipe[1]);
-
-  ssize_t r;
-  while ((r = read(outpipe[0], buf, sizeof(buf))) > 0) {
-    ssize_t off = 0;
-    while (off < r) {
-      ssize_t w = send(out_fd, buf + off, r - off, 0);
-      if (w <= 0)
-        break;
-      off += w;
-    }
-  }
-  close(outpipe[0]);
-
+/* Closes the parser's output pipe p and waits for it. Closing our end
+ * first lets a parser we stopped reading die of EPIPE instead of blocking
+ * the wait. Returns the parser's exit status, or -1. */
+static int reap_parser(pid_t pid, int p) {
+  close(p);
   int status = 0;
   waitpid(pid, &status, 0);
   return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
 }
 
-static void emit_subdirs_recursive(int fd, const char *fsroot,
-                                   const char *rel_dir, int depth) {
-  if (depth < 0)
-    return;
-
-  char dirp[BUFFER_SIZE];
-  if (safe_join(dirp, sizeof(dirp), fsroot, rel_dir) < 0)
-    return;
-
-  DIR *d = opendir(dirp);
-  if (!d)
-    return;
-
-  struct dirent *ent;
-  char fp[BUFFER_SIZE];
-  bool opened_ul = false;
+/* Runs the external parser over in_fd and appends its output to out.
+ * Returns the parser's exit status, or -1. */
+static int run_parser(int in_fd, char *const parser_argv[],
+                      struct md_buf *out) {
+  pid_t pid;
+  int p = spawn_parser(in_fd, parser_argv, &pid);
+  if (p < 0)
+    return -1;
+  int rc = read_fd(p, out);
+  int status = reap_parser(pid, p);
+  return rc < 0 ? -1 : status;
+}
 
-  while ((ent = readdir(d))) {
-    if (ent->d_name[0] == '.')
-      continue;
+/* Built-in renderer: converts the file with the linked mdparse library
+ * inside the request handler instead of forking an external parser. */
+static int render_markdown_builtin(int in_fd, struct md_buf *out) {
+  struct md_buf src = {0};
+  int rc = -1;
+  if (read_fd(in_fd, &src) == 0)
+    rc = markdown_to_html(src.data ? src.data : "", src.len, out);
+  md_buf_free(&src);
+  return rc;
+}
 
-    if (path_join(fp, sizeof(fp), dirp, ent->d_name, false) < 0)
-      continue;
-    struct stat st;
-    if (stat(fp, &st) != 0)
-      continue;
-    if (!S_ISDIR(st.st_mode))
-      continue;
+/* Renders the Markdown source open at f, described by st, into out,
+ * consulting the render cache under the key full first and filling it on a
+ * clean render. f stays open. Time spent in the parser is added to
+ * *parser_ns unless it is NULL. */
+static int render_markdown_fd(const struct server_config *cfg,
+                              const char *full, int f, const struct stat *st,
+                              struct md_buf *out, uint64_t *parser_ns) {
+  int hit = render_cache_get(cfg->cache, full, st, out);
+  if (hit != 0)
+    return hit < 0 ? -1 : 0;
+  if (lseek(f, 0, SEEK_SET) < 0)
+    return -1;
 
-    if (!opened_ul) {
-      send(fd, "<ul>\n", strlen("<ul>\n"), 0);
-      opened_ul = true;
-    }
+  size_t start = out->len;
+  bool timed = cfg->stats || cfg->log;
+  uint64_t t0 = timed ? stats_now_ns() : 0;
+  int rc;
+  if (cfg->pool) {
+    struct md_buf src = {0};
+    rc = read_fd(f, &src) == 0 ? parser_pool_render(cfg->pool,
+                                                    src.data ? src.data : "",
+                                                    src.len, out)
+                               : -1;
+    md_buf_free(&src);
+  } else if (cfg->parser_argv) {
+    rc = run_parser(f, cfg->parser_argv, out);
+  } else {
+    rc = render_markdown_builtin(f, out);
+  }
+  if (timed) {
+    uint64_t ns = stats_now_ns() - t0;
+    stats_parser(cfg->stats, ns);
+    if (parser_ns)
+      *parser_ns += ns;
+  }
+  if (rc == 0)
+    render_cache_put(cfg->cache, full, st, out->data + start,
+                     out->len - start);
+  return rc;
+}
 
-    char href[BUFFER_SIZE];
-    if (path_join(href, sizeof(href), rel_dir, ent->d_name, true) < 0)
-      continue;
+/* Appends the related-articles navigation for rel_dir, prebuilt by the tree
+ * index. A directory missing from the index gets the heading only. The
+ * tree must be locked. */
+static void emit_related(struct md_buf *out, const char *rel_dir,
+                         const struct tree_dir *d) {
+  if (d && d->nav) {
+    md_buf_append(out, d->nav, d->nav_len);
+  } else if (strcmp(rel_dir, "/") == 0) {
+    md_buf_append(out, "<h2>Articoli</h2>\n", strlen("<h2>Articoli</h2>\n"));
+  } else {
+    md_buf_append(out, "<h2>Articoli correlati</h2>\n",
+                  strlen("<h2>Articoli correlati</h2>\n"));
+  }
+}
 
-    char li[BUFFER_SIZE];
-    int n = snprintf(li, sizeof(li), "<li><a href=\"%s\">%s</a>", href,
-                     ent->d_name);
-    send(fd, li, n, 0);
+/* Appends the navigation for rel_dir and reports the hash and mtime of the
+ * fragment, which rendered pages fold into their validators. */
+static void emit_related_for_dir(struct md_buf *out, struct tree_index *tree,
+                                 const char *rel_dir, uint64_t *nav_hash,
+                                 time_t *nav_mtime) {
+  tree_index_rdlock(tree);
+  const struct tree_dir *d = tree_index_find(tree, rel_dir);
+  emit_related(out, rel_dir, d);
+  *nav_hash = d ? d->nav_hash : 0;
+  *nav_mtime = d ? (time_t)d->nav_mtime : 0;
+  tree_index_unlock(tree);
+}
 
-    emit_subdirs_recursive(fd, fsroot, href, depth - 1);
+/* Copies the value of header h into out, cut short to fit. Returns 1 if
+ * the header is present. */
+static int request_header(const struct request *req, enum http_header h,
+                          char *out, size_t outsz) {
+  struct http_slice v = req->http->headers[h];
+  if (!v.p)
+    return 0;
+  size_t vlen = v.len < outsz ? v.len : outsz - 1;
+  memcpy(out, v.p, vlen);
+  out[vlen] = '\0';
+  return 1;
+}
 
-    send(fd, "</li>\n", strlen("</li>\n"), 0);
+/* Reports whether the comma-separated header value v lists token, in any
+ * case. */
+static bool header_has_token(struct http_slice v, const char *token) {
+  const char *p = v.p, *end = v.p + v.len;
+  while (p && p < end) {
+    const char *comma = memchr(p, ',', (size_t)(end - p));
+    const char *e = comma ? comma : end;
+    while (p < e && (*p == ' ' || *p == '\t'))
+      p++;
+    const char *t = e;
+    while (t > p && (t[-1] == ' ' || t[-1] == '\t'))
+      t--;
+    if (http_slice_eq((struct http_slice){p, (size_t)(t - p)}, token))
+      return true;
+    p = comma ? comma + 1 : NULL;
   }
+  return false;
+}
 
-  if (opened_ul) {
-    send(fd, "</ul>\n", strlen("</ul>\n"), 0);
+/* Reports whether an If-None-Match list names etag, using the weak
+ * comparison: W/ prefixes are ignored on both sides. */
+static bool etag_listed(const char *list, const char *etag) {
+  if (strncmp(etag, "W/", 2) == 0)
+    etag += 2;
+  size_t elen = strlen(etag);
+  const char *p = list;
+  for (;;) {
+    p += strspn(p, " \t,");
+    if (!*p)
+      return false;
+    if (*p == '*')
+      return true;
+    if (strncmp(p, "W/", 2) == 0)
+      p += 2;
+    size_t len = strcspn(p, " \t,");
+    if (len == elen && strncmp(p, etag, elen) == 0)
+      return true;
+    p += len;
   }
-
-  closedir(d);
 }
 
-static void emit_related_for_dir(int fd, const char *fsroot,
-                                 const char *rel_dir) {
-  if (strcmp(rel_dir, "/") == 0) {
-    send(fd, "<h2>Articoli</h2>\n", strlen("<h2>Articoli</h2>\n"), 0);
+/* Fills in Last-Modified next to the ETag the caller set and answers a
+ * matching conditional GET with a 304. Returns true if it did. */
+static bool not_modified(struct request *req, time_t mtime) {
+  struct tm tm;
+  gmtime_r(&mtime, &tm);
+  strftime(req->last_modified, sizeof(req->last_modified),
+           "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+  char value[BUFFER_SIZE];
+  bool match;
+  if (request_header(req, HTTP_IF_NONE_MATCH, value, sizeof(value))) {
+    match = etag_listed(value, req->etag);
+  } else if (request_header(req, HTTP_IF_MODIFIED_SINCE, value,
+                            sizeof(value))) {
+    struct tm since = {0};
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &since);
+    match = end && mtime <= timegm(&since);
   } else {
-    send(fd, "<h2>Articoli correlati</h2>\n",
-         strlen("<h2>Articoli correlati</h2>\n"), 0);
+    return false;
   }
+  if (match)
+    send_not_modified(req);
+  return match;
+}
 
-  if (strcmp(rel_dir, "/") == 0) {
-    emit_subdirs_recursive(fd, fsroot, "/", 8);
-    return;
+static const char *const encoding_names[] = {"identity", "gzip", "br"};
+static const char *const encoding_suffixes[] = {"", ".gz", ".br"};
+
+/* Returns the set of codings (1 << enum encoding) the client accepts.
+ * Codings given q=0 are refused and "*" stands for any not listed. */
+static unsigned accepted_encodings(const struct request *req) {
+  char value[BUFFER_SIZE];
+  if (!request_header(req, HTTP_ACCEPT_ENCODING, value, sizeof(value)))
+    return 0;
+  int gzip = -1, br = -1, any = -1; /* -1 unlisted, 0 refused, 1 accepted */
+  char *save = NULL;
+  for (char *tok = strtok_r(value, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    tok += strspn(tok, " \t");
+    size_t n = strcspn(tok, " \t;");
+    const char *q = strstr(tok + n, "q=");
+    int ok = !(q && strtod(q + 2, NULL) <= 0);
+    if (n == 4 && strncasecmp(tok, "gzip", 4) == 0)
+      gzip = ok;
+    else if (n == 2 && strncasecmp(tok, "br", 2) == 0)
+      br = ok;
+    else if (n == 1 && *tok == '*')
+      any = ok;
   }
+  if (gzip < 0)
+    gzip = any == 1;
+  if (br < 0)
+    br = any == 1;
+  return (gzip ? 1u << ENC_GZIP : 0) | (br ? 1u << ENC_BR : 0);
+}
 
-  char dirp[BUFFER_SIZE];
-  if (safe_join(dirp, sizeof(dirp), fsroot, rel_dir) < 0)
-    return;
+static void page_etag(struct request *req, const struct stat *st,
+                      uint64_t nav_hash, enum encoding enc) {
+  snprintf(req->etag, sizeof(req->etag), "W/\"%jx-%jx-%jx-%jx%s%s\"",
+           (uintmax_t)st->st_ino, (uintmax_t)st->st_size,
+           (uintmax_t)st->st_mtim.tv_sec * 1000000000u +
+               (uintmax_t)st->st_mtim.tv_nsec,
+           (uintmax_t)nav_hash, enc != ENC_IDENTITY ? "-" : "",
+           enc != ENC_IDENTITY ? encoding_names[enc] : "");
+}
 
-  DIR *d = opendir(dirp);
-  if (!d)
-    return;
+/* Leaves out the validators of a response clients must not keep, such as
+ * a page whose render failed: it would stay cached after the parser is
+ * fixed, until the source or the navigation changes. */
+static void drop_validators(struct request *req) {
+  req->etag[0] = '\0';
+  req->last_modified[0] = '\0';
+}
 
-  send(fd, "<ul>\n", strlen("<ul>\n"), 0);
+/* Builds the complete page for the Markdown source open at f into out,
+ * with the same chrome serve_markdown_page() sends; full is its cache key.
+ * Returns 0, 1 if the render failed and out carries the parser error
+ * instead, or -1 if out could not grow. parser_ns is as for
+ * render_markdown_fd(). */
+static int assemble_page(const struct server_config *cfg, const char *full,
+                         int f, const struct stat *st, const char *rel_dir,
+                         const struct md_buf *nav, struct md_buf *out,
+                         uint64_t *parser_ns) {
+  const char *pre = strcmp(rel_dir, "/") != 0 ? BACK_LINK : "";
+  const char *post = CUSTOM_MSG "\n</body></html>";
+  md_buf_append(out, HTML_HEAD "<html><body>",
+                strlen(HTML_HEAD "<html><body>"));
+  md_buf_append(out, pre, strlen(pre));
+  bool rendered = render_markdown_fd(cfg, full, f, st, out, parser_ns) == 0;
+  if (!rendered)
+    md_buf_append(out, PARSER_ERROR_MSG, strlen(PARSER_ERROR_MSG));
+  if (nav->len)
+    md_buf_append(out, nav->data, nav->len);
+  if (md_buf_append(out, post, strlen(post)) < 0)
+    return -1;
+  return rendered ? 0 : 1;
+}
 
-  struct dirent *ent;
-  char fp[BUFFER_SIZE];
-  while ((ent = readdir(d))) {
-    if (ent->d_name[0] == '.')
-      continue;
-    if (path_join(fp, sizeof(fp), dirp, ent->d_name, false) < 0)
-      continue;
-    struct stat st;
-    if (stat(fp, &st) == 0 && S_ISDIR(st.st_mode)) {
-      char href[BUFFER_SIZE];
-      if (path_join(href, sizeof(href), rel_dir, ent->d_name, true) < 0)
-        continue;
-      char li[BUFFER_SIZE];
-      int n = snprintf(li, sizeof(li), "<li><a href=\"%s\">%s</a></li>\n", href,
-                       ent->d_name);
-      send(fd, li, n, 0);
+/* Sends a whole page compressed with enc. Compressed pages live in the
+ * render cache next to the bodies, keyed by coding and navigation as well
+ * as by source, so each version is compressed only once. A page that
+ * failed to render goes out uncompressed and uncached. Returns false if
+ * nothing was sent. */
+static bool serve_compressed_page(struct request *req, const char *full,
+                                  int f, const struct stat *st,
+                                  enum encoding enc,
+                                  uint64_t nav_hash, const char *rel_dir,
+                                  const struct md_buf *nav) {
+  const struct server_config *cfg = req->cfg;
+  char key[BUFFER_SIZE + 64];
+  snprintf(key, sizeof(key), "%s:%jx:%s", encoding_names[enc],
+           (uintmax_t)nav_hash, full);
+  struct md_buf z = {0};
+  int hit = render_cache_get(cfg->cache, key, st, &z);
+  if (hit == 0) {
+    struct md_buf page = {0};
+    int rc = assemble_page(cfg, full, f, st, rel_dir, nav, &page,
+                           &req->parser_ns);
+    if (rc < 0) {
+      md_buf_free(&page);
+      return false;
     }
+    if (rc > 0) {
+      drop_validators(req);
+      struct response resp;
+      response_init(&resp);
+      response_add_buf(&resp, &page);
+      response_send(req, &resp, 200, "OK", "text/html");
+      return true;
+    }
+    if ((enc == ENC_BR ? brotli_compress(page.data, page.len, &z)
+                       : gzip_compress(page.data, page.len, &z)) == 0) {
+      render_cache_put(cfg->cache, key, st, z.data, z.len);
+      hit = 1;
+    }
+    md_buf_free(&page);
   }
+  if (hit != 1) {
+    md_buf_free(&z);
+    return false;
+  }
+
+  req->encoding = encoding_names[enc];
+  struct response resp;
+  response_init(&resp);
+  response_add_buf(&resp, &z);
+  response_send(req, &resp, 200, "OK", "text/html");
+  return true;
+}
 
-  closedir(d);
-  send(fd, "</ul>\n", strlen("</ul>\n"), 0);
+/* Ends a page streamed from a parser once its output is through, or the
+ * write failed: reaps the parser and, unless the write failed, queues the
+ * error note for a parser that failed and the rest of the page. */
+static void finish_parser_stream(struct request *req) {
+  const struct server_config *cfg = req->cfg;
+  struct parser_stream *ps = &req->stream;
+  int rc = reap_parser(ps->pid, ps->pipe);
+  ps->pid = 0;
+  if (cfg->stats || cfg->log) {
+    req->parser_ns = stats_now_ns() - ps->start;
+    stats_parser(cfg->stats, req->parser_ns);
+  }
+  if (!req->failed) {
+    if (rc != 0)
+      send_body(req, PARSER_ERROR_MSG, strlen(PARSER_ERROR_MSG));
+    send_body(req, ps->tail.data, ps->tail.len);
+    end_body(req);
+  }
+  md_buf_free(&ps->tail);
 }
 
-static void serve_markdown_page(int fd, const char *fsroot, const char *rel_dir,
-                                const char *rel_file,
-                                char *const parser_argv[]) {
+/* Sends the page for the Markdown source open at f, which it takes over.
+ * rel_file is the source's path below the root. */
+static void serve_markdown_page(struct request *req, int f,
+                                const struct stat *st, const char *rel_dir,
+                                const char *rel_file) {
+  const struct server_config *cfg = req->cfg;
+  /* The cache is keyed by the full path, as the exporter's is. */
   char full[BUFFER_SIZE];
-  if (safe_join(full, sizeof(full), fsroot, rel_file) < 0) {
-    send_header(fd, 500, "Internal Server Error", "text/plain", -1);
-    send(fd, "path too long\n", 14, 0);
+  if (safe_join(full, sizeof(full), cfg->root, rel_file) < 0) {
+    close(f);
+    send_error(req, 500, "Internal Server Error", "path too long\n");
     return;
   }
 
-  send_header(fd, 200, "OK", "text/html", -1);
-  send_html_head(fd);
-  send(fd, "<html><body>", strlen("<html><body>"), 0);
-
-  if (strcmp(rel_dir, "/") != 0) {
-    const char *pre = "<p><a href=\"/\">Ritorna all'inizio</a></p><hr>\n";
-    send(fd, pre, strlen(pre), 0);
+  /* The page depends on its source and on the navigation of its directory;
+   * both are checked before anything is opened or rendered. */
+  struct md_buf nav = {0};
+  uint64_t nav_hash;
+  time_t nav_mtime;
+  emit_related_for_dir(&nav, cfg->tree, rel_dir, &nav_hash, &nav_mtime);
+  enum encoding enc = ENC_IDENTITY;
+  /* Only cached pages are compressed. */
+  if (cfg->cache) {
+    unsigned accepted = accepted_encodings(req);
+    req->vary = true;
+    if (accepted & (1u << ENC_BR))
+      enc = ENC_BR;
+    else if (accepted & (1u << ENC_GZIP))
+      enc = ENC_GZIP;
   }
-
-  if (stream_parser_output(fd, full, parser_argv) != 0) {
-    const char *msg =
-        "<p>Errore: il parser markdown sembra avere problemi.</p>\n";
-    send(fd, msg, strlen(msg), 0);
+  /* Without a cache a forked parser's output is streamed as it comes
+   * (chunked on keep-alive connections), and finish_parser_stream() adds
+   * the rest once it is through; everything else is gathered into one
+   * response with a Content-Length. A streamed page goes out before the
+   * parser could fail, so it has no validators. */
+  bool streamed = !cfg->cache && cfg->parser_argv && !cfg->pool;
+  if (!streamed) {
+    page_etag(req, st, nav_hash, enc);
+    time_t mtime = st->st_mtime > nav_mtime ? st->st_mtime : nav_mtime;
+    if (not_modified(req, mtime)) {
+      close(f);
+      md_buf_free(&nav);
+      return;
+    }
   }
 
-  emit_related_for_dir(fd, fsroot, rel_dir);
-
+  const char *pre = strcmp(rel_dir, "/") != 0 ? BACK_LINK : "";
   const char *post = CUSTOM_MSG "\n</body></html>";
-  send(fd, post, strlen(post), 0);
-}
 
-static void serve_directory_listing(int fd, const char *fsroot,
-                                    const char *rel) {
-  char dirp[BUFFER_SIZE];
-  if (safe_join(dirp, sizeof(dirp), fsroot, rel) < 0) {
-    send_header(fd, 500, "Internal Server Error", "text/plain", -1);
-    send(fd, "path too long\n", 14, 0);
+  if (streamed) {
+    send_header(req, 200, "OK", "text/html", -1);
+    send_body(req, HTML_HEAD "<html><body>",
+              strlen(HTML_HEAD "<html><body>"));
+    send_body(req, pre, strlen(pre));
+    md_buf_append(&nav, post, strlen(post));
+    struct parser_stream *ps = &req->stream;
+    ps->start = cfg->stats || cfg->log ? stats_now_ns() : 0;
+    ps->pipe = lseek(f, 0, SEEK_SET) == 0
+                   ? spawn_parser(f, cfg->parser_argv, &ps->pid)
+                   : -1;
+    close(f);
+    if (ps->pipe < 0) {
+      ps->pid = 0;
+      send_body(req, PARSER_ERROR_MSG, strlen(PARSER_ERROR_MSG));
+      send_body(req, nav.data, nav.len);
+      end_body(req);
+      md_buf_free(&nav);
+      return;
+    }
+    ps->tail = nav;
+    out_queue_pipe(req->out, ps->pipe, req->chunked);
     return;
   }
-  DIR *d = opendir(dirp);
 
-  send_header(fd, 200, "OK", "text/html", -1);
-  if (strcmp(rel, "/") == 0) {
-    send(fd, "<html><body>", strlen("<html><body>"), 0);
-  } else {
-    send(
-        fd, "<html><body><p><a href=\"/\">Ritorna all'inizio</a></p><hr>\n",
-        strlen("<html><body><p><a href=\"/\">Ritorna all'inizio</a></p><hr>\n"),
-        0);
+  if (enc != ENC_IDENTITY) {
+    if (serve_compressed_page(req, full, f, st, enc, nav_hash, rel_dir,
+                              &nav)) {
+      close(f);
+      md_buf_free(&nav);
+      return;
+    }
+    page_etag(req, st, nav_hash, ENC_IDENTITY);
   }
 
-  if (d) {
-    struct dirent *ent;
-    char fp[BUFFER_SIZE];
-    while ((ent = readdir(d))) {
-      if (ent->d_name[0] == '.')
-        continue;
-      if (path_join(fp, sizeof(fp), dirp, ent->d_name, false) < 0)
-        continue;
-      struct stat st;
-      if (stat(fp, &st) == 0 && !S_ISDIR(st.st_mode)) {
-        const char *dot = strrchr(ent->d_name, '.');
-        if (dot && (strcmp(dot, ".md") == 0 || strcmp(dot, ".html") == 0)) {
-          char href[BUFFER_SIZE];
-          if (path_join(href, sizeof(href), rel, ent->d_name, false) < 0)
-            continue;
-          char item[BUFFER_SIZE];
-          int n = snprintf(item, sizeof(item), "<p><a href=\"%s\">%s</a></p>\n",
-                           href, ent->d_name);
-          send(fd, item, n, 0);
-        }
+  struct md_buf body = {0};
+  bool rendered =
+      render_markdown_fd(cfg, full, f, st, &body, &req->parser_ns) == 0;
+  close(f);
+  if (!rendered)
+    drop_validators(req);
+
+  struct response resp;
+  response_init(&resp);
+  response_add_str(&resp, HTML_HEAD "<html><body>");
+  response_add_str(&resp, pre);
+  response_add_buf(&resp, &body);
+  if (!rendered)
+    response_add_str(&resp, PARSER_ERROR_MSG);
+  response_add_buf(&resp, &nav);
+  response_add_str(&resp, post);
+  response_send(req, &resp, 200, "OK", "text/html");
+}
+
+/* Appends the links to d's pages and its navigation, the part of a
+ * directory listing between the chrome. The tree must be locked. */
+static void emit_listing(struct md_buf *out, const char *rel,
+                         const struct tree_dir *d) {
+  if (!d)
+    return;
+  for (size_t i = 0; i < d->npages; i++)
+    md_buf_printf(out, "<p><a href=\"%s%s\">%s</a></p>\n", d->rel,
+                  d->pages[i], d->pages[i]);
+  emit_related(out, rel, d);
+}
+
+static void serve_directory_listing(struct request *req, const char *rel) {
+  struct md_buf page = {0};
+  struct tree_index *tree = req->cfg->tree;
+  tree_index_rdlock(tree);
+  emit_listing(&page, rel, tree_index_find(tree, rel));
+  tree_index_unlock(tree);
+
+  struct response resp;
+  response_init(&resp);
+  response_add_str(&resp, strcmp(rel, "/") == 0 ? "<html><body>"
+                                                : "<html><body>" BACK_LINK);
+  response_add_buf(&resp, &page);
+  response_add_str(&resp, CUSTOM_MSG "\n</body></html>");
+  response_send(req, &resp, 200, "OK", "text/html");
+}
+
+struct byte_range {
+  off_t first;
+  off_t last; /* inclusive */
+};
+
+static bool parse_offset(const char **p, off_t *out) {
+  if (!isdigit((unsigned char)**p))
+    return false;
+  char *end;
+  errno = 0;
+  long long v = strtoll(*p, &end, 10);
+  if (errno != 0)
+    return false;
+  *out = (off_t)v;
+  *p = end;
+  return true;
+}
+
+/* Parses a Range header value against a representation of size bytes.
+ * Returns the number of satisfiable ranges stored in out, 0 if none is
+ * satisfiable (416), or -1 if the header is to be ignored: another unit,
+ * bad syntax or more than max ranges. */
+static int parse_ranges(const char *v, off_t size, struct byte_range *out,
+                        int max) {
+  if (strncasecmp(v, "bytes=", 6) != 0)
+    return -1;
+  const char *p = v + 6;
+  int n = 0;
+  for (;;) {
+    p += strspn(p, " \t");
+    off_t first = 0, last = 0;
+    bool have_first = parse_offset(&p, &first);
+    if (*p++ != '-')
+      return -1;
+    bool have_last = parse_offset(&p, &last);
+    if (!have_first && !have_last)
+      return -1;
+    if (have_first && have_last && last < first)
+      return -1;
+
+    if (!have_first) {
+      /* A suffix range: the final last bytes. */
+      if (last > 0 && size > 0) {
+        first = last < size ? size - last : 0;
+        last = size - 1;
+        if (n == max)
+          return -1;
+        out[n++] = (struct byte_range){first, last};
       }
+    } else if (first < size) {
+      if (!have_last || last >= size)
+        last = size - 1;
+      if (n == max)
+        return -1;
+      out[n++] = (struct byte_range){first, last};
     }
 
-    emit_related_for_dir(fd, fsroot, rel);
-    closedir(d);
+    p += strspn(p, " \t");
+    if (!*p)
+      return n;
+    if (*p++ != ',')
+      return -1;
   }
+}
 
-  send(fd, CUSTOM_MSG "\n</body></html>", strlen(CUSTOM_MSG "\n</body></html>"),
-       0);
+/* Returns the ranges to serve as parse_ranges() does, or -1 when the whole
+ * representation should be sent: no Range, or an If-Range that no longer
+ * matches. If-Range needs the strong ETag or the exact Last-Modified. */
+static int requested_ranges(const struct request *req, const struct stat *st,
+                            struct byte_range *out) {
+  char value[BUFFER_SIZE];
+  if (!request_header(req, HTTP_RANGE, value, sizeof(value)))
+    return -1;
+  char cond[256];
+  if (request_header(req, HTTP_IF_RANGE, cond, sizeof(cond))) {
+    if (cond[0] == '"' || strncmp(cond, "W/", 2) == 0) {
+      if (strncmp(req->etag, "W/", 2) == 0 || strcmp(cond, req->etag) != 0)
+        return -1;
+    } else {
+      struct tm since = {0};
+      const char *end = strptime(cond, "%a, %d %b %Y %H:%M:%S GMT", &since);
+      if (!end || timegm(&since) != st->st_mtime)
+        return -1;
+    }
+  }
+  return parse_ranges(value, st->st_size, out, MAX_RANGES);
 }
 
-static void serve_file_raw(int fd, const char *fsroot, const char *rel,
-                           const char *ctype) {
-  char full[BUFFER_SIZE];
-  if (safe_join(full, sizeof(full), fsroot, rel) < 0) {
-    send_header(fd, 500, "Internal Server Error", "text/plain", -1);
-    send(fd, "path too long\n", 14, 0);
-    return;
+/* Queues len bytes of f starting at off; f has to stay open until the
+ * response has been written. */
+static void send_file_range(struct request *req, int f, off_t off,
+                            off_t len) {
+  out_queue_file(req->out, f, off, (size_t)len);
+}
+
+static int format_part_header(char *buf, size_t cap, const char *boundary,
+                              const char *ctype, const struct byte_range *r,
+                              off_t size) {
+  return snprintf(buf, cap,
+                  "\r\n--%s\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                  boundary, ctype, (intmax_t)r->first, (intmax_t)r->last,
+                  (intmax_t)size);
+}
+
+/* Sends several ranges as a multipart/byteranges body. Every part header
+ * is sized up front so the response keeps an exact Content-Length. */
+static void send_multipart_ranges(struct request *req, int f, off_t size,
+                                  const char *ctype,
+                                  const struct byte_range *ranges, int n) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char boundary[40];
+  snprintf(boundary, sizeof(boundary), "mdserve-%jx%09ld",
+           (intmax_t)now.tv_sec, now.tv_nsec);
+
+  char part[512];
+  off_t total = 0;
+  for (int i = 0; i < n; i++)
+    total += format_part_header(part, sizeof(part), boundary, ctype,
+                                &ranges[i], size) +
+             (ranges[i].last - ranges[i].first + 1);
+  char trailer[64];
+  int tlen = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+  total += tlen;
+
+  char mtype[96];
+  snprintf(mtype, sizeof(mtype), "multipart/byteranges; boundary=%s",
+           boundary);
+  send_header(req, 206, "Partial Content", mtype, total);
+  for (int i = 0; i < n; i++) {
+    int plen = format_part_header(part, sizeof(part), boundary, ctype,
+                                  &ranges[i], size);
+    req_send(req, part, (size_t)plen);
+    send_file_range(req, f, ranges[i].first,
+                    ranges[i].last - ranges[i].first + 1);
   }
+  req_send(req, trailer, (size_t)tlen);
+}
+
+/* A static file being sent: opened for this request only, or borrowed
+ * from the file cache together with the contents of a small file. */
+struct static_file {
+  int fd;
+  struct stat st;
+  const char *data; /* whole contents, or NULL to send from fd */
+  const struct file_cache_entry *cached;
+};
+
+static void static_from_cache(struct static_file *sf,
+                              const struct file_cache_entry *e) {
+  sf->fd = e->fd;
+  sf->st = e->st;
+  sf->data = e->data;
+  sf->cached = e;
+}
+
+static void static_close(const struct server_config *cfg,
+                         struct static_file *sf) {
+  if (sf->cached)
+    file_cache_release(cfg->files, sf->cached);
+  else
+    close(sf->fd);
+}
+
+/* Hands sf over to the response, which releases it once written. */
+static void static_hand_over(struct request *req, struct static_file *sf) {
+  out_queue_hold(req->cfg, req->out, NULL, sf->cached ? -1 : sf->fd,
+                 sf->cached);
+}
+
+/* Opens the sidecar of rel for coding e into sf. When file came from the
+ * file cache so does the sidecar, and a missing one is remembered. */
+static bool open_sidecar(const struct server_config *cfg,
+                         const struct static_file *file, const char *rel,
+                         enum encoding e, struct static_file *sf) {
+  char side[BUFFER_SIZE], side_rel[BUFFER_SIZE];
+  if (snprintf(side, sizeof(side), "%s%s", rel, encoding_suffixes[e]) >=
+      (int)sizeof(side))
+    return false;
+  const struct file_cache_entry *ce = NULL;
+  if (file->cached)
+    ce = file_cache_get(cfg->files, side, file->cached->gen);
+  int fd = -1;
+  if (!ce) {
+    fd = open_beneath(cfg->root_fd, side, side_rel, sizeof(side_rel));
+    if (file->cached && (fd >= 0 ? strcmp(side_rel, side) == 0
+                                 : errno == ENOENT))
+      ce = file_cache_put(cfg->files, side, file->cached->gen, fd);
+  }
+  if (ce) {
+    if (ce->fd >= 0) {
+      static_from_cache(sf, ce);
+      return true;
+    }
+    file_cache_release(cfg->files, ce);
+    return false;
+  }
+  if (fd < 0)
+    return false;
+  *sf = (struct static_file){.fd = fd};
+  if (fstat(fd, &sf->st) != 0) {
+    close(fd);
+    return false;
+  }
+  return true;
+}
 
-  int f = open(full, O_RDONLY);
-  if (f < 0) {
-    send_header(fd, 404, "Not Found", "text/plain", -1);
-    const char *msg = "404 not found\n";
-    send(fd, msg, strlen(msg), 0);
+/* Sends file, whose reference it takes over; rel names it for the sidecar
+ * lookup. Small cached files go out with their header in one write. */
+static void serve_static(struct request *req, struct static_file *file,
+                         const char *rel, const char *ctype) {
+  const struct server_config *cfg = req->cfg;
+  /* A precompressed sidecar (foo.html.br, foo.html.gz) at least as new as
+   * the file is sent in its place. */
+  unsigned accepted = accepted_encodings(req);
+  req->vary = true;
+  for (int e = ENC_BR; e > ENC_IDENTITY; e--) {
+    struct static_file side;
+    if (!(accepted & (1u << e)) ||
+        !open_sidecar(cfg, file, rel, (enum encoding)e, &side))
+      continue;
+    if (!S_ISREG(side.st.st_mode) ||
+        side.st.st_mtim.tv_sec < file->st.st_mtim.tv_sec ||
+        (side.st.st_mtim.tv_sec == file->st.st_mtim.tv_sec &&
+         side.st.st_mtim.tv_nsec < file->st.st_mtim.tv_nsec)) {
+      static_close(cfg, &side);
+      continue;
+    }
+    static_close(cfg, file);
+    *file = side;
+    req->encoding = encoding_names[e];
+    break;
+  }
+  const struct stat *st = &file->st;
+  snprintf(req->etag, sizeof(req->etag), "\"%jx-%jx-%jx\"",
+           (uintmax_t)st->st_ino, (uintmax_t)st->st_size,
+           (uintmax_t)st->st_mtim.tv_sec * 1000000000u +
+               (uintmax_t)st->st_mtim.tv_nsec);
+  if (not_modified(req, st->st_mtime)) {
+    static_close(cfg, file);
     return;
   }
-  struct stat st;
-  fstat(f, &st);
-  send_header(fd, 200, "OK", ctype, st.st_size);
-  off_t off = 0;
-  sendfile(fd, f, &off, st.st_size);
-  close(f);
+
+  req->ranges = true;
+  struct byte_range ranges[MAX_RANGES];
+  int nranges = requested_ranges(req, st, ranges);
+  off_t first = 0, len = st->st_size;
+  if (nranges == 0) {
+    snprintf(req->content_range, sizeof(req->content_range), "bytes */%jd",
+             (intmax_t)st->st_size);
+    send_error(req, 416, "Range Not Satisfiable", NULL);
+  } else if (nranges > 1) {
+    send_multipart_ranges(req, file->fd, st->st_size, ctype, ranges,
+                          nranges);
+  } else {
+    int code = 200;
+    const char *status = "OK";
+    if (nranges == 1) {
+      first = ranges[0].first;
+      len = ranges[0].last - first + 1;
+      snprintf(req->content_range, sizeof(req->content_range),
+               "bytes %jd-%jd/%jd", (intmax_t)first, (intmax_t)ranges[0].last,
+               (intmax_t)st->st_size);
+      code = 206;
+      status = "Partial Content";
+    }
+    if (file->data) {
+      struct response resp;
+      response_init(&resp);
+      response_add(&resp, file->data + first, (size_t)len);
+      response_send(req, &resp, code, status, ctype);
+    } else {
+      send_header(req, code, status, ctype, len);
+      send_file_range(req, file->fd, first, len);
+    }
+  }
+  static_hand_over(req, file);
+}
+
+/* Sends the file open at f, which it takes over. */
+static void serve_file_raw(struct request *req, int f, const struct stat *st,
+                           const char *rel, const char *ctype) {
+  struct static_file file = {.fd = f, .st = *st};
+  serve_static(req, &file, rel, ctype);
+}
+
+static const char *raw_content_type(const char *rel) {
+  const char *dot = strrchr(rel, '.');
+  return dot && strcmp(dot, ".html") == 0 ? "text/html"
+                                          : "application/octet-stream";
+}
+
+/* Turns a request path into a file cache key, or returns false for paths
+ * the cache leaves alone: directories, Markdown pages, and anything with a
+ * dot segment or hidden name, whose resolution the tree index does not
+ * follow. */
+static bool static_cache_key(const char *path, char *key, size_t cap) {
+  if (path[0] != '/' || strstr(path, "/.") || ends_with_slash(path) ||
+      normalize_rel(path, key, cap) < 0)
+    return false;
+  const char *dot = strrchr(key, '.');
+  return !dot || strcmp(dot, ".md") != 0;
 }
 
 static void dirname_rel(const char *rel_file, char out[BUFFER_SIZE]) {
@@ -644,141 +1861,1820 @@ static void dirname_rel(const char *rel_file, char out[BUFFER_SIZE]) {
   out[len] = '\0';
 }
 
-static void handle_client(int fd, const char *fsroot,
-                          char *const parser_argv[]) {
-  char buf[BUFFER_SIZE];
-  ssize_t r = recv(fd, buf, sizeof(buf) - 1, 0);
-  if (r <= 0) {
+/* Whether the client may read the stats: its address has to fall in one
+ * of the -S networks. */
+static bool stats_allowed(const struct request *req) {
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  if (getpeername(req->fd, (struct sockaddr *)&peer, &len) != 0 ||
+      peer.sin_family != AF_INET)
+    return false;
+  uint32_t a = ntohl(peer.sin_addr.s_addr);
+  for (int i = 0; i < req->cfg->nstats_allow; i++)
+    if ((a & req->cfg->stats_allow[i].mask) == req->cfg->stats_allow[i].net)
+      return true;
+  return false;
+}
+
+static void serve_stats(struct request *req) {
+  req->route = STATS_METRICS;
+  struct render_cache_stats rc;
+  render_cache_stats(req->cfg->cache, &rc);
+  struct md_buf body = {0};
+  stats_format(req->cfg->stats, req->cfg->cache ? &rc : NULL, &body);
+  struct response resp;
+  response_init(&resp);
+  response_add_buf(&resp, &body);
+  response_send(req, &resp, 200, "OK", "text/plain; version=0.0.4");
+}
+
+/* Appends s with the characters that are special in HTML text and
+ * attribute values escaped. */
+static void append_escaped(struct md_buf *out, const char *s) {
+  for (const char *run = s;; s++) {
+    const char *ent = NULL;
+    switch (*s) {
+    case '&': ent = "&amp;"; break;
+    case '<': ent = "&lt;"; break;
+    case '>': ent = "&gt;"; break;
+    case '"': ent = "&quot;"; break;
+    case '\0': break;
+    default: continue;
+    }
+    md_buf_append(out, run, (size_t)(s - run));
+    if (!ent)
+      return;
+    md_buf_append(out, ent, strlen(ent));
+    run = s + 1;
+  }
+}
+
+/* Appends the path s percent-encoded for a URL, keeping '/' and the
+ * unreserved characters of RFC 3986. The result has nothing left that is
+ * special in HTML. */
+static void append_url_path(struct md_buf *out, const char *s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (const char *run = s;; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch && (isalnum(ch) || strchr("/-._~", ch)))
+      continue;
+    md_buf_append(out, run, (size_t)(s - run));
+    if (!ch)
+      return;
+    char esc[3] = {'%', hex[ch >> 4], hex[ch & 15]};
+    md_buf_append(out, esc, sizeof(esc));
+    run = s + 1;
+  }
+}
+
+/* The search form and, given q, the best matching pages as links with
+ * their title and the start of their text. */
+static void serve_search(struct request *req, struct http_slice query) {
+  req->route = STATS_SEARCH;
+  char q[256] = "";
+  query_get_param(query.p, query.len, "q", q, sizeof(q));
+
+  struct md_buf page = {0};
+  md_buf_printf(&page, "<form action=\"%s\"><input type=\"search\" "
+                       "name=\"q\" value=\"", SEARCH_PATH);
+  append_escaped(&page, q);
+  md_buf_printf(&page, "\"> <input type=\"submit\" value=\"Cerca\">"
+                       "</form>\n");
+  if (q[0]) {
+    struct search_hit hits[SEARCH_RESULTS];
+    size_t total;
+    search_index_rdlock(req->cfg->search);
+    size_t n = search_index_query(req->cfg->search, q, hits, SEARCH_RESULTS,
+                                  &total);
+    if (total == 0)
+      md_buf_printf(&page, "<p>Nessun risultato.</p>\n");
+    else
+      md_buf_printf(&page, "<p>%zu %s</p>\n", total,
+                    total == 1 ? "risultato" : "risultati");
+    for (size_t i = 0; i < n; i++) {
+      md_buf_printf(&page, "<p><a href=\"");
+      append_url_path(&page, hits[i].path);
+      md_buf_printf(&page, "\">");
+      append_escaped(&page, hits[i].title);
+      md_buf_printf(&page, "</a><br>\n");
+      append_escaped(&page, hits[i].summary);
+      md_buf_printf(&page, "</p>\n");
+    }
+    search_index_unlock(req->cfg->search);
+  }
+
+  struct response resp;
+  response_init(&resp);
+  response_add_str(&resp, HTML_HEAD "<html><body>" BACK_LINK);
+  response_add_buf(&resp, &page);
+  response_add_str(&resp, CUSTOM_MSG "\n</body></html>");
+  response_send(req, &resp, 200, "OK", "text/html");
+}
+
+/* Writes the response to the request parsed into http. Whether the
+ * connection may be reused afterwards is left in req->keep_alive. */
+static void handle_request(struct request *req,
+                           const struct http_request *http) {
+  const struct server_config *cfg = req->cfg;
+  req->http = http;
+  req->minor = http->major == 1 ? http->minor : 0;
+
+  if (cfg->keepalive_timeout > 0) {
+    struct http_slice connection = http->headers[HTTP_CONNECTION];
+    if (req->minor >= 1)
+      req->keep_alive = !header_has_token(connection, "close");
+    else
+      req->keep_alive = header_has_token(connection, "keep-alive");
+  }
+
+  if (http->method.len != 3 || memcmp(http->method.p, "GET", 3) != 0) {
+    /* Any request body is left unread, so the stream cannot be reused. */
+    req->keep_alive = false;
+    send_error(req, 405, "Method Not Allowed", NULL);
+    return;
+  }
+
+  /* The query is split off before decoding, so an escaped '?' stays part
+   * of the path. */
+  char decoded_path[BUFFER_SIZE];
+  url_decode(http->path.p, http->path.len, decoded_path,
+             sizeof(decoded_path));
+
+  if (maybe_handle_go_redirect(req, decoded_path, http->query))
+    return;
+  if (cfg->search && strcmp(decoded_path, SEARCH_PATH) == 0) {
+    serve_search(req, http->query);
+    return;
+  }
+  if (cfg->stats && strcmp(decoded_path, STATS_PATH) == 0 &&
+      stats_allowed(req)) {
+    serve_stats(req);
+    return;
+  }
+
+  /* Hot static files are answered from the file cache. The tree's
+   * generation is read first, so a rename racing with the open below
+   * makes the new entry stale. */
+  char key[BUFFER_SIZE];
+  uint64_t gen = 0;
+  bool cacheable =
+      cfg->files && static_cache_key(decoded_path, key, sizeof(key));
+  if (cacheable) {
+    gen = tree_index_generation(cfg->tree);
+    const struct file_cache_entry *e = file_cache_get(cfg->files, key, gen);
+    stats_file_cache(cfg->stats, e != NULL);
+    req->route = STATS_RAW;
+    if (e && e->fd < 0) {
+      file_cache_release(cfg->files, e);
+      send_error(req, 403, "Forbidden", NULL);
+      return;
+    }
+    if (e) {
+      struct static_file file;
+      static_from_cache(&file, e);
+      serve_static(req, &file, key, raw_content_type(key));
+      return;
+    }
+  }
+
+  char rel[BUFFER_SIZE];
+  int fd = open_beneath(cfg->root_fd, decoded_path, rel, sizeof(rel));
+  if (fd < 0) {
+    if (errno == ENAMETOOLONG)
+      send_error(req, 414, "URI Too Long", "path too long\n");
+    else
+      send_error(req, 403, "Forbidden", NULL);
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
     close(fd);
+    send_error(req, 404, "Not Found", "404 not found\n");
+    return;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    const char *dot = strrchr(rel, '.');
+    if (dot && strcmp(dot, ".md") == 0) {
+      char rel_dir[BUFFER_SIZE];
+      dirname_rel(rel, rel_dir);
+      req->route = STATS_MARKDOWN;
+      serve_markdown_page(req, fd, &st, rel_dir, rel);
+      return;
+    }
+    req->route = STATS_RAW;
+    /* Only files reached without symlinks are cached, as every directory
+     * on their path is then watched. */
+    const struct file_cache_entry *e =
+        cacheable && strcmp(rel, key) == 0
+            ? file_cache_put(cfg->files, key, gen, fd)
+            : NULL;
+    if (e) {
+      struct static_file file;
+      static_from_cache(&file, e);
+      serve_static(req, &file, rel, raw_content_type(rel));
+    } else {
+      serve_file_raw(req, fd, &st, rel, raw_content_type(rel));
+    }
     return;
   }
-  buf[r] = 0;
 
-  char method[16], raw_target[BUFFER_SIZE];
-  if (sscanf(buf, "%15s %16383s", method, raw_target) != 2) {
+  req->route = STATS_LISTING;
+  if (!ends_with_slash(decoded_path)) {
     close(fd);
+    char want[BUFFER_SIZE];
+    if (safe_copy(want, sizeof(want), decoded_path) < 0) {
+      send_error(req, 414, "URI Too Long", "path too long\n");
+      return;
+    }
+    ensure_trailing_slash(want, sizeof(want));
+    send_redirect(req, want);
     return;
   }
-  if (strcmp(method, "GET") != 0) {
-    send_header(fd, 405, "Method Not Allowed", "text/plain", -1);
+
+  char rel_dir[BUFFER_SIZE];
+  safe_copy(rel_dir, sizeof(rel_dir), rel);
+  ensure_trailing_slash(rel_dir, sizeof(rel_dir));
+  char rel_file[BUFFER_SIZE];
+  bool is_markdown = false;
+  if (!pick_page(cfg->tree, rel_dir, rel_file, &is_markdown)) {
     close(fd);
+    serve_directory_listing(req, rel_dir);
     return;
   }
 
-  char decoded_target[BUFFER_SIZE];
-  url_decode(raw_target, decoded_target, sizeof(decoded_target));
+  /* The picked page is opened from the directory already in hand. */
+  int f = openat(fd, rel_file + strlen(rel_dir),
+                 O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  close(fd);
+  if (f < 0 || fstat(f, &st) != 0) {
+    if (f >= 0)
+      close(f);
+    send_error(req, 404, "Not Found", "404 not found\n");
+    return;
+  }
+  req->route = is_markdown ? STATS_MARKDOWN : STATS_RAW;
+  if (is_markdown)
+    serve_markdown_page(req, f, &st, rel_dir, rel_file);
+  else
+    serve_file_raw(req, f, &st, rel_file, "text/html");
+}
 
-  char decoded_path[BUFFER_SIZE];
-  char decoded_query[BUFFER_SIZE];
-  split_path_query(decoded_target, decoded_path, sizeof(decoded_path),
-                   decoded_query, sizeof(decoded_query));
+/* Queues the access log line for req. The method and target are logged
+ * as sent. */
+static void log_request(const struct request *req, uint64_t ns) {
+  if (!req->cfg->log)
+    return;
+  struct access_log_record r = {
+      .method = req->http->method.p,
+      .method_len = req->http->method.len,
+      .target = req->http->target.p,
+      .target_len = req->http->target.len,
+      .status = req->status,
+      .bytes = req->sent,
+      .route = stats_route_name(req->route),
+      .parser_ns = req->parser_ns,
+      .total_ns = ns,
+  };
+  access_log_write(req->cfg->log, &r);
+}
 
-  maybe_handle_go_redirect(fd, decoded_path, decoded_query);
+/* A client connection: what has been read of its requests, and the
+ * response to the one at the front while that is being written. */
+struct conn {
+  int fd;
+  size_t len;
+  struct http_request http; /* parse of the request at the front of buf */
+  unsigned served;
+  bool eof;
+  bool closing; /* timed out under io_uring, its last step still pending */
+  bool responding; /* req is taken up and holds the front of buf */
+  bool pipe_watched; /* the streaming parser's pipe is in the epoll set */
+  enum out_status wait; /* what a response parked in the reactor waits for */
+  time_t deadline;
+  uint64_t start; /* when req was taken up, for the stats */
+  struct request req;
+  struct out_queue out;
+  /* Under io_uring: the send in flight, and where files and parser output
+   * are read to be sent. */
+  struct msghdr msg;
+  struct iovec iov[OUT_MAX_IOV];
+  char *rbuf;
+  struct conn *prev;
+  struct conn *next;
+  char buf[BUFFER_SIZE];
+};
+
+static struct conn *conn_new(int fd) {
+  struct conn *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->fd = fd;
+  http_request_init(&c->http, BUFFER_SIZE - 1);
+  return c;
+}
 
-  char rootcanon[BUFFER_SIZE];
-  if (!realpath(fsroot, rootcanon)) {
-    send_header(fd, 500, "Internal Server Error", "text/plain", -1);
-    close(fd);
-    return;
+static void conn_close(const struct server_config *cfg, struct conn *c) {
+  stats_connection(cfg->stats, -1);
+  close(c->fd);
+  out_queue_free(cfg, &c->out);
+  free(c->rbuf);
+  free(c);
+}
+
+/* Takes up the request at the front of c->buf, parsed with result rc, and
+ * queues its response. */
+static void begin_response(struct conn *c, const struct server_config *cfg,
+                           enum http_parse_result rc) {
+  c->req = (struct request){
+      .fd = c->fd, .cfg = cfg, .out = &c->out, .http = &c->http};
+  c->responding = true;
+  c->pipe_watched = false;
+  c->start = cfg->stats || cfg->log ? stats_now_ns() : 0;
+  if (rc == HTTP_PARSE_DONE)
+    handle_request(&c->req, &c->http);
+  else if (rc == HTTP_PARSE_TOO_LARGE)
+    send_error(&c->req, 431, "Request Header Fields Too Large", NULL);
+  else
+    send_error(&c->req, 400, "Bad Request", NULL);
+}
+
+/* Records the response to the request at the front of c->buf, written or
+ * failed, and shifts the request out. Returns false once the connection
+ * has to be closed. */
+static bool end_response(struct conn *c, const struct server_config *cfg) {
+  struct request *req = &c->req;
+  if (cfg->stats || cfg->log) {
+    uint64_t ns = stats_now_ns() - c->start;
+    stats_request(cfg->stats, req->route, req->status, ns, req->sent);
+    log_request(req, ns);
+  }
+  c->responding = false;
+  out_queue_reset(cfg, &c->out);
+  /* Malformed heads are answered with keep_alive still false. */
+  if (!req->keep_alive || req->failed ||
+      ++c->served >= KEEPALIVE_MAX_REQUESTS)
+    return false;
+  size_t head = c->http.head_len;
+  memmove(c->buf, c->buf + head, c->len - head);
+  c->len -= head;
+  c->buf[c->len] = '\0';
+  http_request_init(&c->http, BUFFER_SIZE - 1);
+  return true;
+}
+
+/* How far a worker writes a response: to the end (-m fork), until the
+ * socket or the parser would block, leaving the rest to the reactor, or
+ * not at all, for the reactor to submit through io_uring. */
+enum write_mode { WRITE_BLOCKING, WRITE_NONBLOCKING, WRITE_RING };
+
+/* Writes the response queued on c. Returns true once it is done or has
+ * failed, and false when it is left to the reactor, with c->wait telling
+ * what it waits for. */
+static bool write_response(struct conn *c, enum write_mode mode) {
+  struct request *req = &c->req;
+  for (;;) {
+    enum out_status st;
+    if (req->failed)
+      st = OUT_FAILED;
+    else if (mode == WRITE_RING)
+      st = OUT_BLOCKED;
+    else
+      st = out_queue_write(&c->out, c->fd, &req->sent);
+    if (st == OUT_PIPE_EOF) {
+      finish_parser_stream(req);
+      continue;
+    }
+    if (st == OUT_FAILED) {
+      req->failed = true;
+      if (req->stream.pid)
+        finish_parser_stream(req);
+      return true;
+    }
+    if (st == OUT_DONE)
+      return true;
+    if (mode != WRITE_BLOCKING) {
+      c->wait = st;
+      return false;
+    }
+    struct pollfd pfd = {c->fd, POLLOUT, 0};
+    if (st == OUT_PIPE_WAIT)
+      pfd = (struct pollfd){c->out.segs[c->out.head].fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      req->failed = true;
   }
+}
 
-  char joined[BUFFER_SIZE];
-  if (safe_join(joined, sizeof(joined), rootcanon, decoded_path) < 0) {
-    send_header(fd, 414, "URI Too Long", "text/plain", -1);
-    send(fd, "path too long\n", 14, 0);
+enum serve_result { SERVE_READ, SERVE_WRITE, SERVE_CLOSE };
+
+/* Answers every complete request at the front of c->buf in order, first
+ * finishing a response the reactor handed back: one whose parser's output
+ * is through, or that failed with the parser still to reap. At EOF a
+ * trailing partial head is answered as a final request. Returns whether
+ * the connection waits for more input, for the reactor to write the rest
+ * of a response, or has to be closed. */
+static enum serve_result serve_buffered_requests(
+    struct conn *c, const struct server_config *cfg, enum write_mode mode) {
+  for (;;) {
+    if (c->responding) {
+      if (c->req.stream.pid)
+        finish_parser_stream(&c->req);
+    } else {
+      enum http_parse_result rc =
+          http_request_parse(&c->http, c->buf, c->len, c->eof);
+      if (rc == HTTP_PARSE_INCOMPLETE)
+        return c->eof ? SERVE_CLOSE : SERVE_READ;
+      begin_response(c, cfg, rc);
+    }
+    if (!write_response(c, mode))
+      return SERVE_WRITE;
+    if (!end_response(c, cfg))
+      return SERVE_CLOSE;
+  }
+}
+
+/* Fork-per-connection mode: blocking reads until the client or the idle
+ * timeout ends the connection. */
+static void handle_client(int fd, const struct server_config *cfg) {
+  struct conn *c = conn_new(fd);
+  if (!c) {
     close(fd);
     return;
   }
+  stats_connection(cfg->stats, 1);
+  for (;;) {
+    struct timeval tv = {c->len == 0 && c->served > 0
+                             ? cfg->keepalive_timeout
+                             : REQUEST_TIMEOUT_SEC,
+                         0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssize_t r = recv(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && c->len == 0)
+      break;
+    c->eof = r <= 0;
+    if (r > 0)
+      c->len += (size_t)r;
+    c->buf[c->len] = '\0';
+    if (serve_buffered_requests(c, cfg, WRITE_BLOCKING) != SERVE_READ)
+      break;
+  }
+  conn_close(cfg, c);
+}
 
-  char canon[BUFFER_SIZE];
-  if (!realpath(joined, canon) ||
-      !path_is_within_root(canon, rootcanon)) {
-    send_header(fd, 403, "Forbidden", "text/plain", -1);
+/* Parses a byte count with an optional K, M or G suffix. */
+static int parse_size(const char *s, size_t *out) {
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (errno || end == s)
+    return -1;
+  switch (*end) {
+  case 'G':
+  case 'g':
+    v <<= 10;
+    /* fall through */
+  case 'M':
+  case 'm':
+    v <<= 10;
+    /* fall through */
+  case 'K':
+  case 'k':
+    v <<= 10;
+    end++;
+    break;
+  default:
+    break;
+  }
+  if (*end)
+    return -1;
+  *out = (size_t)v;
+  return 0;
+}
+
+/* Parses a comma-separated list of IPv4 addresses and a.b.c.d/len
+ * networks. Returns the number of rules, or -1. */
+static int parse_allow_list(const char *s, struct allow_rule *out, int max) {
+  int n = 0;
+  while (*s) {
+    char item[64];
+    size_t len = strcspn(s, ",");
+    if (len == 0 || len >= sizeof(item) || n == max)
+      return -1;
+    memcpy(item, s, len);
+    item[len] = '\0';
+    s += len + (s[len] == ',');
+
+    int bits = 32;
+    char *slash = strchr(item, '/');
+    if (slash) {
+      char *end;
+      long b = strtol(slash + 1, &end, 10);
+      if (end == slash + 1 || *end || b < 0 || b > 32)
+        return -1;
+      bits = (int)b;
+      *slash = '\0';
+    }
+    struct in_addr a;
+    if (inet_pton(AF_INET, item, &a) != 1)
+      return -1;
+    out[n].mask = bits ? ~(uint32_t)0 << (32 - bits) : 0;
+    out[n].net = ntohl(a.s_addr) & out[n].mask;
+    n++;
+  }
+  return n > 0 ? n : -1;
+}
+
+static volatile sig_atomic_t stats_requested;
+
+static void on_sigusr1(int sig) {
+  (void)sig;
+  stats_requested = 1;
+}
+
+static void print_stats(const struct server_config *cfg) {
+  struct render_cache_stats cs;
+  render_cache_stats(cfg->cache, &cs);
+  fprintf(stderr,
+          "render cache: hits=%llu misses=%llu insertions=%llu "
+          "evictions=%llu entries=%zu bytes=%zu budget=%zu\n",
+          (unsigned long long)cs.hits, (unsigned long long)cs.misses,
+          (unsigned long long)cs.insertions, (unsigned long long)cs.evictions,
+          cs.entries, cs.bytes, cs.budget);
+  if (cfg->log)
+    fprintf(stderr, "access log: dropped=%llu\n",
+            (unsigned long long)access_log_dropped(cfg->log));
+  if (cfg->search) {
+    struct search_index_stats ss;
+    search_index_stats(cfg->search, &ss);
+    fprintf(stderr,
+            "search index: documents=%zu terms=%zu bytes=%zu saved=%d "
+            "pending=%zu merges=%llu\n",
+            ss.documents, ss.terms, ss.segment_bytes, (int)ss.saved,
+            ss.pending, (unsigned long long)ss.merges);
+  }
+  if (!cfg->files)
+    return;
+  struct file_cache_stats fs;
+  file_cache_stats(cfg->files, &fs);
+  fprintf(stderr,
+          "file cache: hits=%llu misses=%llu insertions=%llu evictions=%llu "
+          "invalidations=%llu entries=%zu bytes=%zu\n",
+          (unsigned long long)fs.hits, (unsigned long long)fs.misses,
+          (unsigned long long)fs.insertions, (unsigned long long)fs.evictions,
+          (unsigned long long)fs.invalidations, fs.entries, fs.bytes);
+}
+
+/* Fork-per-connection accept loop, kept for -m fork. */
+static void run_fork_loop(int s, const struct server_config *cfg) {
+  struct sigaction sa = {0};
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  while (1) {
+    struct sockaddr_in c;
+    socklen_t l = sizeof(c);
+    int fd = accept(s, (struct sockaddr *)&c, &l);
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats(cfg);
+    }
+    if (fd < 0)
+      continue;
+    pid_t pid = fork();
+    if (pid == 0) {
+      /* The parser's exit status must be observable in the child. */
+      signal(SIGCHLD, SIG_DFL);
+      close(s);
+      handle_client(fd, cfg);
+      _exit(0);
+    }
     close(fd);
+  }
+}
+
+/* The reactor thread owns accept, request reads and the writes sockets
+ * could not take at once; every connection it holds sits on an idle list
+ * with its read or write deadline. Connections with a complete request
+ * head go to the worker queue, and workers hand kept-alive ones back
+ * through the return list and wake_fd, together with any response they
+ * could not write without blocking, which the reactor then finishes. The
+ * reactor waits either on epoll, reading ready sockets itself, or on an
+ * io_uring with an accept, a read of wake_fd and one receive or response
+ * write per connection in flight, all submitted and reaped in batches by
+ * one system call; there workers only queue responses, and the reactor
+ * writes them all. */
+struct reactor {
+  int epfd;
+  struct uring *ring; /* NULL under epoll */
+  bool accept_oneshot; /* the kernel has no multishot accept */
+  time_t accept_resume; /* accepting paused after an error until then */
+  uint64_t wake_count;  /* target of the wake_fd read */
+  int listen_fd;
+  int wake_fd;
+  const struct server_config *cfg;
+  struct conn *idle_head;
+  struct conn *idle_tail;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct conn *work_head;
+  struct conn *work_tail;
+  struct conn *returned;
+};
+
+static void work_queue_push(struct reactor *r, struct conn *c) {
+  c->next = NULL;
+  pthread_mutex_lock(&r->lock);
+  if (r->work_tail)
+    r->work_tail->next = c;
+  else
+    r->work_head = c;
+  r->work_tail = c;
+  pthread_mutex_unlock(&r->lock);
+  /* After unlocking, so the woken worker does not block on the lock. */
+  pthread_cond_signal(&r->ready);
+}
+
+static struct conn *work_queue_pop(struct reactor *r) {
+  pthread_mutex_lock(&r->lock);
+  while (!r->work_head)
+    pthread_cond_wait(&r->ready, &r->lock);
+  struct conn *c = r->work_head;
+  r->work_head = c->next;
+  if (!r->work_head)
+    r->work_tail = NULL;
+  pthread_mutex_unlock(&r->lock);
+  return c;
+}
+
+static void hand_back(struct reactor *r, struct conn *c) {
+  pthread_mutex_lock(&r->lock);
+  bool wake = !r->returned; /* else the reactor has been woken already */
+  c->next = r->returned;
+  r->returned = c;
+  pthread_mutex_unlock(&r->lock);
+  if (!wake)
+    return;
+  uint64_t one = 1;
+  ssize_t w = write(r->wake_fd, &one, sizeof(one));
+  (void)w; /* EAGAIN only means a wakeup is already pending */
+}
+
+static void serve_conn(struct reactor *r, struct conn *c) {
+  c->buf[c->len] = '\0';
+  enum write_mode mode = r->ring ? WRITE_RING : WRITE_NONBLOCKING;
+  if (serve_buffered_requests(c, r->cfg, mode) == SERVE_CLOSE) {
+    conn_close(r->cfg, c);
     return;
   }
+  hand_back(r, c);
+}
 
-  struct stat st;
-  if (stat(canon, &st) == 0) {
-    if (S_ISDIR(st.st_mode)) {
-      if (!ends_with_slash(decoded_path)) {
-        char want[BUFFER_SIZE];
-        if (safe_copy(want, sizeof(want), decoded_path) < 0) {
-          close(fd);
-          return;
-        }
-        ensure_trailing_slash(want, sizeof(want));
-        send_redirect(fd, want);
-        close(fd);
+static void *worker_main(void *arg) {
+  struct reactor *r = arg;
+  for (;;)
+    serve_conn(r, work_queue_pop(r));
+  return NULL;
+}
+
+static void idle_unlink(struct reactor *r, struct conn *c) {
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    r->idle_head = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    r->idle_tail = c->prev;
+  c->prev = c->next = NULL;
+}
+
+static void idle_append(struct reactor *r, struct conn *c) {
+  int timeout = c->responding                 ? SEND_TIMEOUT_SEC
+                : c->len == 0 && c->served > 0 ? r->cfg->keepalive_timeout
+                                               : REQUEST_TIMEOUT_SEC;
+  c->deadline = time(NULL) + timeout;
+  c->next = NULL;
+  c->prev = r->idle_tail;
+  if (r->idle_tail)
+    r->idle_tail->next = c;
+  else
+    r->idle_head = c;
+  r->idle_tail = c;
+}
+
+static void reactor_close(struct reactor *r, struct conn *c) {
+  idle_unlink(r, c);
+  conn_close(r->cfg, c);
+}
+
+/* Pauses accepting after accept failed with err for other reasons than a
+ * client giving up, as when out of descriptors: the pending connection
+ * stays, and retrying at once only spins. Returns whether it paused. */
+static bool reactor_accept_failed(struct reactor *r, int err) {
+  if (err == EINTR || err == ECONNABORTED || err == EAGAIN)
+    return false;
+  r->accept_resume = time(NULL) + ACCEPT_BACKOFF_SEC;
+  return true;
+}
+
+static void reactor_accept(struct reactor *r) {
+  for (;;) {
+    int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (reactor_accept_failed(r, errno)) {
+        /* The listener is level-triggered: take it out until then. */
+        struct epoll_event ev = {0};
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->listen_fd, &ev);
         return;
       }
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    struct conn *c = conn_new(fd);
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                             .data.ptr = c};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    stats_connection(r->cfg->stats, 1);
+    idle_append(r, c);
+  }
+}
 
-      const char *rf = canon + strlen(rootcanon);
-      char rel_dir[BUFFER_SIZE];
-      if (!*rf) {
-        safe_copy(rel_dir, sizeof(rel_dir), "/");
-      } else {
-        if (*rf != '/') {
-          char tmp[BUFFER_SIZE] = "/";
-          safe_join(rel_dir, sizeof(rel_dir), tmp, rf);
-        } else {
-          safe_copy(rel_dir, sizeof(rel_dir), rf);
-        }
-        ensure_trailing_slash(rel_dir, sizeof(rel_dir));
+/* io_uring user_data of the two standing requests and of cancellations;
+ * anything else is the connection a receive or write step belongs to. */
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_CANCEL 3
+
+/* Queues a receive into the free end of c's buffer. */
+static int uring_arm_recv(struct reactor *r, struct conn *c) {
+  struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t)(c->buf + c->len);
+  sqe->len = (unsigned)(sizeof(c->buf) - 1 - c->len);
+  sqe->user_data = (uintptr_t)c;
+  return 0;
+}
+
+/* Queues the next step of c's response: a send of the bytes at the head
+ * of its queue, or a read of the file or parser output there into
+ * c->rbuf, which is then sent like any other bytes. One step is in flight
+ * per connection; steps of all connections go in the same submission. */
+static int uring_arm_write(struct reactor *r, struct conn *c) {
+  const struct out_queue *q = &c->out;
+  const struct out_seg *s = &q->segs[q->head];
+  if (s->kind != OUT_BYTES && !c->rbuf &&
+      !(c->rbuf = malloc(URING_READ_SIZE)))
+    return -1;
+  struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+  if (!sqe)
+    return -1;
+  if (s->kind == OUT_BYTES) {
+    bool more;
+    c->msg = (struct msghdr){.msg_iov = c->iov};
+    c->msg.msg_iovlen = (size_t)out_queue_iov(q, c->iov, OUT_MAX_IOV, &more);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)&c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+  } else {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->fd;
+    sqe->addr = (uintptr_t)c->rbuf;
+    sqe->len = URING_READ_SIZE;
+    if (s->kind == OUT_FILE && s->len < URING_READ_SIZE)
+      sqe->len = (unsigned)s->len;
+    /* A pipe has no offset; -1 reads at the current position. */
+    sqe->off = s->kind == OUT_FILE ? (uint64_t)s->off : (uint64_t)-1;
+  }
+  sqe->user_data = (uintptr_t)c;
+  return 0;
+}
+
+static void reactor_rearm(struct reactor *r, struct conn *c) {
+  idle_append(r, c);
+  if (r->ring) {
+    if (uring_arm_recv(r, c) < 0)
+      reactor_close(r, c);
+    return;
+  }
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                           .data.ptr = c};
+  if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    reactor_close(r, c);
+}
+
+/* Hands c to a worker once it holds a whole request head, or anything a
+ * worker has to answer, and otherwise waits for more. */
+static void reactor_dispatch(struct reactor *r, struct conn *c) {
+  if (c->len == 0 && c->eof) {
+    conn_close(r->cfg, c);
+    return;
+  }
+  /* The parse resumes where the last read left it; malformed and
+   * oversized heads go to a worker too, to be answered. */
+  if (c->eof || c->len == sizeof(c->buf) - 1 ||
+      http_request_parse(&c->http, c->buf, c->len, false) !=
+          HTTP_PARSE_INCOMPLETE) {
+    /* No read is armed (EPOLLONESHOT, or no receive queued) while a
+     * worker owns the connection. */
+    work_queue_push(r, c);
+    return;
+  }
+  reactor_rearm(r, c);
+}
+
+static void reactor_readable(struct reactor *r, struct conn *c) {
+  for (;;) {
+    size_t room = sizeof(c->buf) - 1 - c->len;
+    if (room == 0)
+      break;
+    ssize_t n = recv(c->fd, c->buf + c->len, room, 0);
+    if (n > 0) {
+      c->len += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    c->eof = true;
+    break;
+  }
+  idle_unlink(r, c);
+  reactor_dispatch(r, c);
+}
+
+/* Gives up on c's response. A parser still streaming it is left to a
+ * worker to reap. */
+static void reactor_abort(struct reactor *r, struct conn *c) {
+  c->req.failed = true;
+  if (c->req.stream.pid) {
+    work_queue_push(r, c);
+    return;
+  }
+  end_response(c, r->cfg);
+  conn_close(r->cfg, c);
+}
+
+/* Waits for the socket to take more of c's response, or for its parser to
+ * write more. Only one of the two is armed at a time, so no event for c
+ * can come in while a worker holds it. Under io_uring the next write step
+ * is submitted instead. */
+static void reactor_park(struct reactor *r, struct conn *c) {
+  if (r->ring) {
+    if (uring_arm_write(r, c) < 0)
+      reactor_abort(r, c);
+    else
+      idle_append(r, c);
+    return;
+  }
+  struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = c};
+  int fd = c->fd, op = EPOLL_CTL_MOD;
+  if (c->wait == OUT_PIPE_WAIT) {
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    fd = c->out.segs[c->out.head].fd;
+    op = c->pipe_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    c->pipe_watched = true;
+  }
+  if (epoll_ctl(r->epfd, op, fd, &ev) < 0) {
+    reactor_abort(r, c);
+    return;
+  }
+  idle_append(r, c);
+}
+
+/* Carries on with c's response after a write stopped with st. */
+static void reactor_written(struct reactor *r, struct conn *c,
+                            enum out_status st) {
+  switch (st) {
+  case OUT_BLOCKED:
+  case OUT_PIPE_WAIT:
+    c->wait = st;
+    reactor_park(r, c);
+    break;
+  case OUT_PIPE_EOF:
+    /* A worker reaps the parser and queues the rest of the page. */
+    work_queue_push(r, c);
+    break;
+  case OUT_FAILED:
+    reactor_abort(r, c);
+    break;
+  case OUT_DONE:
+    if (end_response(c, r->cfg))
+      reactor_dispatch(r, c);
+    else
+      conn_close(r->cfg, c);
+    break;
+  }
+}
+
+static void reactor_writable(struct reactor *r, struct conn *c) {
+  idle_unlink(r, c);
+  reactor_written(r, c, out_queue_write(&c->out, c->fd, &c->req.sent));
+}
+
+/* Re-registers connections that workers handed back: kept alive with only
+ * partial input left, as workers drain every complete pipelined request
+ * first, or with a response to finish writing. */
+static void reactor_take_back(struct reactor *r) {
+  uint64_t n;
+  /* Under io_uring the read has completed already. */
+  if (!r->ring && read(r->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    return;
+  pthread_mutex_lock(&r->lock);
+  struct conn *c = r->returned;
+  r->returned = NULL;
+  pthread_mutex_unlock(&r->lock);
+  while (c) {
+    struct conn *next = c->next;
+    c->prev = c->next = NULL;
+    if (c->responding)
+      reactor_park(r, c);
+    else
+      reactor_rearm(r, c);
+    c = next;
+  }
+}
+
+static void reactor_expire(struct reactor *r) {
+  time_t now = time(NULL);
+  struct conn *c = r->idle_head;
+  while (c) {
+    struct conn *next = c->next;
+    if (now >= c->deadline && r->ring) {
+      /* The pending receive still points at c: end it and free c when
+       * its completion comes in. */
+      idle_unlink(r, c);
+      c->closing = true;
+      shutdown(c->fd, SHUT_RDWR);
+      /* A read of a stalled parser's pipe is not ended by that. */
+      struct io_uring_sqe *sqe;
+      if (c->responding && (sqe = uring_get_sqe(r->ring))) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)c;
+        sqe->user_data = URING_CANCEL;
       }
+    } else if (now >= c->deadline && c->responding) {
+      /* A stalled client or parser: disarm the wait before a worker may
+       * take c to reap the parser. */
+      idle_unlink(r, c);
+      struct epoll_event ev = {0};
+      if (c->wait == OUT_PIPE_WAIT)
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->out.segs[c->out.head].fd, &ev);
+      else
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+      reactor_abort(r, c);
+    } else if (now >= c->deadline) {
+      reactor_close(r, c);
+    }
+    c = next;
+  }
+}
+
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void run_epoll_loop(struct reactor *r) {
+  struct epoll_event evs[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(r->epfd, evs, MAX_EVENTS, 1000);
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats(r->cfg);
+    }
+    for (int i = 0; i < n; i++) {
+      if (evs[i].data.ptr == NULL)
+        reactor_accept(r);
+      else if (evs[i].data.ptr == r)
+        reactor_take_back(r);
+      else if (((struct conn *)evs[i].data.ptr)->responding)
+        reactor_writable(r, evs[i].data.ptr);
+      else
+        reactor_readable(r, evs[i].data.ptr);
+    }
+    if (r->accept_resume && time(NULL) >= r->accept_resume) {
+      struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+      epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->listen_fd, &ev);
+      r->accept_resume = 0;
+    }
+    reactor_expire(r);
+  }
+}
+
+static int uring_arm_accept(struct reactor *r) {
+  struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = r->listen_fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (!r->accept_oneshot)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT;
+  return 0;
+}
+
+static int uring_arm_wake(struct reactor *r) {
+  struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = r->wake_fd;
+  sqe->addr = (uintptr_t)&r->wake_count;
+  sqe->len = sizeof(r->wake_count);
+  sqe->user_data = URING_WAKE;
+  return 0;
+}
+
+static void uring_accepted(struct reactor *r, int fd) {
+  struct conn *c = conn_new(fd);
+  if (!c) {
+    close(fd);
+    return;
+  }
+  stats_connection(r->cfg->stats, 1);
+  reactor_rearm(r, c);
+}
+
+/* Adds the res bytes just read into c->rbuf ahead of the rest of c's
+ * response, framed as a chunk for a chunked parser stream. */
+static void uring_queue_read(struct conn *c, size_t res, bool chunked) {
+  struct out_queue *q = &c->out;
+  struct out_seg *s;
+  if (chunked && (s = out_queue_add_front(q, OUT_BYTES))) {
+    s->p = "\r\n";
+    s->len = 2;
+  }
+  if ((s = out_queue_add_front(q, OUT_BYTES))) {
+    s->p = c->rbuf;
+    s->len = res;
+  }
+  if (chunked) {
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", res);
+    size_t at = q->bytes.len;
+    if (md_buf_append(&q->bytes, size, (size_t)n) < 0)
+      q->failed = true;
+    else if ((s = out_queue_add_front(q, OUT_BYTES))) {
+      s->copied = true;
+      s->at = at;
+      s->len = (size_t)n;
+    }
+  }
+}
+
+/* Takes the completion of c's write step. */
+static void uring_wrote(struct reactor *r, struct conn *c, int res) {
+  if (c->closing) {
+    reactor_abort(r, c);
+    return;
+  }
+  idle_unlink(r, c);
+  struct out_queue *q = &c->out;
+  struct out_seg *s = &q->segs[q->head];
+  enum out_status st = OUT_BLOCKED;
+  if (res == -EINTR || res == -EAGAIN) {
+    /* Submitted again as it was. */
+  } else if (res < 0 || (res == 0 && s->kind != OUT_PIPE)) {
+    /* A file that came up short fails too, as for sendfile(). */
+    st = OUT_FAILED;
+  } else if (s->kind == OUT_BYTES) {
+    out_queue_consume(q, (size_t)res);
+    c->req.sent += (uint64_t)res;
+  } else if (s->kind == OUT_FILE) {
+    s->off += res;
+    if ((s->len -= (size_t)res) == 0)
+      q->head++;
+    uring_queue_read(c, (size_t)res, false);
+  } else if (res == 0) {
+    q->head++;
+    st = OUT_PIPE_EOF;
+  } else {
+    uring_queue_read(c, (size_t)res, s->chunked);
+  }
+  if (q->failed)
+    st = OUT_FAILED;
+  else if (st == OUT_BLOCKED && q->head == q->nsegs)
+    st = OUT_DONE;
+  reactor_written(r, c, st);
+}
+
+static void uring_received(struct reactor *r, struct conn *c, int res) {
+  if (c->closing) {
+    conn_close(r->cfg, c);
+    return;
+  }
+  idle_unlink(r, c);
+  if (res == -EINTR || res == -EAGAIN) {
+    reactor_rearm(r, c);
+    return;
+  }
+  if (res > 0)
+    c->len += (size_t)res;
+  else
+    c->eof = true;
+  reactor_dispatch(r, c);
+}
 
-      char pagepath[BUFFER_SIZE];
-      bool is_markdown = false;
-      if (pick_page(canon, pagepath, &is_markdown)) {
-        const char *rf2 = pagepath + strlen(rootcanon);
-        char rel_file[BUFFER_SIZE];
-        if (*rf2 == '/')
-          safe_copy(rel_file, sizeof(rel_file), rf2);
+static void run_uring_loop(struct reactor *r) {
+  bool accepting = false, waking = false;
+  while (1) {
+    if (!accepting && time(NULL) >= r->accept_resume)
+      accepting = uring_arm_accept(r) == 0;
+    if (!waking)
+      waking = uring_arm_wake(r) == 0;
+    if (uring_submit_and_wait(r->ring, 1000) < 0 && errno != EINTR &&
+        errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      die("io_uring_enter: %s", strerror(errno));
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats(r->cfg);
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(r->ring))) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(r->ring);
+      if (data == URING_ACCEPT) {
+        if (res >= 0)
+          uring_accepted(r, res);
+        else if (res == -EINVAL)
+          r->accept_oneshot = true; /* before Linux 5.19 */
+        else
+          reactor_accept_failed(r, -res);
+        accepting = flags & IORING_CQE_F_MORE;
+      } else if (data == URING_WAKE) {
+        waking = false;
+        reactor_take_back(r);
+      } else if (data != URING_CANCEL) {
+        struct conn *c = (struct conn *)(uintptr_t)data;
+        if (c->responding)
+          uring_wrote(r, c, res);
         else
-          safe_copy(rel_file, sizeof(rel_file), "/");
-
-        if (is_markdown) {
-          serve_markdown_page(fd, rootcanon, rel_dir, rel_file, parser_argv);
-        } else {
-          serve_file_raw(fd, rootcanon, rel_file, "text/html");
-        }
-      } else {
-        serve_directory_listing(fd, rootcanon, rel_dir);
+          uring_received(r, c, res);
       }
-    } else {
-      const char *rf = canon + strlen(rootcanon);
-      char relfile[BUFFER_SIZE];
-      if (*rf == '/')
-        safe_copy(relfile, sizeof(relfile), rf);
+    }
+    reactor_expire(r);
+  }
+}
+
+/* Event reactor with a fixed pool of worker threads (-m epoll), waiting on
+ * io_uring with -u when the kernel allows it and on epoll otherwise. */
+static void run_event_loop(int s, const struct server_config *cfg,
+                           int nthreads) {
+  raise_fd_limit();
+
+  struct reactor r = {.listen_fd = s, .cfg = cfg};
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.ready, NULL);
+  struct uring ring;
+  if (cfg->uring) {
+    if (uring_init(&ring, URING_ENTRIES) == 0)
+      r.ring = &ring;
+    else
+      fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+              strerror(errno));
+  }
+  /* io_uring answers non-blocking descriptors with EAGAIN instead of
+   * waiting, so its listener and wake_fd stay blocking. */
+  r.wake_fd = eventfd(0, EFD_CLOEXEC | (r.ring ? 0 : EFD_NONBLOCK));
+  if (r.wake_fd < 0)
+    die("eventfd: %s", strerror(errno));
+  if (!r.ring) {
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    r.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r.epfd < 0)
+      die("epoll_create1: %s", strerror(errno));
+    struct epoll_event lev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event wev = {.events = EPOLLIN, .data.ptr = &r};
+    if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, s, &lev) < 0 ||
+        epoll_ctl(r.epfd, EPOLL_CTL_ADD, r.wake_fd, &wev) < 0)
+      die("epoll_ctl: %s", strerror(errno));
+  }
+
+  /* Workers never see SIGUSR1, so it always interrupts the reactor's
+   * wait. */
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker_main, &r) != 0)
+      die("pthread_create: %s", strerror(errno));
+    pthread_detach(t);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (r.ring)
+    run_uring_loop(&r);
+  else
+    run_epoll_loop(&r);
+}
+
+static int cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int)n;
+}
+
+static int open_listener(int port, bool reuseport) {
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0)
+    return -1;
+  int optval = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  if (reuseport &&
+      setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+    close(s);
+    return -1;
+  }
+
+  struct sockaddr_in a = {0};
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = INADDR_ANY;
+  if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0 ||
+      listen(s, SOMAXCONN) < 0) {
+    int saved = errno;
+    close(s);
+    errno = saved;
+    return -1;
+  }
+  return s;
+}
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static struct tree_index *open_tree_index(const char *root) {
+  struct tree_index *t = tree_index_open(root);
+  if (!t)
+    die("cannot index %s: %s", root, strerror(errno));
+  if (tree_index_watch(t) < 0)
+    fprintf(stderr, "inotify unavailable, directory changes need a "
+                    "restart\n");
+  return t;
+}
+
+/* Indexes root for SEARCH_PATH, saving the index to path if one is given.
+ * Each serving process starts the watcher itself with
+ * watch_search_index(). */
+static struct search_index *open_search_index(const char *root,
+                                              const char *path) {
+  struct search_index *s = search_index_open(root, path);
+  if (!s)
+    die("cannot index %s for search: %s", root, strerror(errno));
+  struct search_index_stats st;
+  search_index_stats(s, &st);
+  if (path && !st.saved)
+    fprintf(stderr, "cannot save the search index to %s, keeping it in "
+                    "memory\n", path);
+  return s;
+}
+
+static void watch_search_index(struct search_index *s) {
+  if (search_index_watch(s) < 0)
+    fprintf(stderr, "inotify unavailable, search results need a restart\n");
+}
+
+/* Starts the configured parser pool, or returns NULL to fork the parser
+ * per document. */
+static struct parser_pool *open_parser_pool(const struct server_config *cfg) {
+  if (!cfg->parser_argv || cfg->pool_size <= 0)
+    return NULL;
+  struct parser_pool *p = parser_pool_create(
+      cfg->parser_argv, cfg->pool_size, cfg->parser_timeout * 1000);
+  if (!p)
+    die("cannot start parser pool: %s", strerror(errno));
+  return p;
+}
+
+/* Starts the file cache for a serving process whose tree index is already
+ * open. Without a watched tree nothing would notice renames, so the cache
+ * stays off then. */
+static struct file_cache *open_file_cache(const struct server_config *cfg) {
+  if (cfg->max_files == 0 || tree_index_watch(cfg->tree) < 0)
+    return NULL;
+  struct file_cache *c = file_cache_create(cfg->root, cfg->max_files);
+  if (!c)
+    fprintf(stderr, "file cache unavailable: %s\n", strerror(errno));
+  return c;
+}
+
+static pid_t spawn_worker(int port, const struct server_config *cfg,
+                          int nthreads) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() == 1)
+    _exit(0);
+  int s = open_listener(port, true);
+  if (s < 0) {
+    fprintf(stderr, "worker %d: listen on port %d: %s\n", (int)getpid(),
+            port, strerror(errno));
+    _exit(1);
+  }
+  /* The watcher thread and its inotify descriptor cannot be shared across
+   * fork, so every worker indexes the tree itself. The search index is
+   * inherited as built and only watched from here. */
+  struct server_config wcfg = *cfg;
+  wcfg.tree = open_tree_index(cfg->root);
+  wcfg.pool = open_parser_pool(cfg);
+  wcfg.files = open_file_cache(&wcfg);
+  watch_search_index(wcfg.search);
+  run_event_loop(s, &wcfg, nthreads);
+  _exit(0);
+}
+
+/* Prefork master (-w): keeps nworkers long-lived processes, each with its
+ * own SO_REUSEPORT listener and event loop, and restarts any that exit.
+ * The kernel spreads incoming connections across the listeners. */
+static void run_prefork_master(int port, const struct server_config *cfg,
+                               int nworkers, int nthreads) {
+  /* Fail fast on a port we cannot bind; the probe socket is closed again
+   * so it never receives connections of its own. */
+  int probe = open_listener(port, true);
+  if (probe < 0)
+    die("listen on port %d: %s", port, strerror(errno));
+  close(probe);
+
+  struct sigaction ss = {0};
+  ss.sa_handler = on_stop_signal;
+  sigaction(SIGTERM, &ss, NULL);
+  sigaction(SIGINT, &ss, NULL);
+
+  pid_t *pids = calloc((size_t)nworkers, sizeof(*pids));
+  time_t *started = calloc((size_t)nworkers, sizeof(*started));
+  if (!pids || !started)
+    die("out of memory");
+  for (int i = 0; i < nworkers; i++) {
+    pids[i] = spawn_worker(port, cfg, nthreads);
+    started[i] = time(NULL);
+  }
+
+  while (!stop_requested) {
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats(cfg);
+    }
+    if (pid <= 0)
+      continue;
+    for (int i = 0; i < nworkers; i++) {
+      if (pids[i] != pid)
+        continue;
+      if (WIFSIGNALED(status))
+        fprintf(stderr, "worker %d killed by signal %d, restarting\n",
+                (int)pid, WTERMSIG(status));
       else
-        safe_copy(relfile, sizeof(relfile), "/");
-
-      const char *dot = strrchr(relfile, '.');
-      if (dot && strcmp(dot, ".md") == 0) {
-        char rel_dir[BUFFER_SIZE];
-        dirname_rel(relfile, rel_dir);
-        serve_markdown_page(fd, rootcanon, rel_dir, relfile, parser_argv);
-      } else if (dot && strcmp(dot, ".html") == 0) {
-        serve_file_raw(fd, rootcanon, relfile, "text/html");
-      } else {
-        serve_file_raw(fd, rootcanon, relfile, "application/octet-stream");
-      }
+        fprintf(stderr, "worker %d exited with status %d, restarting\n",
+                (int)pid, WEXITSTATUS(status));
+      /* Back off when a worker dies right after start. */
+      if (time(NULL) - started[i] < 1)
+        sleep(1);
+      if (stop_requested)
+        break;
+      pids[i] = spawn_worker(port, cfg, nthreads);
+      started[i] = time(NULL);
     }
+  }
+
+  for (int i = 0; i < nworkers; i++)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+    ;
+  free(pids);
+  free(started);
+}
+
+/* Static export (-b): every page, listing and .html file the server would
+ * answer for the tree is written below an output directory, mirroring the
+ * URL layout (directories get index.html). Rendered .md pages keep their
+ * name, so the front end has to serve them as text/html. A manifest
+ * records the inputs each file was built from, so a later export only
+ * rebuilds what changed and removes what disappeared. */
+#define EXPORT_MANIFEST ".mdserve-export"
+
+enum export_kind { EXPORT_PAGE, EXPORT_LISTING, EXPORT_COPY };
+
+struct export_job {
+  enum export_kind kind;
+  const struct tree_dir *dir; /* whose navigation the output carries */
+  char src[BUFFER_SIZE];      /* root-relative source, "" for listings */
+  char out[BUFFER_SIZE];      /* root-relative output path */
+  char key[128]; /* version of the inputs, "" if unknown */
+  bool unchanged;
+  bool failed;
+};
+
+struct export_entry {
+  char *path;
+  char *key;
+};
+
+struct exporter {
+  const struct server_config *cfg;
+  const char *outdir;
+  struct export_job *jobs;
+  size_t njobs, cap;
+  size_t next; /* next job to claim, advanced atomically */
+  struct export_entry *old; /* previous manifest, sorted by path */
+  size_t nold;
+};
+
+static int export_entry_cmp(const void *a, const void *b) {
+  return strcmp(((const struct export_entry *)a)->path,
+                ((const struct export_entry *)b)->path);
+}
+
+static const struct export_entry *export_old(const struct exporter *x,
+                                             const char *path) {
+  struct export_entry probe = {(char *)path, NULL};
+  return x->nold ? bsearch(&probe, x->old, x->nold, sizeof(*x->old),
+                           export_entry_cmp)
+                 : NULL;
+}
+
+static const char *export_parser_name(const struct server_config *cfg) {
+  return cfg->parser_argv ? cfg->parser_argv[0] : "builtin";
+}
+
+/* Loads the previous manifest. Keys recorded with another parser are
+ * dropped so every page is rebuilt, but the paths still let stale files
+ * be removed. */
+static void export_load_manifest(struct exporter *x) {
+  char path[BUFFER_SIZE];
+  snprintf(path, sizeof(path), "%s/" EXPORT_MANIFEST, x->outdir);
+  FILE *f = fopen(path, "re");
+  if (!f)
+    return;
+  char *line = NULL;
+  size_t cap = 0, n = 0, alloc = 0;
+  bool same_parser = false;
+  if (getline(&line, &cap, f) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    same_parser = strncmp(line, "mdserve-export 1 ", 17) == 0 &&
+                  strcmp(line + 17, export_parser_name(x->cfg)) == 0;
+  }
+  while (getline(&line, &cap, f) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    char *tab = strchr(line, '\t');
+    if (!tab)
+      continue;
+    *tab = '\0';
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 256;
+      struct export_entry *ne = realloc(x->old, alloc * sizeof(*ne));
+      if (!ne)
+        break;
+      x->old = ne;
+    }
+    x->old[n].key = strdup(same_parser ? line : "");
+    x->old[n].path = strdup(tab + 1);
+    if (!x->old[n].key || !x->old[n].path) {
+      free(x->old[n].key);
+      free(x->old[n].path);
+      break;
+    }
+    n++;
+  }
+  free(line);
+  fclose(f);
+  x->nold = n;
+  qsort(x->old, n, sizeof(*x->old), export_entry_cmp);
+}
+
+static struct export_job *export_add(struct exporter *x, enum export_kind kind,
+                                     const struct tree_dir *d, const char *src,
+                                     const char *out) {
+  if (x->njobs == x->cap) {
+    size_t ncap = x->cap ? x->cap * 2 : 256;
+    struct export_job *nj = realloc(x->jobs, ncap * sizeof(*nj));
+    if (!nj)
+      die("out of memory");
+    x->jobs = nj;
+    x->cap = ncap;
+  }
+  struct export_job *j = &x->jobs[x->njobs++];
+  memset(j, 0, sizeof(*j));
+  j->kind = kind;
+  j->dir = d;
+  safe_copy(j->src, sizeof(j->src), src);
+  safe_copy(j->out, sizeof(j->out), out);
+
+  /* The key covers everything the output is built from, like the ETags
+   * the server sends for the same resources. */
+  struct stat st;
+  char full[BUFFER_SIZE];
+  if (kind == EXPORT_LISTING) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < d->npages; i++)
+      for (const char *p = d->pages[i]; ; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        if (!*p)
+          break;
+      }
+    snprintf(j->key, sizeof(j->key), "l-%jx-%jx", (uintmax_t)h,
+             (uintmax_t)d->nav_hash);
+  } else if (safe_join(full, sizeof(full), x->cfg->root, src) >= 0 &&
+             stat(full, &st) == 0) {
+    snprintf(j->key, sizeof(j->key), "%c-%jx-%jx-%jx-%jx",
+             kind == EXPORT_PAGE ? 'p' : 'c', (uintmax_t)st.st_ino,
+             (uintmax_t)st.st_size,
+             (uintmax_t)st.st_mtim.tv_sec * 1000000000u +
+                 (uintmax_t)st.st_mtim.tv_nsec,
+             kind == EXPORT_PAGE ? (uintmax_t)d->nav_hash : 0);
+  }
+
+  const struct export_entry *old = export_old(x, out);
+  char dst[BUFFER_SIZE];
+  j->unchanged = j->key[0] && old && strcmp(old->key, j->key) == 0 &&
+                 safe_join(dst, sizeof(dst), x->outdir, out) >= 0 &&
+                 access(dst, F_OK) == 0;
+  return j;
+}
+
+/* Queues the outputs for d and its subdirectories, creating the output
+ * directories on the way. Symlinked directories are left to the server. */
+static void export_collect(struct exporter *x, const struct tree_dir *d) {
+  if (d->is_link)
+    return;
+  char path[BUFFER_SIZE];
+  if (safe_join(path, sizeof(path), x->outdir, d->rel) < 0 ||
+      (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+    fprintf(stderr, "export: cannot create %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  char src[BUFFER_SIZE], out[BUFFER_SIZE];
+  path_join(out, sizeof(out), d->rel, "index.html", false);
+  bool index_written = true;
+  if (!d->index_page) {
+    export_add(x, EXPORT_LISTING, d, "", out);
+  } else if (d->index_is_markdown) {
+    path_join(src, sizeof(src), d->rel, d->index_page, false);
+    export_add(x, EXPORT_PAGE, d, src, out);
+  } else if (strcmp(d->index_page, "index.html") != 0) {
+    path_join(src, sizeof(src), d->rel, d->index_page, false);
+    export_add(x, EXPORT_COPY, d, src, out);
   } else {
-    send_header(fd, 404, "Not Found", "text/plain", -1);
-    const char *msg = "404 not found\n";
-    send(fd, msg, strlen(msg), 0);
+    index_written = false;
   }
 
-  close(fd);
+  for (size_t i = 0; i < d->npages; i++) {
+    const char *name = d->pages[i];
+    bool md = strcmp(strrchr(name, '.'), ".md") == 0;
+    /* The directory's own response owns index.html. */
+    if (!md && index_written && strcmp(name, "index.html") == 0)
+      continue;
+    path_join(src, sizeof(src), d->rel, name, false);
+    export_add(x, md ? EXPORT_PAGE : EXPORT_COPY, d, src, src);
+  }
+
+  for (size_t i = 0; i < d->nsubdirs; i++)
+    export_collect(x, d->subdirs[i]);
+}
+
+/* Replaces path with data through a temporary file and rename(), so a
+ * front end never sees a half-written page. */
+static int write_file_atomic(const char *path, const char *data, size_t len) {
+  char tmp[BUFFER_SIZE + 16];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (f < 0)
+    return -1;
+  size_t off = 0;
+  while (off < len) {
+    ssize_t w = write(f, data + off, len - off);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    off += (size_t)w;
+  }
+  if (close(f) != 0 || off < len || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static void export_run_job(struct exporter *x, struct export_job *j) {
+  const struct server_config *cfg = x->cfg;
+  char full[BUFFER_SIZE], dst[BUFFER_SIZE];
+  if (safe_join(dst, sizeof(dst), x->outdir, j->out) < 0 ||
+      (j->src[0] && safe_join(full, sizeof(full), cfg->root, j->src) < 0)) {
+    j->failed = true;
+    return;
+  }
+
+  struct md_buf out = {0};
+  int rc = 0;
+  switch (j->kind) {
+  case EXPORT_PAGE: {
+    struct stat st;
+    int f = open(full, O_RDONLY | O_CLOEXEC);
+    if (f < 0 || fstat(f, &st) != 0) {
+      rc = -1;
+    } else {
+      struct md_buf nav = {0};
+      emit_related(&nav, j->dir->rel, j->dir);
+      rc = assemble_page(cfg, full, f, &st, j->dir->rel, &nav, &out, NULL);
+      md_buf_free(&nav);
+    }
+    if (f >= 0)
+      close(f);
+    break;
+  }
+  case EXPORT_LISTING:
+    md_buf_append(&out, "<html><body>", strlen("<html><body>"));
+    if (strcmp(j->dir->rel, "/") != 0)
+      md_buf_append(&out, BACK_LINK, strlen(BACK_LINK));
+    emit_listing(&out, j->dir->rel, j->dir);
+    if (md_buf_append(&out, CUSTOM_MSG "\n</body></html>",
+                      strlen(CUSTOM_MSG "\n</body></html>")) < 0)
+      rc = -1;
+    break;
+  case EXPORT_COPY: {
+    int f = open(full, O_RDONLY | O_CLOEXEC);
+    rc = f < 0 ? -1 : read_fd(f, &out);
+    if (f >= 0)
+      close(f);
+    break;
+  }
+  }
+
+  /* A page whose render failed is still written, with the parser error
+   * the server would show, but is retried by the next export. */
+  if (rc < 0 || write_file_atomic(dst, out.data ? out.data : "", out.len) < 0)
+    fprintf(stderr, "export: cannot write %s\n", dst);
+  if (rc != 0)
+    j->failed = true;
+  md_buf_free(&out);
+}
+
+static void *export_worker(void *arg) {
+  struct exporter *x = arg;
+  for (;;) {
+    size_t i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED);
+    if (i >= x->njobs)
+      return NULL;
+    if (!x->jobs[i].unchanged)
+      export_run_job(x, &x->jobs[i]);
+  }
+}
+
+static int export_path_cmp(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Writes the new manifest and deletes files the previous export produced
+ * that no longer belong to the site. Returns the number deleted. */
+static size_t export_finish(struct exporter *x) {
+  char path[BUFFER_SIZE];
+  snprintf(path, sizeof(path), "%s/" EXPORT_MANIFEST, x->outdir);
+  struct md_buf m = {0};
+  md_buf_printf(&m, "mdserve-export 1 %s\n", export_parser_name(x->cfg));
+  const char **outs = calloc(x->njobs ? x->njobs : 1, sizeof(*outs));
+  if (!outs)
+    die("out of memory");
+  for (size_t i = 0; i < x->njobs; i++) {
+    const struct export_job *j = &x->jobs[i];
+    md_buf_printf(&m, "%s\t%s\n", j->failed ? "" : j->key, j->out);
+    outs[i] = j->out;
+  }
+  if (write_file_atomic(path, m.data, m.len) < 0)
+    fprintf(stderr, "export: cannot write %s\n", path);
+  md_buf_free(&m);
+
+  qsort(outs, x->njobs, sizeof(*outs), export_path_cmp);
+  size_t removed = 0;
+  for (size_t i = 0; i < x->nold; i++) {
+    const char *old = x->old[i].path;
+    if (x->njobs &&
+        bsearch(&old, outs, x->njobs, sizeof(*outs), export_path_cmp))
+      continue;
+    char dst[BUFFER_SIZE];
+    if (safe_join(dst, sizeof(dst), x->outdir, old) < 0 || unlink(dst) != 0)
+      continue;
+    removed++;
+    /* Drop directories left empty by a removed source directory. */
+    size_t keep = strlen(x->outdir);
+    char *slash;
+    while ((slash = strrchr(dst, '/')) && (size_t)(slash - dst) > keep) {
+      *slash = '\0';
+      if (rmdir(dst) != 0)
+        break;
+    }
+  }
+  free(outs);
+  return removed;
+}
+
+static int run_export(const struct server_config *cfg, const char *outdir,
+                      int nthreads) {
+  if (mkdir(outdir, 0755) != 0 && errno != EEXIST)
+    die("cannot create %s: %s", outdir, strerror(errno));
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  struct exporter x = {.cfg = cfg, .outdir = outdir};
+  export_load_manifest(&x);
+  tree_index_rdlock(cfg->tree);
+  export_collect(&x, tree_index_find(cfg->tree, "/"));
+
+  pthread_t *threads = calloc((size_t)nthreads, sizeof(*threads));
+  if (!threads)
+    die("out of memory");
+  int started = 0;
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[started], NULL, export_worker, &x) == 0)
+      started++;
+  if (started == 0)
+    export_worker(&x);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  tree_index_unlock(cfg->tree);
+
+  size_t written = 0, unchanged = 0, failed = 0;
+  for (size_t i = 0; i < x.njobs; i++) {
+    if (x.jobs[i].unchanged)
+      unchanged++;
+    else if (x.jobs[i].failed)
+      failed++;
+    else
+      written++;
+  }
+  size_t removed = export_finish(&x);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("Exported %zu files to %s in %.2fs: %zu written, %zu unchanged, "
+         "%zu removed, %zu failed\n",
+         x.njobs, outdir,
+         (double)(t1.tv_sec - t0.tv_sec) +
+             (double)(t1.tv_nsec - t0.tv_nsec) / 1e9,
+         written, unchanged, removed, failed);
+
+  for (size_t i = 0; i < x.nold; i++) {
+    free(x.old[i].path);
+    free(x.old[i].key);
+  }
+  free(x.old);
+  free(x.jobs);
+  return failed ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
   int port = 8080;
   const char *root = ".";
-  const char *parser = "mdparse";
+  const char *parser = NULL;
+  size_t cache_budget = 32u << 20;
+  enum { MODE_EPOLL, MODE_FORK, MODE_PREFORK } mode = MODE_EPOLL;
+  int nthreads = 0, nworkers = 0;
+  int keepalive = KEEPALIVE_TIMEOUT_SEC;
+  const char *export_dir = NULL;
+  int pool_size = 0, parser_timeout = PARSER_TIMEOUT_SEC;
+  size_t max_files = FILE_CACHE_FILES;
+  struct allow_rule stats_allow[MAX_STATS_ALLOW];
+  int nstats_allow = 0;
+  const char *log_path = NULL;
+  const char *index_path = NULL;
+  bool uring = false;
   int opt;
-  while ((opt = getopt(argc, argv, "p:r:x:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:r:x:c:m:t:w:k:b:P:T:F:S:L:I:u")) != -1) {
     switch (opt) {
     case 'p':
       port = atoi(optarg);
@@ -789,48 +3685,224 @@ int main(int argc, char **argv) {
     case 'x':
       parser = optarg;
       break;
+    case 'c':
+      if (parse_size(optarg, &cache_budget) < 0)
+        die("invalid cache size: %s", optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "fork") == 0)
+        mode = MODE_FORK;
+      else if (strcmp(optarg, "epoll") == 0)
+        mode = MODE_EPOLL;
+      else if (strcmp(optarg, "prefork") == 0)
+        mode = MODE_PREFORK;
+      else
+        die("unknown mode: %s (expected epoll, fork or prefork)", optarg);
+      break;
+    case 'w':
+      nworkers = atoi(optarg);
+      if (nworkers < 0)
+        die("invalid worker count: %s", optarg);
+      mode = MODE_PREFORK;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1)
+        die("invalid thread count: %s", optarg);
+      break;
+    case 'k':
+      keepalive = atoi(optarg);
+      if (keepalive < 0)
+        die("invalid keep-alive timeout: %s", optarg);
+      break;
+    case 'b':
+      export_dir = optarg;
+      break;
+    case 'P':
+      pool_size = atoi(optarg);
+      if (pool_size < 0)
+        die("invalid parser pool size: %s", optarg);
+      break;
+    case 'T':
+      parser_timeout = atoi(optarg);
+      if (parser_timeout < 1)
+        die("invalid parser timeout: %s", optarg);
+      break;
+    case 'F': {
+      char *end;
+      errno = 0;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (errno || end == optarg || *end)
+        die("invalid file cache size: %s", optarg);
+      max_files = n;
+      break;
+    }
+    case 'S':
+      nstats_allow = parse_allow_list(optarg, stats_allow, MAX_STATS_ALLOW);
+      if (nstats_allow < 0)
+        die("invalid stats allow list: %s", optarg);
+      break;
+    case 'L':
+      log_path = optarg;
+      break;
+    case 'I':
+      index_path = optarg;
+      break;
+    case 'u':
+      uring = true;
+      break;
     default:
-      fprintf(stderr, "Usage: %s [-p port] [-r root] [-x parser]\n", argv[0]);
+      fprintf(stderr,
+              "Usage: %s [-p port] [-r root] [-x parser] [-c cache_bytes] "
+              "[-m epoll|fork|prefork] [-w workers] [-t threads] "
+              "[-k keepalive_secs] [-b outdir] [-P parsers] "
+              "[-T parser_secs] [-F files] [-S allow] [-L access_log] "
+              "[-I index_file] [-u]\n",
+              argv[0]);
+      fprintf(stderr, "Without -x, Markdown is rendered by the built-in "
+                      "mdparse library.\n");
+      fprintf(stderr, "-c sets the rendered-page cache budget (K/M/G "
+                      "suffixes, 0 disables); SIGUSR1 prints its stats.\n");
+      fprintf(stderr, "-m epoll (default) serves from an epoll reactor and "
+                      "a pool of -t worker threads;\n"
+                      "-m fork forks a process per connection;\n"
+                      "-w N (or -m prefork) runs N worker processes on a "
+                      "shared SO_REUSEPORT port, N=0 means one per CPU.\n");
+      fprintf(stderr, "-k sets how long idle keep-alive connections stay "
+                      "open (default %d, 0 disables).\n",
+              KEEPALIVE_TIMEOUT_SEC);
+      fprintf(stderr, "-b exports the site as static HTML into outdir with "
+                      "-t threads instead of serving,\n"
+                      "rebuilding only what changed since the last export.\n");
+      fprintf(stderr, "-P N keeps N -x parsers running and sends them framed "
+                      "documents (mdparse speaks it);\n"
+                      "-T limits each pooled document to that many seconds "
+                      "(default %d).\n",
+              PARSER_TIMEOUT_SEC);
+      fprintf(stderr, "-F keeps up to that many static files open per "
+                      "process, with small ones in memory\n"
+                      "(default %d, 0 disables; not with -m fork).\n",
+              FILE_CACHE_FILES);
+      fprintf(stderr, "-S serves metrics at " STATS_PATH " in the "
+                      "Prometheus text format to the listed IPv4\n"
+                      "addresses or networks, e.g. 127.0.0.1,10.0.0.0/8.\n");
+      fprintf(stderr, "-L appends a JSON line per request to access_log "
+                      "(- for stdout), written in batches;\n"
+                      "lines are dropped and counted if the writer falls "
+                      "behind.\n");
+      fprintf(stderr, "-I keeps the full-text index behind " SEARCH_PATH
+                      " in index_file, so a restart\n"
+                      "only reads the pages changed since.\n");
+      fprintf(stderr, "-u accepts, reads requests and writes responses "
+                      "through io_uring in epoll and\nprefork mode, "
+                      "falling back to epoll where the kernel lacks or "
+                      "forbids it.\n");
       exit(1);
     }
   }
 
-  char *pargv[2] = {(char *)parser, NULL};
+  /* A client hanging up mid-response, or a parser dying mid-document,
+   * must not kill a threaded server. */
+  signal(SIGPIPE, SIG_IGN);
 
-  int s = socket(AF_INET, SOCK_STREAM, 0);
-  if (s < 0)
-    die("socket: %s", strerror(errno));
-  int optval = 1;
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-  struct sockaddr_in a = {0};
-  a.sin_family = AF_INET;
-  a.sin_port = htons(port);
-  a.sin_addr.s_addr = INADDR_ANY;
-  if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0)
-    die("bind: %s", strerror(errno));
-  if (listen(s, 64) < 0)
-    die("listen: %s", strerror(errno));
-
-  printf("Serving %s on port %d using parser '%s'\n", root, port, parser);
+  char *pargv[2] = {(char *)parser, NULL};
+  if (mode == MODE_FORK && pool_size > 0) {
+    fprintf(stderr, "-P is not available with -m fork, forking the parser "
+                    "per document\n");
+    pool_size = 0;
+  }
+  if (export_dir) {
+    /* Every page is rendered once, so the render cache would only cost
+     * memory. */
+    struct server_config ecfg = {
+        .root = root,
+        .parser_argv = parser ? pargv : NULL,
+        .tree = tree_index_open(root),
+        .pool_size = pool_size,
+        .parser_timeout = parser_timeout,
+    };
+    if (!ecfg.tree)
+      die("cannot index %s: %s", root, strerror(errno));
+    ecfg.pool = open_parser_pool(&ecfg);
+    int rc = run_export(&ecfg, export_dir, nthreads ? nthreads : cpu_count());
+    parser_pool_destroy(ecfg.pool);
+    tree_index_close(ecfg.tree);
+    return rc;
+  }
 
-  struct sigaction sa = {0};
-  sa.sa_handler = SIG_IGN;
-  sa.sa_flags = SA_RESTART;
-  sigaction(SIGCHLD, &sa, NULL);
+  /* Opened once so that requests resolve beneath it, whatever happens to
+   * the path later. */
+  int root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0)
+    die("cannot open %s: %s", root, strerror(errno));
+  struct server_config cfg = {
+      .root = root,
+      .root_fd = root_fd,
+      .parser_argv = parser ? pargv : NULL,
+      .cache = render_cache_create(cache_budget),
+      .keepalive_timeout = keepalive,
+      .pool_size = pool_size,
+      .parser_timeout = parser_timeout,
+      /* A forked handler's entries would die with it. */
+      .max_files = mode == MODE_FORK ? 0 : max_files,
+      .nstats_allow = nstats_allow,
+      .uring = uring,
+  };
+  memcpy(cfg.stats_allow, stats_allow,
+         (size_t)nstats_allow * sizeof(*stats_allow));
+  /* Mapped before any fork, so every handler and worker counts into the
+   * same place. */
+  if (nstats_allow > 0 && !(cfg.stats = stats_create()))
+    die("cannot map stats: %s", strerror(errno));
+  if (log_path && !(cfg.log = access_log_open(log_path)))
+    die("cannot open access log %s: %s", log_path, strerror(errno));
+
+  if (nworkers == 0)
+    nworkers = cpu_count();
+  if (nthreads == 0)
+    nthreads = mode == MODE_PREFORK ? 2 : 2 * cpu_count();
+
+  int s = -1;
+  if (mode != MODE_PREFORK && (s = open_listener(port, false)) < 0)
+    die("listen on port %d: %s", port, strerror(errno));
+
+  printf("Serving %s on port %d using parser '%s'\n", root, port,
+         parser ? parser : "builtin");
+  fflush(stdout);
+
+  struct sigaction su = {0};
+  su.sa_handler = on_sigusr1;
+  sigaction(SIGUSR1, &su, NULL);
+
+  /* Prefork workers build their own index, pool and file cache after the
+   * fork, and watch the search index they inherit. */
+  cfg.search = open_search_index(root, index_path);
+  if (mode != MODE_PREFORK) {
+    cfg.tree = open_tree_index(root);
+    cfg.pool = open_parser_pool(&cfg);
+    cfg.files = open_file_cache(&cfg);
+    watch_search_index(cfg.search);
+  }
 
-  while (1) {
-    struct sockaddr_in c;
-    socklen_t l = sizeof(c);
-    int fd = accept(s, (struct sockaddr *)&c, &l);
-    if (fd < 0)
-      continue;
-    pid_t pid = fork();
-    if (pid == 0) {
-      close(s);
-      handle_client(fd, root, pargv);
-      _exit(0);
-    }
-    close(fd);
+  switch (mode) {
+  case MODE_FORK:
+    run_fork_loop(s, &cfg);
+    break;
+  case MODE_EPOLL:
+    run_event_loop(s, &cfg, nthreads);
+    break;
+  case MODE_PREFORK:
+    printf("Starting %d workers with %d threads each\n", nworkers, nthreads);
+    fflush(stdout);
+    run_prefork_master(port, &cfg, nworkers, nthreads);
+    break;
   }
+  file_cache_destroy(cfg.files);
+  parser_pool_destroy(cfg.pool);
+  tree_index_close(cfg.tree);
+  search_index_close(cfg.search);
+  render_cache_destroy(cfg.cache);
+  stats_destroy(cfg.stats);
+  access_log_close(cfg.log);
+  return 0;
 }
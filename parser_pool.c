@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "parser_pool.h"
+
+/* Replies larger than this are taken as a broken worker. */
+#define MAX_REPLY ((size_t)1 << 30)
+
+struct pool_worker {
+  pid_t pid; /* 0 when the slot has no process */
+  int to_fd; /* parser's stdin */
+  int from_fd; /* parser's stdout */
+  bool busy;
+};
+
+extern char **environ;
+
+struct parser_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  char *const *argv;
+  char **envp; /* environ plus MDSERVE_FRAMED=1 */
+  int timeout_ms;
+  int size;
+  struct pool_worker *workers;
+};
+
+static int start_worker(struct pool_worker *w, const struct parser_pool *p) {
+  int in[2], out[2];
+  /* CLOEXEC keeps other children from inheriting the ends, which would
+   * hold a dead worker's pipes open. */
+  if (pipe2(in, O_CLOEXEC))
+    return -1;
+  if (pipe2(out, O_CLOEXEC)) {
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    execvpe(p->argv[0], p->argv, p->envp);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  w->pid = pid;
+  w->to_fd = in[1];
+  w->from_fd = out[0];
+  return 0;
+}
+
+static void stop_worker(struct pool_worker *w) {
+  if (w->pid <= 0)
+    return;
+  close(w->to_fd);
+  close(w->from_fd);
+  kill(w->pid, SIGKILL);
+  waitpid(w->pid, NULL, 0);
+  w->pid = 0;
+}
+
+/* Reaps a worker that exited while idle and starts its replacement. Once
+ * reaped its pid may be reused, so it must not be signalled. */
+static void check_worker(struct pool_worker *w, const struct parser_pool *p) {
+  if (w->pid > 0 && waitpid(w->pid, NULL, WNOHANG) != 0) {
+    close(w->to_fd);
+    close(w->from_fd);
+    w->pid = 0;
+  }
+  if (w->pid == 0)
+    start_worker(w, p);
+}
+
+struct parser_pool *parser_pool_create(char *const argv[], int size,
+                                       int timeout_ms) {
+  struct parser_pool *p = calloc(1, sizeof(*p));
+  if (!p)
+    return NULL;
+  p->workers = calloc((size_t)size, sizeof(*p->workers));
+  if (!p->workers) {
+    free(p);
+    return NULL;
+  }
+  /* Tells parsers that serve both ways to speak the framed protocol. The
+   * environment is built here since the child of a threaded process must
+   * not allocate before exec. */
+  size_t nenv = 0;
+  while (environ[nenv])
+    nenv++;
+  p->envp = calloc(nenv + 2, sizeof(*p->envp));
+  if (!p->envp) {
+    free(p->workers);
+    free(p);
+    return NULL;
+  }
+  size_t j = 0;
+  for (size_t i = 0; i < nenv; i++)
+    if (strncmp(environ[i], "MDSERVE_FRAMED=", 15) != 0)
+      p->envp[j++] = environ[i];
+  p->envp[j] = (char *)"MDSERVE_FRAMED=1";
+  p->argv = argv;
+  p->size = size;
+  p->timeout_ms = timeout_ms;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->idle, NULL);
+  int started = 0;
+  for (int i = 0; i < size; i++)
+    if (start_worker(&p->workers[i], p) == 0)
+      started++;
+  if (started == 0) {
+    parser_pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+void parser_pool_destroy(struct parser_pool *p) {
+  if (!p)
+    return;
+  for (int i = 0; i < p->size; i++)
+    stop_worker(&p->workers[i]);
+  pthread_cond_destroy(&p->idle);
+  pthread_mutex_destroy(&p->lock);
+  free(p->envp);
+  free(p->workers);
+  free(p);
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Parses the reply header in buf[0, n). Returns the header length, 0 if
+ * it is not complete yet, or -1 if it is malformed. */
+static int parse_reply_header(const char *buf, size_t n, size_t *len) {
+  size_t v = 0;
+  for (size_t i = 0; i < n && i < 20; i++) {
+    if (buf[i] == '\n')
+      return i > 0 ? (int)i + 1 : -1;
+    if (buf[i] < '0' || buf[i] > '9')
+      return -1;
+    v = v * 10 + (size_t)(buf[i] - '0');
+    if (v > MAX_REPLY)
+      return -1;
+    *len = v;
+  }
+  return n < 20 ? 0 : -1;
+}
+
+/* Sends one document and reads its reply into out, writing and reading
+ * concurrently so neither side can block the other on a full pipe. */
+static int exchange(const struct parser_pool *p, struct pool_worker *w,
+                    const char *src, size_t len, struct md_buf *out) {
+  char head[24];
+  size_t head_len = (size_t)snprintf(head, sizeof(head), "%zu\n", len);
+  size_t total = head_len + len, sent = 0;
+
+  char rhead[24];
+  size_t rhead_len = 0, want = 0, got = 0;
+  bool have_header = false;
+  int64_t deadline = now_ms() + p->timeout_ms;
+
+  while (!have_header || got < want) {
+    int64_t left = deadline - now_ms();
+    if (left <= 0)
+      return -1;
+    struct pollfd pf[2] = {{.fd = w->from_fd, .events = POLLIN},
+                           {.fd = w->to_fd, .events = POLLOUT}};
+    int r = poll(pf, sent < total ? 2 : 1, (int)left);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+
+    if (sent < total && pf[1].revents) {
+      bool in_head = sent < head_len;
+      const char *data = in_head ? head + sent : src + (sent - head_len);
+      size_t n = in_head ? head_len - sent : total - sent;
+      ssize_t k = write(w->to_fd, data, n);
+      if (k < 0 && errno != EAGAIN && errno != EINTR)
+        return -1;
+      if (k > 0)
+        sent += (size_t)k;
+    }
+
+    if (!pf[0].revents)
+      continue;
+    ssize_t k;
+    if (!have_header) {
+      k = read(w->from_fd, rhead + rhead_len, sizeof(rhead) - rhead_len);
+    } else {
+      if (md_buf_reserve(out, want - got) < 0)
+        return -1;
+      k = read(w->from_fd, out->data + out->len, want - got);
+    }
+    if (k == 0)
+      return -1; /* the worker exited */
+    if (k < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (have_header) {
+      out->len += (size_t)k;
+      got += (size_t)k;
+      continue;
+    }
+
+    rhead_len += (size_t)k;
+    int h = parse_reply_header(rhead, rhead_len, &want);
+    if (h < 0)
+      return -1;
+    if (h == 0)
+      continue;
+    have_header = true;
+    /* Whatever followed the header is the start of the body. */
+    got = rhead_len - (size_t)h;
+    if (got > want || md_buf_append(out, rhead + h, got) < 0)
+      return -1;
+  }
+  /* A worker that answers before the whole document is in is out of step
+   * with the protocol. */
+  if (sent < total)
+    return -1;
+  if (out->data)
+    out->data[out->len] = '\0';
+  return 0;
+}
+
+int parser_pool_render(struct parser_pool *p, const char *src, size_t len,
+                       struct md_buf *out) {
+  pthread_mutex_lock(&p->lock);
+  struct pool_worker *w = NULL;
+  for (;;) {
+    for (int i = 0; i < p->size && !w; i++)
+      if (!p->workers[i].busy)
+        w = &p->workers[i];
+    if (w)
+      break;
+    pthread_cond_wait(&p->idle, &p->lock);
+  }
+  w->busy = true;
+  pthread_mutex_unlock(&p->lock);
+
+  check_worker(w, p);
+
+  size_t start = out->len;
+  int rc = w->pid > 0 ? exchange(p, w, src, len, out) : -1;
+  if (rc < 0) {
+    out->len = start;
+    if (out->data)
+      out->data[start] = '\0';
+    /* Replace the worker now, so it starts up before the next document. */
+    stop_worker(w);
+    start_worker(w, p);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  w->busy = false;
+  pthread_cond_signal(&p->idle);
+  pthread_mutex_unlock(&p->lock);
+  return rc;
+}
@@ -0,0 +1,28 @@
+#ifndef PARSER_POOL_H
+#define PARSER_POOL_H
+
+#include <stddef.h>
+
+#include "mdparse.h"
+
+/* Pool of long-lived external parser processes. Instead of reading stdin to
+ * EOF, a pooled parser loops over length-framed documents: it reads a
+ * decimal byte count, a newline and that many bytes of Markdown, then
+ * writes the HTML the same way ("<length>\n<bytes>") and waits for the
+ * next document. Workers run with MDSERVE_FRAMED=1 in their environment;
+ * mdparse speaks the protocol then, or with -f. Workers that exit,
+ * break the protocol or overrun the per-document timeout are killed and
+ * replaced at once, so the replacement starts up before it is needed. */
+struct parser_pool;
+
+/* Starts size workers running argv. Returns NULL if none could start. */
+struct parser_pool *parser_pool_create(char *const argv[], int size,
+                                       int timeout_ms);
+void parser_pool_destroy(struct parser_pool *p);
+
+/* Renders len bytes of Markdown at src through an idle worker, appending
+ * the HTML to out. Returns 0, or -1 with out unchanged. */
+int parser_pool_render(struct parser_pool *p, const char *src, size_t len,
+                       struct md_buf *out);
+
+#endif
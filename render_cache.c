@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "render_cache.h"
+
+/* Entry payloads (key followed by body) are stored in chains of fixed-size
+ * blocks, so eviction never has to compact the arena. */
+#define CACHE_BLOCK 4096
+#define NIL (-1)
+
+struct cache_entry {
+  uint64_t hash;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t key_len;
+  uint32_t body_len;
+  int32_t first_block;
+  int32_t lru_prev;
+  int32_t lru_next;
+  int32_t hash_next;
+};
+
+struct render_cache {
+  pthread_mutex_t lock;
+  size_t map_size;
+  size_t budget;
+  int32_t nblocks;
+  int32_t nbuckets;
+  int32_t free_block;
+  int32_t free_entry;
+  int32_t lru_head;
+  int32_t lru_tail;
+  size_t used_blocks;
+  size_t bytes;
+  size_t entries;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  int32_t *buckets;
+  struct cache_entry *ents;
+  int32_t *block_next;
+  char *data;
+};
+
+static size_t align_up(size_t n) { return (n + 63) & ~(size_t)63; }
+
+static uint64_t hash_key(const char *s, size_t n) {
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static void cache_reset(struct render_cache *c) {
+  for (int32_t i = 0; i < c->nbuckets; i++)
+    c->buckets[i] = NIL;
+  for (int32_t i = 0; i < c->nblocks; i++) {
+    c->block_next[i] = i + 1 < c->nblocks ? i + 1 : NIL;
+    c->ents[i].hash_next = i + 1 < c->nblocks ? i + 1 : NIL;
+  }
+  c->free_block = 0;
+  c->free_entry = 0;
+  c->lru_head = c->lru_tail = NIL;
+  c->used_blocks = c->bytes = c->entries = 0;
+}
+
+static void cache_lock(struct render_cache *c) {
+  /* A handler that died mid-update leaves the lists in an unknown state;
+   * start over rather than walk them. */
+  if (pthread_mutex_lock(&c->lock) == EOWNERDEAD) {
+    cache_reset(c);
+    pthread_mutex_consistent(&c->lock);
+  }
+}
+
+static void cache_unlock(struct render_cache *c) {
+  pthread_mutex_unlock(&c->lock);
+}
+
+struct render_cache *render_cache_create(size_t budget) {
+  size_t nblocks = budget / CACHE_BLOCK;
+  if (nblocks < 2 || nblocks > INT32_MAX / 2)
+    return NULL;
+  size_t nbuckets = 1;
+  while (nbuckets < nblocks)
+    nbuckets <<= 1;
+
+  size_t off_buckets = align_up(sizeof(struct render_cache));
+  size_t off_ents = off_buckets + align_up(nbuckets * sizeof(int32_t));
+  size_t off_next = off_ents + align_up(nblocks * sizeof(struct cache_entry));
+  size_t off_data = off_next + align_up(nblocks * sizeof(int32_t));
+  size_t map_size = off_data + nblocks * CACHE_BLOCK;
+
+  char *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  struct render_cache *c = (struct render_cache *)(void *)base;
+  memset(c, 0, sizeof(*c));
+  c->map_size = map_size;
+  c->budget = nblocks * CACHE_BLOCK;
+  c->nblocks = (int32_t)nblocks;
+  c->nbuckets = (int32_t)nbuckets;
+  c->buckets = (int32_t *)(void *)(base + off_buckets);
+  c->ents = (struct cache_entry *)(void *)(base + off_ents);
+  c->block_next = (int32_t *)(void *)(base + off_next);
+  c->data = base + off_data;
+  cache_reset(c);
+
+  pthread_mutexattr_t ma;
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+  int rc = pthread_mutex_init(&c->lock, &ma);
+  pthread_mutexattr_destroy(&ma);
+  if (rc != 0) {
+    munmap(base, map_size);
+    return NULL;
+  }
+  return c;
+}
+
+void render_cache_destroy(struct render_cache *c) {
+  if (!c)
+    return;
+  pthread_mutex_destroy(&c->lock);
+  munmap(c, c->map_size);
+}
+
+/* Copies len bytes starting at logical offset off of a block chain. */
+static void chain_read(const struct render_cache *c, int32_t blk, size_t off,
+                       char *dst, size_t len) {
+  while (off >= CACHE_BLOCK) {
+    blk = c->block_next[blk];
+    off -= CACHE_BLOCK;
+  }
+  while (len) {
+    size_t n = CACHE_BLOCK - off;
+    if (n > len)
+      n = len;
+    memcpy(dst, c->data + (size_t)blk * CACHE_BLOCK + off, n);
+    dst += n;
+    len -= n;
+    off = 0;
+    blk = c->block_next[blk];
+  }
+}
+
+static bool chain_equals(const struct render_cache *c, int32_t blk,
+                         const char *s, size_t len) {
+  while (len) {
+    size_t n = len < CACHE_BLOCK ? len : CACHE_BLOCK;
+    if (memcmp(c->data + (size_t)blk * CACHE_BLOCK, s, n) != 0)
+      return false;
+    s += n;
+    len -= n;
+    blk = c->block_next[blk];
+  }
+  return true;
+}
+
+static size_t blocks_for(size_t len) {
+  return (len + CACHE_BLOCK - 1) / CACHE_BLOCK;
+}
+
+static void lru_unlink(struct render_cache *c, int32_t e) {
+  struct cache_entry *ent = &c->ents[e];
+  if (ent->lru_prev != NIL)
+    c->ents[ent->lru_prev].lru_next = ent->lru_next;
+  else
+    c->lru_head = ent->lru_next;
+  if (ent->lru_next != NIL)
+    c->ents[ent->lru_next].lru_prev = ent->lru_prev;
+  else
+    c->lru_tail = ent->lru_prev;
+}
+
+static void lru_push_front(struct render_cache *c, int32_t e) {
+  struct cache_entry *ent = &c->ents[e];
+  ent->lru_prev = NIL;
+  ent->lru_next = c->lru_head;
+  if (c->lru_head != NIL)
+    c->ents[c->lru_head].lru_prev = e;
+  c->lru_head = e;
+  if (c->lru_tail == NIL)
+    c->lru_tail = e;
+}
+
+static void entry_remove(struct render_cache *c, int32_t e) {
+  struct cache_entry *ent = &c->ents[e];
+  int32_t *pp = &c->buckets[ent->hash & (uint64_t)(c->nbuckets - 1)];
+  while (*pp != NIL && *pp != e)
+    pp = &c->ents[*pp].hash_next;
+  if (*pp == e)
+    *pp = ent->hash_next;
+  lru_unlink(c, e);
+
+  size_t total = (size_t)ent->key_len + ent->body_len;
+  int32_t blk = ent->first_block;
+  int32_t last = blk;
+  while (c->block_next[last] != NIL)
+    last = c->block_next[last];
+  c->block_next[last] = c->free_block;
+  c->free_block = blk;
+  c->used_blocks -= blocks_for(total);
+  c->bytes -= total;
+  c->entries--;
+
+  ent->hash_next = c->free_entry;
+  c->free_entry = e;
+}
+
+static int32_t entry_find(const struct render_cache *c, uint64_t h,
+                          const char *key, size_t key_len) {
+  int32_t e = c->buckets[h & (uint64_t)(c->nbuckets - 1)];
+  while (e != NIL) {
+    const struct cache_entry *ent = &c->ents[e];
+    if (ent->hash == h && ent->key_len == key_len &&
+        chain_equals(c, ent->first_block, key, key_len))
+      return e;
+    e = ent->hash_next;
+  }
+  return NIL;
+}
+
+static bool entry_fresh(const struct cache_entry *ent, const struct stat *st) {
+  return ent->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+         ent->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+         ent->size == (int64_t)st->st_size;
+}
+
+int render_cache_get(struct render_cache *c, const char *path,
+                     const struct stat *st, struct md_buf *out) {
+  if (!c)
+    return 0;
+  size_t key_len = strlen(path);
+  uint64_t h = hash_key(path, key_len);
+
+  cache_lock(c);
+  int32_t e = entry_find(c, h, path, key_len);
+  if (e != NIL && !entry_fresh(&c->ents[e], st)) {
+    entry_remove(c, e);
+    e = NIL;
+  }
+  if (e == NIL) {
+    c->misses++;
+    cache_unlock(c);
+    return 0;
+  }
+
+  const struct cache_entry *ent = &c->ents[e];
+  if (md_buf_reserve(out, ent->body_len) < 0) {
+    cache_unlock(c);
+    return -1;
+  }
+  chain_read(c, ent->first_block, key_len, out->data + out->len,
+             ent->body_len);
+  out->len += ent->body_len;
+  out->data[out->len] = '\0';
+  lru_unlink(c, e);
+  lru_push_front(c, e);
+  c->hits++;
+  cache_unlock(c);
+  return 1;
+}
+
+void render_cache_put(struct render_cache *c, const char *path,
+                      const struct stat *st, const char *body, size_t len) {
+  if (!c)
+    return;
+  size_t key_len = strlen(path);
+  size_t total = key_len + len;
+  size_t need = blocks_for(total);
+  /* One oversized page must not flush the whole cache. */
+  if (len > UINT32_MAX || need == 0 || need > (size_t)c->nblocks / 2)
+    return;
+  uint64_t h = hash_key(path, key_len);
+
+  cache_lock(c);
+  int32_t old = entry_find(c, h, path, key_len);
+  if (old != NIL)
+    entry_remove(c, old);
+  while ((size_t)c->nblocks - c->used_blocks < need || c->free_entry == NIL) {
+    entry_remove(c, c->lru_tail);
+    c->evictions++;
+  }
+
+  int32_t e = c->free_entry;
+  c->free_entry = c->ents[e].hash_next;
+  struct cache_entry *ent = &c->ents[e];
+  ent->hash = h;
+  ent->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+  ent->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+  ent->size = (int64_t)st->st_size;
+  ent->key_len = (uint32_t)key_len;
+  ent->body_len = (uint32_t)len;
+
+  /* Detach need blocks from the free list and fill them in order. */
+  ent->first_block = c->free_block;
+  int32_t blk = c->free_block;
+  size_t done = 0;
+  for (size_t i = 0; i < need; i++) {
+    char *dst = c->data + (size_t)blk * CACHE_BLOCK;
+    size_t room = CACHE_BLOCK;
+    while (room && done < total) {
+      const char *src = done < key_len ? path + done : body + (done - key_len);
+      size_t avail = done < key_len ? key_len - done : total - done;
+      size_t n = avail < room ? avail : room;
+      memcpy(dst, src, n);
+      dst += n;
+      room -= n;
+      done += n;
+    }
+    if (i + 1 == need) {
+      c->free_block = c->block_next[blk];
+      c->block_next[blk] = NIL;
+    } else {
+      blk = c->block_next[blk];
+    }
+  }
+
+  int32_t *bucket = &c->buckets[h & (uint64_t)(c->nbuckets - 1)];
+  ent->hash_next = *bucket;
+  *bucket = e;
+  lru_push_front(c, e);
+  c->used_blocks += need;
+  c->bytes += total;
+  c->entries++;
+  c->insertions++;
+  cache_unlock(c);
+}
+
+void render_cache_stats(struct render_cache *c,
+                        struct render_cache_stats *out) {
+  memset(out, 0, sizeof(*out));
+  if (!c)
+    return;
+  cache_lock(c);
+  out->hits = c->hits;
+  out->misses = c->misses;
+  out->insertions = c->insertions;
+  out->evictions = c->evictions;
+  out->entries = c->entries;
+  out->bytes = c->bytes;
+  out->budget = c->budget;
+  cache_unlock(c);
+}
@@ -0,0 +1,42 @@
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "mdparse.h"
+
+/* Bounded LRU cache of rendered page bodies, keyed by canonical source path
+ * and validated against the source's mtime and size. The cache lives in a
+ * shared anonymous mapping guarded by a process-shared mutex, so entries
+ * inserted by one forked handler are visible to every later one. */
+struct render_cache;
+
+struct render_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+};
+
+/* Returns NULL when budget is too small to hold anything (caching off). */
+struct render_cache *render_cache_create(size_t budget);
+void render_cache_destroy(struct render_cache *c);
+
+/* On a hit appends the cached body to out and returns 1. Returns 0 on a
+ * miss or a stale entry (which is dropped), -1 if out could not grow. */
+int render_cache_get(struct render_cache *c, const char *path,
+                     const struct stat *st, struct md_buf *out);
+
+/* Stores body for path; silently skipped if it cannot fit the budget. */
+void render_cache_put(struct render_cache *c, const char *path,
+                      const struct stat *st, const char *body, size_t len);
+
+void render_cache_stats(struct render_cache *c,
+                        struct render_cache_stats *out);
+
+#endif
@@ -0,0 +1,1562 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mdparse.h"
+#include "search_index.h"
+
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Words are indexed when they are this long in bytes; longer runs are
+ * mostly URLs and hashes. */
+#define WORD_MIN 2
+#define WORD_MAX 48
+#define TITLE_MAX 160
+#define SUMMARY_MAX 240
+/* Per query: words, and indexed words one of them may stand for as a
+ * prefix. */
+#define QUERY_WORDS 8
+#define PREFIX_EXPANSIONS 64
+/* The overlay is merged into a new segment this long after the last
+ * change, or right away once it holds this many documents. */
+#define MERGE_DELAY_MS 2000
+#define OVERLAY_MAX 256
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+#define SEG_MAGIC "mdsearch"
+#define SEG_VERSION 1
+#define SEG_BYTE_ORDER 0x01020304u
+
+/* A segment is this header followed by the sections it points to, each
+ * 8-byte aligned; offsets are from the start of the segment. String
+ * fields are offsets into the string section, whose strings are
+ * NUL-terminated. */
+struct seg_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t ndocs;
+  uint32_t nterms;
+  uint64_t total_len; /* words in all documents */
+  uint64_t docs_off;  /* struct seg_doc[ndocs], sorted by path */
+  uint64_t terms_off; /* struct seg_term[nterms], sorted by text */
+  uint64_t postings_off, postings_len;
+  uint64_t strings_off, strings_len;
+  uint32_t root; /* the directory that was indexed */
+  uint32_t reserved;
+};
+
+struct seg_doc {
+  uint32_t path, title, summary;
+  uint32_t len; /* words */
+  int64_t mtime_ns;
+  int64_t size;
+};
+
+/* A posting list is df pairs of varints: the document, as the difference
+ * from the one before, and how often the term occurs in it. */
+struct seg_term {
+  uint32_t text;
+  uint32_t df;
+  uint64_t postings; /* offset into the postings section */
+};
+
+struct segment {
+  const char *data; /* NULL until the first merge */
+  size_t size;
+  bool mapped;
+  const struct seg_header *hdr;
+  const struct seg_doc *docs;
+  const struct seg_term *terms;
+  const unsigned char *postings;
+  const char *strings;
+  uint32_t ndocs, nterms;
+};
+
+struct live_term {
+  const char *text;
+  uint32_t tf;
+};
+
+/* A document indexed since the segment was built. */
+struct live_doc {
+  char *path, *title, *summary;
+  uint32_t len;
+  int64_t mtime_ns, size;
+  struct live_term *terms; /* sorted by text */
+  size_t nterms;
+  char *texts; /* the terms' bytes */
+};
+
+/* Queries read under the read lock. Only the thread that opened the index,
+ * and then the watcher, change it, taking the write lock for each change;
+ * they read it without locking. */
+struct search_index {
+  pthread_rwlock_t lock;
+  char root[PATH_MAX];
+  int root_fd; /* O_PATH descriptor of root, files are opened beneath it */
+  char *path; /* where the segment is saved, NULL to keep it in memory */
+  struct segment seg;
+  unsigned char *dead; /* per segment document: removed or replaced */
+  size_t ndead;
+  struct live_doc **live;
+  size_t nlive, live_cap;
+  uint64_t total_len; /* words in the documents that can be found */
+  uint64_t merges;
+  int ifd;
+  char **by_wd; /* root-relative path of each watched directory */
+  size_t by_wd_cap;
+  pthread_t watcher;
+  bool watching;
+};
+
+/* Fork-per-connection children inherit the index as a snapshot; make sure
+ * the watcher is not halfway through an update when one is forked. */
+static struct search_index *forked_index;
+
+static void atfork_prepare(void) {
+  if (forked_index)
+    pthread_rwlock_rdlock(&forked_index->lock);
+}
+
+static void atfork_release(void) {
+  if (forked_index)
+    pthread_rwlock_unlock(&forked_index->lock);
+}
+
+static void register_atfork(void) {
+  pthread_atfork(atfork_prepare, atfork_release, atfork_release);
+}
+
+static char *dup_str(const char *s) {
+  size_t n = strlen(s) + 1;
+  char *p = malloc(n);
+  if (p)
+    memcpy(p, s, n);
+  return p;
+}
+
+static int push_ptr(void ***arr, size_t *n, size_t *cap, void *p) {
+  if (*n == *cap) {
+    size_t ncap = *cap ? *cap * 2 : 8;
+    void **na = realloc(*arr, ncap * sizeof(*na));
+    if (!na)
+      return -1;
+    *arr = na;
+    *cap = ncap;
+  }
+  (*arr)[(*n)++] = p;
+  return 0;
+}
+
+static int cmp_str(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Words */
+
+/* Bytes that separate words: ASCII other than letters and digits, and the
+ * UTF-8 punctuation common in prose, U+0080-U+00BF (no-break space, « »)
+ * and U+2000-U+207F (’ “ ” – …). Other non-ASCII bytes are letters.
+ * Returns the length of the separator at p, 0 if there is none. */
+static size_t separator_len(const unsigned char *p, size_t left) {
+  unsigned char c = p[0];
+  if (c < 0x80)
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                   (c >= 'A' && c <= 'Z')
+               ? 0
+               : 1;
+  if (c == 0xc2 && left >= 2 && p[1] >= 0x80 && p[1] <= 0xbf)
+    return 2;
+  if (c == 0xe2 && left >= 3 && (p[1] == 0x80 || p[1] == 0x81))
+    return 3;
+  return 0;
+}
+
+/* Copies the next word of text[*pos..n) into word, lowercased (ASCII and
+ * the Latin-1 capitals, so "È" finds "è"), and returns its length, or 0
+ * at the end. Words outside WORD_MIN..WORD_MAX are skipped, and so are
+ * the targets of Markdown links. */
+static size_t next_word(const char *text, size_t n, size_t *pos,
+                        char word[WORD_MAX + 1]) {
+  const unsigned char *p = (const unsigned char *)text;
+  size_t i = *pos;
+  while (i < n) {
+    size_t sep = separator_len(p + i, n - i);
+    if (sep) {
+      if (p[i] == ']' && i + 1 < n && p[i + 1] == '(') {
+        const unsigned char *close = memchr(p + i, ')', n - i);
+        i = close ? (size_t)(close - p) + 1 : n;
+      } else {
+        i += sep;
+      }
+      continue;
+    }
+    size_t start = i;
+    while (i < n && separator_len(p + i, n - i) == 0)
+      i++;
+    size_t len = i - start;
+    if (len < WORD_MIN || len > WORD_MAX)
+      continue;
+    for (size_t k = 0; k < len; k++) {
+      unsigned char c = p[start + k];
+      if (c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+      else if (k > 0 && p[start + k - 1] == 0xc3 && c >= 0x80 && c <= 0x9e &&
+               c != 0x97)
+        c += 0x20;
+      word[k] = (char)c;
+    }
+    word[len] = '\0';
+    *pos = i;
+    return len;
+  }
+  *pos = n;
+  return 0;
+}
+
+/* Drops a UTF-8 sequence cut short at the end of s[0..len). */
+static size_t utf8_trim(const char *s, size_t len) {
+  size_t i = len;
+  while (i > 0 && ((unsigned char)s[i - 1] & 0xc0) == 0x80)
+    i--;
+  if (i == 0 || (unsigned char)s[i - 1] < 0xc0)
+    return len;
+  unsigned char lead = (unsigned char)s[i - 1];
+  size_t need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+  return len - (i - 1) < need ? i - 1 : len;
+}
+
+/* Markdown source as plain text, markup and link targets dropped and
+ * whitespace collapsed, cut to max bytes with an ellipsis. */
+static char *plain_excerpt(const char *s, size_t n, size_t max) {
+  static const char ellipsis[] = "\xe2\x80\xa6";
+  char *out = malloc(max + sizeof(ellipsis));
+  if (!out)
+    return NULL;
+  size_t len = 0;
+  bool space = false, cut = false;
+  for (size_t i = 0; i < n; i++) {
+    char c = s[i];
+    if (c == ']' && i + 1 < n && s[i + 1] == '(') {
+      const char *close = memchr(s + i, ')', n - i);
+      i = close ? (size_t)(close - s) : n;
+      continue;
+    }
+    if (c == '*' || c == '_' || c == '`' || c == '[' || c == ']')
+      continue;
+    if (c == '\\' && i + 1 < n)
+      c = s[++i];
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      space = len > 0;
+      continue;
+    }
+    if (len + space + 1 > max) {
+      cut = true;
+      break;
+    }
+    if (space)
+      out[len++] = ' ';
+    space = false;
+    out[len++] = c;
+  }
+  if (cut) {
+    len = utf8_trim(out, len);
+    memcpy(out + len, ellipsis, sizeof(ellipsis) - 1);
+    len += sizeof(ellipsis) - 1;
+  }
+  out[len] = '\0';
+  return out;
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+  return p;
+}
+
+/* Picks the title, the first "# " heading, and the summary, the start of
+ * the first paragraph, out of Markdown source. */
+static void describe(const char *src, size_t n, char **title,
+                     char **summary) {
+  const char *p = src, *end = src + n;
+  while (p < end && (!*title || !*summary)) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    const char *eol = nl ? nl : end;
+    const char *l = skip_blanks(p, eol);
+    size_t len = (size_t)(eol - l);
+    if (!*title && len >= 2 && l[0] == '#' && l[1] == ' ') {
+      *title = plain_excerpt(l + 2, len - 2, TITLE_MAX);
+    } else if (!*summary && len > 0 && !strchr("#<!|", l[0])) {
+      /* The paragraph runs to a blank line or a heading. */
+      while (eol < end) {
+        const char *next = eol + 1;
+        const char *nnl = memchr(next, '\n', (size_t)(end - next));
+        const char *neol = nnl ? nnl : end;
+        const char *nl2 = skip_blanks(next, neol);
+        if (nl2 == neol || *nl2 == '#')
+          break;
+        eol = neol;
+      }
+      while (l < eol && strchr("->+ ", *l))
+        l++;
+      *summary = plain_excerpt(l, (size_t)(eol - l), SUMMARY_MAX);
+    }
+    p = eol < end ? eol + 1 : end;
+  }
+}
+
+static void live_free(struct live_doc *d) {
+  if (!d)
+    return;
+  free(d->path);
+  free(d->title);
+  free(d->summary);
+  free(d->terms);
+  free(d->texts);
+  free(d);
+}
+
+static int read_all(int f, struct md_buf *out) {
+  for (;;) {
+    if (md_buf_reserve(out, 64 * 1024) < 0)
+      return -1;
+    ssize_t r = read(f, out->data + out->len, out->cap - out->len - 1);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return r == 0 ? 0 : -1;
+    out->len += (size_t)r;
+  }
+}
+
+/* Counts the distinct words of the sorted list words[0..n) into d. */
+static int collect_terms(struct live_doc *d, char **words, size_t n) {
+  size_t nuniq = 0, bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 || strcmp(words[i], words[i - 1]) != 0) {
+      nuniq++;
+      bytes += strlen(words[i]) + 1;
+    }
+  }
+  d->terms = malloc((nuniq ? nuniq : 1) * sizeof(*d->terms));
+  d->texts = malloc(bytes ? bytes : 1);
+  if (!d->terms || !d->texts)
+    return -1;
+  char *t = d->texts;
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0 && strcmp(words[i], words[i - 1]) == 0) {
+      d->terms[d->nterms - 1].tf++;
+      continue;
+    }
+    size_t len = strlen(words[i]) + 1;
+    memcpy(t, words[i], len);
+    d->terms[d->nterms++] = (struct live_term){t, 1};
+    t += len;
+  }
+  return 0;
+}
+
+/* Opens rel ("/" or "/a/b.md") the way mdserve resolves request paths:
+ * symlinks are followed only while they stay beneath the root, so a
+ * linked file that the server refuses is not indexed either. Without
+ * openat2() the last component must not be a symlink at all. */
+static int open_beneath(const struct search_index *s, const char *rel,
+                        int flags) {
+  const char *p = rel[1] ? rel + 1 : ".";
+  flags |= O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+  struct open_how how = {
+      .flags = (uint64_t)flags,
+      .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+  };
+  int fd = (int)syscall(SYS_openat2, s->root_fd, p, &how, sizeof(how));
+  if (fd >= 0 || (errno != ENOSYS && errno != EPERM && errno != E2BIG))
+    return fd;
+  return openat(s->root_fd, p, flags | O_NOFOLLOW);
+}
+
+/* Reads and indexes the Markdown file rel, whose last component is
+ * name. */
+static struct live_doc *index_file(const struct search_index *s,
+                                   const char *name, const char *rel,
+                                   const struct stat *st) {
+  int f = open_beneath(s, rel, O_RDONLY);
+  if (f < 0)
+    return NULL;
+  struct md_buf src = {0}, arena = {0};
+  int rc = read_all(f, &src);
+  close(f);
+  struct live_doc *d = calloc(1, sizeof(*d));
+  size_t *offs = NULL, noffs = 0, offs_cap = 0;
+  char **words = NULL;
+  if (rc < 0 || !d || !(d->path = dup_str(rel)))
+    goto fail;
+  d->mtime_ns = mtime_ns(st);
+  d->size = (int64_t)st->st_size;
+  const char *text = src.data ? src.data : "";
+  describe(text, src.len, &d->title, &d->summary);
+  if (!d->title) {
+    size_t len = strlen(name) - strlen(".md");
+    d->title = plain_excerpt(name, len, TITLE_MAX);
+  }
+  if (!d->summary)
+    d->summary = dup_str("");
+  if (!d->title || !d->summary)
+    goto fail;
+
+  /* Every word goes into one arena first, so sorting them brings the
+   * repeats of each together. */
+  char word[WORD_MAX + 1];
+  size_t pos = 0, len;
+  while ((len = next_word(text, src.len, &pos, word)) > 0) {
+    if (noffs == offs_cap) {
+      size_t ncap = offs_cap ? offs_cap * 2 : 256;
+      size_t *no = realloc(offs, ncap * sizeof(*no));
+      if (!no)
+        goto fail;
+      offs = no;
+      offs_cap = ncap;
+    }
+    offs[noffs++] = arena.len;
+    if (md_buf_append(&arena, word, len + 1) < 0)
+      goto fail;
+  }
+  d->len = noffs > UINT32_MAX ? UINT32_MAX : (uint32_t)noffs;
+  if (noffs > 0) {
+    words = malloc(noffs * sizeof(*words));
+    if (!words)
+      goto fail;
+    for (size_t i = 0; i < noffs; i++)
+      words[i] = arena.data + offs[i];
+    qsort(words, noffs, sizeof(*words), cmp_str);
+  }
+  if (collect_terms(d, words, noffs) < 0)
+    goto fail;
+  free(words);
+  free(offs);
+  md_buf_free(&arena);
+  md_buf_free(&src);
+  return d;
+
+fail:
+  free(words);
+  free(offs);
+  md_buf_free(&arena);
+  md_buf_free(&src);
+  live_free(d);
+  return NULL;
+}
+
+/* Segments */
+
+static const char *seg_str(const struct segment *g, uint32_t off) {
+  return g->strings + off;
+}
+
+static bool in_segment(uint64_t off, uint64_t len, size_t size) {
+  return off % 8 == 0 && off <= size && len <= size - off;
+}
+
+/* Fills g from data after checking that it is a segment of root that can
+ * be searched without reading out of bounds. */
+static int segment_open(struct segment *g, const char *data, size_t size,
+                        bool mapped, const char *root) {
+  const struct seg_header *h = (const struct seg_header *)(const void *)data;
+  if (size < sizeof(*h) || memcmp(h->magic, SEG_MAGIC, 8) != 0 ||
+      h->version != SEG_VERSION || h->byte_order != SEG_BYTE_ORDER)
+    return -1;
+  if (!in_segment(h->docs_off, (uint64_t)h->ndocs * sizeof(struct seg_doc),
+                  size) ||
+      !in_segment(h->terms_off, (uint64_t)h->nterms * sizeof(struct seg_term),
+                  size) ||
+      !in_segment(h->postings_off, h->postings_len, size) ||
+      !in_segment(h->strings_off, h->strings_len, size) ||
+      h->strings_len == 0 || data[h->strings_off + h->strings_len - 1] != '\0')
+    return -1;
+  *g = (struct segment){
+      .data = data,
+      .size = size,
+      .mapped = mapped,
+      .hdr = h,
+      .docs = (const struct seg_doc *)(const void *)(data + h->docs_off),
+      .terms = (const struct seg_term *)(const void *)(data + h->terms_off),
+      .postings = (const unsigned char *)data + h->postings_off,
+      .strings = data + h->strings_off,
+      .ndocs = h->ndocs,
+      .nterms = h->nterms,
+  };
+  uint64_t slen = h->strings_len;
+  if (h->root >= slen || strcmp(seg_str(g, h->root), root) != 0)
+    return -1;
+  for (uint32_t i = 0; i < g->ndocs; i++)
+    if (g->docs[i].path >= slen || g->docs[i].title >= slen ||
+        g->docs[i].summary >= slen)
+      return -1;
+  for (uint32_t i = 0; i < g->nterms; i++)
+    if (g->terms[i].text >= slen || g->terms[i].postings > h->postings_len)
+      return -1;
+  return 0;
+}
+
+static void segment_release(struct segment *g) {
+  if (g->data && g->mapped)
+    munmap((void *)g->data, g->size);
+  else
+    free((void *)g->data);
+  memset(g, 0, sizeof(*g));
+}
+
+static int segment_load(struct segment *g, const char *path,
+                        const char *root) {
+  int f = open(path, O_RDONLY | O_CLOEXEC);
+  if (f < 0)
+    return -1;
+  struct stat st;
+  void *m = MAP_FAILED;
+  if (fstat(f, &st) == 0 && st.st_size > 0)
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, f, 0);
+  close(f);
+  if (m == MAP_FAILED)
+    return -1;
+  if (segment_open(g, m, (size_t)st.st_size, true, root) < 0) {
+    munmap(m, (size_t)st.st_size);
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes data to path through a temporary file and returns a mapping of
+ * it, or NULL. The mapping is of the file written, whatever another
+ * process renames over path later. */
+static void *segment_save(const char *path, const char *data, size_t size) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+    return NULL;
+  int f = mkostemp(tmp, O_CLOEXEC);
+  if (f < 0)
+    return NULL;
+  size_t off = 0;
+  while (off < size) {
+    ssize_t w = write(f, data + off, size - off);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    off += (size_t)w;
+  }
+  void *m = MAP_FAILED;
+  if (off == size)
+    m = mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
+  close(f);
+  if (m != MAP_FAILED && rename(tmp, path) == 0)
+    return m;
+  if (m != MAP_FAILED)
+    munmap(m, size);
+  unlink(tmp);
+  return NULL;
+}
+
+/* Position of the first segment document whose path is not below key. */
+static uint32_t seg_lower_doc(const struct segment *g, const char *key) {
+  uint32_t lo = 0, hi = g->ndocs;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(seg_str(g, g->docs[mid].path), key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static uint32_t seg_lower_term(const struct segment *g, const char *key) {
+  uint32_t lo = 0, hi = g->nterms;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(seg_str(g, g->terms[mid].text), key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+struct posting_iter {
+  const unsigned char *p, *end;
+  uint32_t left;
+  uint32_t doc;
+  uint32_t ndocs;
+};
+
+static void postings_begin(const struct segment *g, uint32_t t,
+                           struct posting_iter *it) {
+  it->p = g->postings + g->terms[t].postings;
+  it->end = g->postings + g->hdr->postings_len;
+  it->left = g->terms[t].df;
+  it->doc = 0;
+  it->ndocs = g->ndocs;
+}
+
+static bool get_varint(const unsigned char **p, const unsigned char *end,
+                       uint32_t *out) {
+  uint32_t v = 0;
+  for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+    unsigned char c = *(*p)++;
+    v |= (uint32_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int put_varint(struct md_buf *b, uint32_t v) {
+  char tmp[5];
+  size_t n = 0;
+  while (v >= 0x80) {
+    tmp[n++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  tmp[n++] = (char)v;
+  return md_buf_append(b, tmp, n);
+}
+
+/* A corrupt list ends early rather than yield a document out of range. */
+static bool postings_next(struct posting_iter *it, uint32_t *doc,
+                          uint32_t *tf) {
+  uint32_t delta;
+  if (it->left == 0 || !get_varint(&it->p, it->end, &delta) ||
+      !get_varint(&it->p, it->end, tf))
+    return false;
+  uint64_t d = (uint64_t)it->doc + delta;
+  if (d >= it->ndocs)
+    return false;
+  it->doc = (uint32_t)d;
+  it->left--;
+  *doc = it->doc;
+  return true;
+}
+
+/* The overlay */
+
+static long live_find(const struct search_index *s, const char *path) {
+  for (size_t i = 0; i < s->nlive; i++)
+    if (strcmp(s->live[i]->path, path) == 0)
+      return (long)i;
+  return -1;
+}
+
+static uint32_t live_tf(const struct live_doc *d, const char *text) {
+  size_t lo = 0, hi = d->nterms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = strcmp(d->terms[mid].text, text);
+    if (c == 0)
+      return d->terms[mid].tf;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+static bool pending(const struct search_index *s) {
+  return s->nlive > 0 || s->ndead > 0;
+}
+
+/* Whether path is indexed as of st. */
+static bool indexed_as(const struct search_index *s, const char *path,
+                       const struct stat *st) {
+  const struct segment *g = &s->seg;
+  uint32_t i = seg_lower_doc(g, path);
+  if (i < g->ndocs && !s->dead[i] &&
+      strcmp(seg_str(g, g->docs[i].path), path) == 0)
+    return g->docs[i].mtime_ns == mtime_ns(st) &&
+           g->docs[i].size == (int64_t)st->st_size;
+  long j = live_find(s, path);
+  return j >= 0 && s->live[j]->mtime_ns == mtime_ns(st) &&
+         s->live[j]->size == (int64_t)st->st_size;
+}
+
+/* The changes below are made with the write lock held. */
+
+static void kill_seg_doc(struct search_index *s, uint32_t i) {
+  if (s->dead[i])
+    return;
+  s->dead[i] = 1;
+  s->ndead++;
+  s->total_len -= s->seg.docs[i].len;
+}
+
+static void drop_live(struct search_index *s, size_t j) {
+  s->total_len -= s->live[j]->len;
+  live_free(s->live[j]);
+  s->live[j] = s->live[--s->nlive];
+}
+
+static void remove_doc(struct search_index *s, const char *path) {
+  const struct segment *g = &s->seg;
+  uint32_t i = seg_lower_doc(g, path);
+  if (i < g->ndocs && strcmp(seg_str(g, g->docs[i].path), path) == 0)
+    kill_seg_doc(s, i);
+  long j = live_find(s, path);
+  if (j >= 0)
+    drop_live(s, (size_t)j);
+}
+
+static void replace_doc(struct search_index *s, struct live_doc *d) {
+  pthread_rwlock_wrlock(&s->lock);
+  remove_doc(s, d->path);
+  if (push_ptr((void ***)&s->live, &s->nlive, &s->live_cap, d) == 0)
+    s->total_len += d->len;
+  else
+    live_free(d);
+  pthread_rwlock_unlock(&s->lock);
+}
+
+/* Whether name, up to a '/' or the end, is in the sorted list names. */
+static bool has_name(char **names, size_t n, const char *name) {
+  const char *slash = strchr(name, '/');
+  size_t len = slash ? (size_t)(slash - name) : strlen(name);
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = strncmp(names[mid], name, len);
+    if (c == 0 && names[mid][len] == '\0')
+      return true;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return false;
+}
+
+/* Drops what the index holds below rel, the directory with the sorted
+ * lists of files and subdirectories given, but the directory does not. */
+static void drop_vanished(struct search_index *s, const char *rel,
+                          char **files, size_t nfiles, char **dirs,
+                          size_t ndirs) {
+  size_t rlen = strlen(rel);
+  pthread_rwlock_wrlock(&s->lock);
+  const struct segment *g = &s->seg;
+  for (uint32_t i = seg_lower_doc(g, rel); i < g->ndocs; i++) {
+    const char *path = seg_str(g, g->docs[i].path);
+    if (strncmp(path, rel, rlen) != 0)
+      break;
+    const char *rest = path + rlen;
+    if (s->dead[i])
+      continue;
+    if (strchr(rest, '/') ? !has_name(dirs, ndirs, rest)
+                          : !has_name(files, nfiles, rest))
+      kill_seg_doc(s, i);
+  }
+  for (size_t j = s->nlive; j-- > 0;) {
+    const char *path = s->live[j]->path;
+    if (strncmp(path, rel, rlen) != 0)
+      continue;
+    const char *rest = path + rlen;
+    if (strchr(rest, '/') ? !has_name(dirs, ndirs, rest)
+                          : !has_name(files, nfiles, rest))
+      drop_live(s, j);
+  }
+  pthread_rwlock_unlock(&s->lock);
+
+  /* Watches on directories that went away, or moved: the new place is
+   * watched afresh when its parent is looked at. */
+  for (size_t wd = 0; wd < s->by_wd_cap; wd++) {
+    const char *w = s->by_wd[wd];
+    if (!w || strncmp(w, rel, rlen) != 0 || w[rlen] == '\0' ||
+        has_name(dirs, ndirs, w + rlen))
+      continue;
+    inotify_rm_watch(s->ifd, (int)wd);
+    free(s->by_wd[wd]);
+    s->by_wd[wd] = NULL;
+  }
+}
+
+static int set_wd(struct search_index *s, int wd, const char *rel) {
+  if ((size_t)wd >= s->by_wd_cap) {
+    size_t ncap = s->by_wd_cap ? s->by_wd_cap : 64;
+    while (ncap <= (size_t)wd)
+      ncap *= 2;
+    char **na = realloc(s->by_wd, ncap * sizeof(*na));
+    if (!na)
+      return -1;
+    memset(na + s->by_wd_cap, 0, (ncap - s->by_wd_cap) * sizeof(*na));
+    s->by_wd = na;
+    s->by_wd_cap = ncap;
+  }
+  char *copy = dup_str(rel);
+  if (!copy)
+    return -1;
+  free(s->by_wd[wd]);
+  s->by_wd[wd] = copy;
+  return 0;
+}
+
+/* Brings the documents in the directory rel up to date: new and changed
+ * files are indexed, vanished ones dropped. Subdirectories are descended
+ * when all is set, and otherwise only when they are new to the watcher. */
+static void reconcile_dir(struct search_index *s, const char *rel, bool all) {
+  char path[PATH_MAX];
+  int dfd = open_beneath(s, rel, O_RDONLY | O_DIRECTORY);
+  if (dfd < 0)
+    return;
+  DIR *dir = fdopendir(dfd);
+  if (!dir) {
+    close(dfd);
+    return;
+  }
+
+  char **files = NULL, **dirs = NULL;
+  size_t nfiles = 0, files_cap = 0, ndirs = 0, dirs_cap = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    /* Symlinked directories are not descended, as in tree_index;
+     * symlinked files are checked when they are opened. */
+    bool is_dir = ent->d_type == DT_DIR;
+    bool is_file = ent->d_type == DT_REG || ent->d_type == DT_LNK;
+    if (ent->d_type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(dfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+      is_dir = S_ISDIR(st.st_mode);
+      is_file = S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+    }
+    const char *dot = strrchr(ent->d_name, '.');
+    bool is_md = is_file && dot && strcmp(dot, ".md") == 0;
+    if (!is_dir && !is_md)
+      continue;
+    char *name = dup_str(ent->d_name);
+    if (!name ||
+        push_ptr(is_dir ? (void ***)&dirs : (void ***)&files,
+                 is_dir ? &ndirs : &nfiles, is_dir ? &dirs_cap : &files_cap,
+                 name) < 0)
+      free(name);
+  }
+  if (nfiles)
+    qsort(files, nfiles, sizeof(*files), cmp_str);
+  if (ndirs)
+    qsort(dirs, ndirs, sizeof(*dirs), cmp_str);
+
+  /* Files that cannot be resolved beneath the root, or are no regular
+   * files once resolved, count as gone. */
+  char sub[PATH_MAX];
+  struct stat *sts = malloc((nfiles ? nfiles : 1) * sizeof(*sts));
+  if (!sts)
+    goto out;
+  size_t kept = 0;
+  for (size_t i = 0; i < nfiles; i++) {
+    bool ok = snprintf(sub, sizeof(sub), "%s%s", rel, files[i]) <
+                  (int)sizeof(sub) &&
+              fstatat(dfd, files[i], &sts[kept], AT_SYMLINK_NOFOLLOW) == 0;
+    if (ok && S_ISLNK(sts[kept].st_mode)) {
+      int f = open_beneath(s, sub, O_RDONLY);
+      ok = f >= 0 && fstat(f, &sts[kept]) == 0;
+      if (f >= 0)
+        close(f);
+    }
+    if (ok && S_ISREG(sts[kept].st_mode))
+      files[kept++] = files[i];
+    else
+      free(files[i]);
+  }
+  nfiles = kept;
+  drop_vanished(s, rel, files, nfiles, dirs, ndirs);
+
+  for (size_t i = 0; i < nfiles; i++) {
+    snprintf(sub, sizeof(sub), "%s%s", rel, files[i]);
+    if (indexed_as(s, sub, &sts[i]))
+      continue;
+    struct live_doc *d = index_file(s, files[i], sub, &sts[i]);
+    if (d)
+      replace_doc(s, d);
+  }
+  free(sts);
+
+  for (size_t i = 0; i < ndirs; i++) {
+    if (snprintf(sub, sizeof(sub), "%s%s/", rel, dirs[i]) >= (int)sizeof(sub))
+      continue;
+    bool descend = all;
+    if (s->ifd >= 0 && snprintf(path, sizeof(path), "%s%s", s->root, sub) <
+                           (int)sizeof(path)) {
+      int wd = inotify_add_watch(s->ifd, path, WATCH_MASK | IN_ONLYDIR);
+      /* A directory moved within the tree keeps its watch. */
+      if (wd >= 0 && ((size_t)wd >= s->by_wd_cap || !s->by_wd[wd] ||
+                      strcmp(s->by_wd[wd], sub) != 0)) {
+        set_wd(s, wd, sub);
+        descend = true;
+      }
+    }
+    if (descend)
+      reconcile_dir(s, sub, all);
+  }
+
+out:
+  closedir(dir);
+  for (size_t i = 0; i < nfiles; i++)
+    free(files[i]);
+  for (size_t i = 0; i < ndirs; i++)
+    free(dirs[i]);
+  free(files);
+  free(dirs);
+}
+
+/* Merging */
+
+struct posting {
+  uint32_t doc, tf;
+};
+
+struct triple {
+  const char *text;
+  uint32_t doc, tf;
+};
+
+static int cmp_live_path(const void *a, const void *b) {
+  return strcmp((*(struct live_doc *const *)a)->path,
+                (*(struct live_doc *const *)b)->path);
+}
+
+static int cmp_triple(const void *a, const void *b) {
+  const struct triple *x = a, *y = b;
+  int c = strcmp(x->text, y->text);
+  return c ? c : (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+static int cmp_posting(const void *a, const void *b) {
+  const struct posting *x = a, *y = b;
+  return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+static uint32_t add_string(struct md_buf *b, const char *str, bool *failed) {
+  size_t off = b->len;
+  if (off > UINT32_MAX || md_buf_append(b, str, strlen(str) + 1) < 0)
+    *failed = true;
+  return (uint32_t)off;
+}
+
+static int push_posting(struct posting **p, size_t *n, size_t *cap,
+                        uint32_t doc, uint32_t tf) {
+  if (*n == *cap) {
+    size_t ncap = *cap ? *cap * 2 : 64;
+    struct posting *np = realloc(*p, ncap * sizeof(*np));
+    if (!np)
+      return -1;
+    *p = np;
+    *cap = ncap;
+  }
+  (*p)[(*n)++] = (struct posting){doc, tf};
+  return 0;
+}
+
+static int append_section(struct md_buf *out, const struct md_buf *b) {
+  return b->len ? md_buf_append(out, b->data, b->len) : 0;
+}
+
+/* Writes into out the segment that holds the live documents of the
+ * current one and the overlay. Both lists are in path and term order, so
+ * this is a merge of sorted runs. */
+static int build_segment(const struct search_index *s, struct md_buf *out) {
+  const struct segment *g = &s->seg;
+  struct md_buf docs = {0}, terms = {0}, postings = {0}, strings = {0};
+  uint32_t *seg_id = malloc((g->ndocs ? g->ndocs : 1) * sizeof(*seg_id));
+  size_t nlive = s->nlive;
+  struct live_doc **live = malloc((nlive ? nlive : 1) * sizeof(*live));
+  uint32_t *live_id = malloc((nlive ? nlive : 1) * sizeof(*live_id));
+  struct triple *triples = NULL;
+  struct posting *post = NULL;
+  size_t npost = 0, post_cap = 0;
+  bool failed = !seg_id || !live || !live_id;
+  if (failed)
+    goto done;
+  if (nlive)
+    memcpy(live, s->live, nlive * sizeof(*live));
+  qsort(live, nlive, sizeof(*live), cmp_live_path);
+
+  struct seg_header h = {0};
+  memcpy(h.magic, SEG_MAGIC, sizeof(h.magic));
+  h.version = SEG_VERSION;
+  h.byte_order = SEG_BYTE_ORDER;
+  h.root = add_string(&strings, s->root, &failed);
+
+  /* Documents: the segment's survivors and the overlay, renumbered. */
+  uint32_t i = 0, next = 0;
+  size_t j = 0;
+  while (i < g->ndocs || j < nlive) {
+    if (i < g->ndocs && s->dead[i]) {
+      seg_id[i++] = UINT32_MAX;
+      continue;
+    }
+    struct seg_doc d;
+    if (j == nlive ||
+        (i < g->ndocs &&
+         strcmp(seg_str(g, g->docs[i].path), live[j]->path) < 0)) {
+      const struct seg_doc *o = &g->docs[i];
+      d = (struct seg_doc){
+          .path = add_string(&strings, seg_str(g, o->path), &failed),
+          .title = add_string(&strings, seg_str(g, o->title), &failed),
+          .summary = add_string(&strings, seg_str(g, o->summary), &failed),
+          .len = o->len,
+          .mtime_ns = o->mtime_ns,
+          .size = o->size,
+      };
+      seg_id[i++] = next++;
+    } else {
+      const struct live_doc *o = live[j];
+      d = (struct seg_doc){
+          .path = add_string(&strings, o->path, &failed),
+          .title = add_string(&strings, o->title, &failed),
+          .summary = add_string(&strings, o->summary, &failed),
+          .len = o->len,
+          .mtime_ns = o->mtime_ns,
+          .size = o->size,
+      };
+      live_id[j++] = next++;
+    }
+    h.total_len += d.len;
+    if (md_buf_append(&docs, (const char *)&d, sizeof(d)) < 0)
+      failed = true;
+  }
+  h.ndocs = next;
+
+  /* The overlay's postings, in term and then document order. */
+  size_t ntriples = 0;
+  for (j = 0; j < nlive; j++)
+    ntriples += live[j]->nterms;
+  triples = malloc((ntriples ? ntriples : 1) * sizeof(*triples));
+  if (!triples) {
+    failed = true;
+    goto done;
+  }
+  size_t k = 0;
+  for (j = 0; j < nlive; j++)
+    for (size_t t = 0; t < live[j]->nterms; t++)
+      triples[k++] = (struct triple){live[j]->terms[t].text, live_id[j],
+                                     live[j]->terms[t].tf};
+  qsort(triples, ntriples, sizeof(*triples), cmp_triple);
+
+  uint32_t t = 0;
+  k = 0;
+  while (!failed && (t < g->nterms || k < ntriples)) {
+    int c = t == g->nterms ? 1
+            : k == ntriples
+                ? -1
+                : strcmp(seg_str(g, g->terms[t].text), triples[k].text);
+    const char *text = c <= 0 ? seg_str(g, g->terms[t].text) : triples[k].text;
+    npost = 0;
+    if (c <= 0) {
+      struct posting_iter it;
+      uint32_t doc, tf;
+      postings_begin(g, t++, &it);
+      while (postings_next(&it, &doc, &tf))
+        if (seg_id[doc] != UINT32_MAX &&
+            push_posting(&post, &npost, &post_cap, seg_id[doc], tf) < 0)
+          failed = true;
+    }
+    if (c >= 0) {
+      for (; k < ntriples && strcmp(triples[k].text, text) == 0; k++)
+        if (push_posting(&post, &npost, &post_cap, triples[k].doc,
+                         triples[k].tf) < 0)
+          failed = true;
+    }
+    if (npost == 0)
+      continue;
+    if (c == 0)
+      qsort(post, npost, sizeof(*post), cmp_posting);
+    struct seg_term st = {add_string(&strings, text, &failed),
+                          (uint32_t)npost, postings.len};
+    uint32_t prev = 0;
+    for (size_t p = 0; p < npost; p++) {
+      if (put_varint(&postings, post[p].doc - prev) < 0 ||
+          put_varint(&postings, post[p].tf) < 0)
+        failed = true;
+      prev = post[p].doc;
+    }
+    if (md_buf_append(&terms, (const char *)&st, sizeof(st)) < 0)
+      failed = true;
+    h.nterms++;
+  }
+  if (failed)
+    goto done;
+
+  static const char zeros[8];
+  size_t pad = (8 - postings.len % 8) % 8;
+  h.docs_off = sizeof(h);
+  h.terms_off = h.docs_off + docs.len;
+  h.postings_off = h.terms_off + terms.len;
+  h.postings_len = postings.len;
+  h.strings_off = h.postings_off + postings.len + pad;
+  h.strings_len = strings.len;
+  failed = md_buf_reserve(out, h.strings_off + h.strings_len) < 0 ||
+           md_buf_append(out, (const char *)&h, sizeof(h)) < 0 ||
+           append_section(out, &docs) < 0 ||
+           append_section(out, &terms) < 0 ||
+           append_section(out, &postings) < 0 ||
+           md_buf_append(out, zeros, pad) < 0 ||
+           append_section(out, &strings) < 0;
+
+done:
+  free(seg_id);
+  free(live);
+  free(live_id);
+  free(triples);
+  free(post);
+  md_buf_free(&docs);
+  md_buf_free(&terms);
+  md_buf_free(&postings);
+  md_buf_free(&strings);
+  return failed ? -1 : 0;
+}
+
+/* Replaces the segment with g and drops the overlay, which g includes. */
+static int adopt_segment(struct search_index *s, struct segment *g) {
+  unsigned char *dead = calloc(g->ndocs ? g->ndocs : 1, 1);
+  if (!dead)
+    return -1;
+  pthread_rwlock_wrlock(&s->lock);
+  struct segment old = s->seg;
+  unsigned char *old_dead = s->dead;
+  s->seg = *g;
+  s->dead = dead;
+  s->ndead = 0;
+  s->total_len = g->hdr->total_len;
+  for (size_t i = 0; i < s->nlive; i++)
+    live_free(s->live[i]);
+  s->nlive = 0;
+  pthread_rwlock_unlock(&s->lock);
+  segment_release(&old);
+  free(old_dead);
+  return 0;
+}
+
+/* Folds the overlay and the dead entries into a new segment, saved to and
+ * mapped from the index file when there is one. */
+static void merge(struct search_index *s) {
+  struct md_buf b = {0};
+  if (build_segment(s, &b) < 0) {
+    md_buf_free(&b);
+    return;
+  }
+  struct segment g;
+  void *m = s->path ? segment_save(s->path, b.data, b.len) : NULL;
+  int rc;
+  if (m) {
+    rc = segment_open(&g, m, b.len, true, s->root);
+    if (rc < 0)
+      munmap(m, b.len);
+    md_buf_free(&b);
+  } else {
+    rc = segment_open(&g, b.data, b.len, false, s->root);
+    if (rc < 0)
+      md_buf_free(&b);
+  }
+  if (rc == 0 && adopt_segment(s, &g) < 0)
+    segment_release(&g);
+  else if (rc == 0)
+    __atomic_add_fetch(&s->merges, 1, __ATOMIC_RELAXED);
+}
+
+/* Queries */
+
+static double bm25(double idf, uint32_t tf, uint32_t len, double avg_len) {
+  double f = tf;
+  return idf * f * (BM25_K1 + 1) /
+         (f + BM25_K1 * (1 - BM25_B + BM25_B * len / avg_len));
+}
+
+static bool seen_word(const char **words, size_t n, const char *text) {
+  for (size_t i = 0; i < n; i++)
+    if (strcmp(words[i], text) == 0)
+      return true;
+  return false;
+}
+
+/* Collects the indexed words that start with prefix, from the segment and
+ * the overlay, into words: the word itself first if it is indexed, then up
+ * to PREFIX_EXPANSIONS in all. Returns how many there are. */
+static size_t expand_prefix(const struct search_index *s, const char *prefix,
+                            const char **words) {
+  const struct segment *g = &s->seg;
+  size_t plen = strlen(prefix), n = 0;
+  uint32_t t0 = seg_lower_term(g, prefix);
+  if (t0 < g->nterms && strcmp(seg_str(g, g->terms[t0].text), prefix) == 0)
+    words[n++] = seg_str(g, g->terms[t0].text);
+  for (size_t j = 0; j < s->nlive && n == 0; j++)
+    if (live_tf(s->live[j], prefix) > 0)
+      words[n++] = prefix;
+
+  for (uint32_t t = t0; t < g->nterms && n < PREFIX_EXPANSIONS; t++) {
+    const char *text = seg_str(g, g->terms[t].text);
+    if (strncmp(text, prefix, plen) != 0)
+      break;
+    if (!seen_word(words, n, text))
+      words[n++] = text;
+  }
+  for (size_t j = 0; j < s->nlive && n < PREFIX_EXPANSIONS; j++) {
+    const struct live_doc *d = s->live[j];
+    size_t lo = 0, hi = d->nterms;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (strcmp(d->terms[mid].text, prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (; lo < d->nterms && n < PREFIX_EXPANSIONS &&
+           strncmp(d->terms[lo].text, prefix, plen) == 0;
+         lo++)
+      if (!seen_word(words, n, d->terms[lo].text))
+        words[n++] = d->terms[lo].text;
+  }
+  return n;
+}
+
+/* Scores every document containing text, keeping in best the highest
+ * score each has had for the current query word. */
+static void score_term(const struct search_index *s, const char *text,
+                       size_t ndocs, double avg_len, double *best) {
+  const struct segment *g = &s->seg;
+  uint32_t t = seg_lower_term(g, text);
+  bool in_seg =
+      t < g->nterms && strcmp(seg_str(g, g->terms[t].text), text) == 0;
+  struct posting_iter it;
+  uint32_t doc, tf;
+  size_t df = 0;
+  if (in_seg) {
+    postings_begin(g, t, &it);
+    while (postings_next(&it, &doc, &tf))
+      df += !s->dead[doc];
+  }
+  for (size_t j = 0; j < s->nlive; j++)
+    df += live_tf(s->live[j], text) > 0;
+  if (df == 0)
+    return;
+  double idf = log(1 + ((double)ndocs - (double)df + 0.5) / ((double)df + 0.5));
+
+  if (in_seg) {
+    postings_begin(g, t, &it);
+    while (postings_next(&it, &doc, &tf)) {
+      if (s->dead[doc])
+        continue;
+      double sc = bm25(idf, tf, g->docs[doc].len, avg_len);
+      if (sc > best[doc])
+        best[doc] = sc;
+    }
+  }
+  for (size_t j = 0; j < s->nlive; j++) {
+    tf = live_tf(s->live[j], text);
+    if (tf == 0)
+      continue;
+    double sc = bm25(idf, tf, s->live[j]->len, avg_len);
+    if (sc > best[g->ndocs + j])
+      best[g->ndocs + j] = sc;
+  }
+}
+
+static void fill_hit(const struct search_index *s, size_t d, double score,
+                     struct search_hit *h) {
+  const struct segment *g = &s->seg;
+  if (d < g->ndocs) {
+    h->path = seg_str(g, g->docs[d].path);
+    h->title = seg_str(g, g->docs[d].title);
+    h->summary = seg_str(g, g->docs[d].summary);
+  } else {
+    const struct live_doc *l = s->live[d - g->ndocs];
+    h->path = l->path;
+    h->title = l->title;
+    h->summary = l->summary;
+  }
+  h->score = score;
+}
+
+size_t search_index_query(struct search_index *s, const char *query,
+                          struct search_hit *hits, size_t max,
+                          size_t *total) {
+  *total = 0;
+  char words[QUERY_WORDS][WORD_MAX + 1];
+  char word[WORD_MAX + 1];
+  size_t nwords = 0, pos = 0, qlen = strlen(query);
+  while (nwords < QUERY_WORDS && next_word(query, qlen, &pos, word) > 0) {
+    bool seen = false;
+    for (size_t w = 0; w < nwords && !seen; w++)
+      seen = strcmp(words[w], word) == 0;
+    if (!seen)
+      strcpy(words[nwords++], word);
+  }
+
+  size_t n = s->seg.ndocs + s->nlive;
+  size_t ndocs = s->seg.ndocs - s->ndead + s->nlive;
+  if (nwords == 0 || ndocs == 0)
+    return 0;
+  double avg_len = s->total_len ? (double)s->total_len / (double)ndocs : 1;
+  double *score = calloc(n, sizeof(*score));
+  double *best = calloc(n, sizeof(*best));
+  unsigned char *matched = calloc(n, 1);
+  size_t nhits = 0;
+  if (!score || !best || !matched)
+    goto done;
+
+  /* A word counts once per document, with its best-scoring expansion, so
+   * short prefixes do not pile up the scores of many words. */
+  for (size_t w = 0; w < nwords; w++) {
+    const char *expansions[PREFIX_EXPANSIONS];
+    size_t nexp = expand_prefix(s, words[w], expansions);
+    for (size_t e = 0; e < nexp; e++)
+      score_term(s, expansions[e], ndocs, avg_len, best);
+    for (size_t d = 0; d < n; d++) {
+      if (best[d] > 0) {
+        score[d] += best[d];
+        matched[d]++;
+        best[d] = 0;
+      }
+    }
+  }
+
+  for (size_t d = 0; d < n; d++) {
+    if (matched[d] != nwords)
+      continue;
+    (*total)++;
+    if (max == 0 || (nhits == max && score[d] <= hits[max - 1].score))
+      continue;
+    size_t at = nhits < max ? nhits++ : max - 1;
+    while (at > 0 && hits[at - 1].score < score[d]) {
+      hits[at] = hits[at - 1];
+      at--;
+    }
+    fill_hit(s, d, score[d], &hits[at]);
+  }
+
+done:
+  free(score);
+  free(best);
+  free(matched);
+  return nhits;
+}
+
+/* The watcher */
+
+static void handle_events(struct search_index *s, const char *buf,
+                          ssize_t n, int **dirty, size_t *dirty_cap) {
+  bool rescan_all = false;
+  size_t ndirty = 0;
+  for (const char *p = buf; p < buf + n;) {
+    const struct inotify_event *ev = (const struct inotify_event *)p;
+    p += sizeof(*ev) + ev->len;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      rescan_all = true;
+      continue;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= s->by_wd_cap)
+      continue;
+    if (ev->mask & IN_IGNORED) {
+      free(s->by_wd[ev->wd]);
+      s->by_wd[ev->wd] = NULL;
+      continue;
+    }
+    /* Only Markdown files and directories matter. */
+    if (ev->len == 0 || ev->name[0] == '.')
+      continue;
+    const char *dot = strrchr(ev->name, '.');
+    if (!(ev->mask & IN_ISDIR) && (!dot || strcmp(dot, ".md") != 0))
+      continue;
+    bool seen = false;
+    for (size_t i = 0; i < ndirty && !seen; i++)
+      seen = (*dirty)[i] == ev->wd;
+    if (seen)
+      continue;
+    if (ndirty == *dirty_cap) {
+      size_t ncap = *dirty_cap ? *dirty_cap * 2 : 16;
+      int *nd = realloc(*dirty, ncap * sizeof(*nd));
+      if (!nd) {
+        rescan_all = true;
+        continue;
+      }
+      *dirty = nd;
+      *dirty_cap = ncap;
+    }
+    (*dirty)[ndirty++] = ev->wd;
+  }
+
+  if (rescan_all) {
+    reconcile_dir(s, "/", true);
+    return;
+  }
+  /* Look each directory up again: an earlier one may have dropped it. */
+  for (size_t i = 0; i < ndirty; i++) {
+    int wd = (*dirty)[i];
+    if ((size_t)wd >= s->by_wd_cap || !s->by_wd[wd])
+      continue;
+    char rel[PATH_MAX];
+    snprintf(rel, sizeof(rel), "%s", s->by_wd[wd]);
+    reconcile_dir(s, rel, false);
+  }
+}
+
+static void *watch_main(void *arg) {
+  struct search_index *s = arg;
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  int *dirty = NULL;
+  size_t dirty_cap = 0;
+  int oldstate;
+
+  /* Catch up with whatever changed since the index was opened, adding the
+   * watches on the way. */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+  reconcile_dir(s, "/", true);
+  if (pending(s))
+    merge(s);
+  pthread_setcancelstate(oldstate, NULL);
+
+  for (;;) {
+    struct pollfd pfd = {s->ifd, POLLIN, 0};
+    int ready = poll(&pfd, 1, pending(s) ? MERGE_DELAY_MS : -1);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      break;
+    ssize_t n = 0;
+    if (ready > 0) {
+      n = read(s->ifd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    if (ready > 0)
+      handle_events(s, buf, n, &dirty, &dirty_cap);
+    if (ready == 0 || s->nlive >= OVERLAY_MAX)
+      merge(s);
+    pthread_setcancelstate(oldstate, NULL);
+  }
+  free(dirty);
+  return NULL;
+}
+
+struct search_index *search_index_open(const char *root, const char *path) {
+  struct search_index *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  s->ifd = -1;
+  s->root_fd = -1;
+  if (!realpath(root, s->root)) {
+    free(s);
+    return NULL;
+  }
+  /* Relative paths are appended to the root, which must not end in '/'. */
+  if (strcmp(s->root, "/") == 0)
+    s->root[0] = '\0';
+  pthread_rwlock_init(&s->lock, NULL);
+  s->root_fd = open(s->root[0] ? s->root : "/",
+                    O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (s->root_fd < 0 || (path && !(s->path = dup_str(path)))) {
+    search_index_close(s);
+    return NULL;
+  }
+
+  struct segment g;
+  if (s->path && segment_load(&g, s->path, s->root) == 0 &&
+      adopt_segment(s, &g) < 0)
+    segment_release(&g);
+  reconcile_dir(s, "/", true);
+  if (pending(s))
+    merge(s);
+  return s;
+}
+
+int search_index_watch(struct search_index *s) {
+  if (s->watching)
+    return 0;
+  s->ifd = inotify_init1(IN_CLOEXEC);
+  if (s->ifd < 0)
+    return -1;
+  char top[PATH_MAX];
+  int wd = -1;
+  if (snprintf(top, sizeof(top), "%s/", s->root) < (int)sizeof(top))
+    wd = inotify_add_watch(s->ifd, top, WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0 || set_wd(s, wd, "/") < 0 ||
+      pthread_create(&s->watcher, NULL, watch_main, s) != 0) {
+    close(s->ifd);
+    s->ifd = -1;
+    return -1;
+  }
+  s->watching = true;
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, register_atfork);
+  forked_index = s;
+  return 0;
+}
+
+void search_index_close(struct search_index *s) {
+  if (!s)
+    return;
+  if (s->watching) {
+    pthread_cancel(s->watcher);
+    pthread_join(s->watcher, NULL);
+  }
+  if (forked_index == s)
+    forked_index = NULL;
+  if (s->ifd >= 0)
+    close(s->ifd);
+  if (s->root_fd >= 0)
+    close(s->root_fd);
+  for (size_t i = 0; i < s->by_wd_cap; i++)
+    free(s->by_wd[i]);
+  free(s->by_wd);
+  for (size_t i = 0; i < s->nlive; i++)
+    live_free(s->live[i]);
+  free(s->live);
+  segment_release(&s->seg);
+  free(s->dead);
+  free(s->path);
+  pthread_rwlock_destroy(&s->lock);
+  free(s);
+}
+
+void search_index_rdlock(struct search_index *s) {
+  pthread_rwlock_rdlock(&s->lock);
+}
+
+void search_index_unlock(struct search_index *s) {
+  pthread_rwlock_unlock(&s->lock);
+}
+
+void search_index_stats(struct search_index *s,
+                        struct search_index_stats *out) {
+  pthread_rwlock_rdlock(&s->lock);
+  out->documents = s->seg.ndocs - s->ndead + s->nlive;
+  out->terms = s->seg.nterms;
+  out->segment_bytes = s->seg.size;
+  out->saved = s->seg.mapped;
+  out->pending = s->nlive + s->ndead;
+  out->merges = __atomic_load_n(&s->merges, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&s->lock);
+}
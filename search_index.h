@@ -0,0 +1,63 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Full-text index of every .md file below the content root, ranked with
+ * BM25. Most of it is an immutable segment: documents sorted by path and a
+ * sorted term dictionary whose posting lists are delta- and varint-coded,
+ * laid out so that the file it is saved to can be mapped and searched in
+ * place. Files added or changed since the segment was built are kept in a
+ * small in-memory overlay, the segment entries they replace are marked
+ * dead, and the two are merged into a fresh segment once the tree has been
+ * quiet for a moment. A watcher thread keeps it current through inotify.
+ * Hidden files and directories and symlinked directories are skipped, as
+ * in tree_index. */
+struct search_index;
+
+struct search_hit {
+  const char *path;    /* root-relative, e.g. "/a/b.md" */
+  const char *title;   /* the first "# " heading, else the file name */
+  const char *summary; /* start of the first paragraph, may be "" */
+  double score;
+};
+
+struct search_index_stats {
+  size_t documents;
+  size_t terms;         /* in the segment */
+  size_t segment_bytes;
+  bool saved;           /* the segment is mapped from the index file */
+  size_t pending;       /* overlay documents and dead segment entries */
+  uint64_t merges;
+};
+
+/* Indexes root. With a path the segment is saved there and mapped from
+ * it, and a file left by an earlier run on the same root is reused, so
+ * only files whose mtime or size changed since are read again. The file
+ * is specific to the machine that wrote it. Returns NULL if root cannot
+ * be read. */
+struct search_index *search_index_open(const char *root, const char *path);
+/* Starts the watcher thread, also in a process forked after
+ * search_index_open(). Returns -1 if inotify is unavailable, in which
+ * case the index stays a startup snapshot. */
+int search_index_watch(struct search_index *s);
+void search_index_close(struct search_index *s);
+
+/* Hits returned by search_index_query() stay valid until the matching
+ * search_index_unlock(). */
+void search_index_rdlock(struct search_index *s);
+void search_index_unlock(struct search_index *s);
+
+/* Finds the documents that contain every word of query, where a word also
+ * matches as the prefix of a longer one, and stores up to max of them in
+ * hits, best first. Returns how many were stored and sets *total to the
+ * number of matching documents. */
+size_t search_index_query(struct search_index *s, const char *query,
+                          struct search_hit *hits, size_t max, size_t *total);
+
+void search_index_stats(struct search_index *s,
+                        struct search_index_stats *out);
+
+#endif
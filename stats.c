@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* Values below 2 * SUB microseconds get a bucket each; above that every
+ * power of two is split into SUB buckets. Anything from 2^31 us (about 36
+ * minutes) on lands in the last one. */
+#define SUB_BITS 4
+#define SUB (1u << SUB_BITS)
+#define MAX_BITS 31
+#define NBUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB)
+
+struct hist {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[NBUCKETS];
+};
+
+struct stats {
+  struct hist routes[STATS_NROUTES];
+  struct hist parser;
+  uint64_t bytes_sent;
+  int64_t connections_active;
+  uint64_t connections_total;
+  uint64_t file_hits;
+  uint64_t file_misses;
+};
+
+static const char *const route_names[STATS_NROUTES] = {
+    "markdown", "raw",     "listing",      "go",
+    "search",   "metrics", "client_error", "server_error",
+};
+
+const char *stats_route_name(enum stats_route route) {
+  return route_names[route];
+}
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+struct stats *stats_create(void) {
+  void *p = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void stats_destroy(struct stats *s) {
+  if (s)
+    munmap(s, sizeof(*s));
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void add(uint64_t *p, uint64_t v) {
+  __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+static unsigned bucket_index(uint64_t us) {
+  if (us < 2 * SUB)
+    return (unsigned)us;
+  unsigned msb = 63u - (unsigned)__builtin_clzll(us);
+  if (msb >= MAX_BITS)
+    return NBUCKETS - 1;
+  unsigned shift = msb - SUB_BITS;
+  return (shift + 1) * SUB + (unsigned)(us >> shift) - SUB;
+}
+
+/* The largest value, in microseconds, that falls into bucket i. */
+static uint64_t bucket_upper(unsigned i) {
+  if (i < 2 * SUB)
+    return i;
+  unsigned shift = i / SUB - 1;
+  return (((uint64_t)(i % SUB) + SUB + 1) << shift) - 1;
+}
+
+static void record(struct hist *h, uint64_t ns) {
+  add(&h->buckets[bucket_index(ns / 1000)], 1);
+  add(&h->sum_ns, ns);
+  add(&h->count, 1);
+}
+
+void stats_request(struct stats *s, enum stats_route route, int status,
+                   uint64_t ns, uint64_t bytes) {
+  if (!s)
+    return;
+  if (status >= 500)
+    route = STATS_SERVER_ERROR;
+  else if (status >= 400)
+    route = STATS_CLIENT_ERROR;
+  record(&s->routes[route], ns);
+  add(&s->bytes_sent, bytes);
+}
+
+void stats_parser(struct stats *s, uint64_t ns) {
+  if (s)
+    record(&s->parser, ns);
+}
+
+void stats_connection(struct stats *s, int delta) {
+  if (!s)
+    return;
+  __atomic_fetch_add(&s->connections_active, delta, __ATOMIC_RELAXED);
+  if (delta > 0)
+    add(&s->connections_total, (uint64_t)delta);
+}
+
+void stats_file_cache(struct stats *s, bool hit) {
+  if (s)
+    add(hit ? &s->file_hits : &s->file_misses, 1);
+}
+
+static uint64_t load(const uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* Appends one summary series: the quantiles read off a snapshot of h,
+ * then its sum and count. labels is "" or a "name=\"value\"" list. */
+static void format_summary(struct md_buf *out, const char *name,
+                           const char *labels, const struct hist *h) {
+  uint64_t counts[NBUCKETS], total = 0;
+  for (unsigned i = 0; i < NBUCKETS; i++) {
+    counts[i] = load(&h->buckets[i]);
+    total += counts[i];
+  }
+  const char *sep = labels[0] ? "," : "";
+  for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+    if (total == 0) {
+      md_buf_printf(out, "%s{%s%squantile=\"%g\"} NaN\n", name, labels, sep,
+                    quantiles[q]);
+      continue;
+    }
+    double want = quantiles[q] * (double)total;
+    uint64_t rank = (uint64_t)want, seen = 0;
+    if ((double)rank < want || rank == 0)
+      rank++;
+    unsigned i = 0;
+    while (i < NBUCKETS - 1 && (seen += counts[i]) < rank)
+      i++;
+    md_buf_printf(out, "%s{%s%squantile=\"%g\"} %.6f\n", name, labels, sep,
+                  quantiles[q], (double)bucket_upper(i) / 1e6);
+  }
+  const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+  md_buf_printf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close,
+                (double)load(&h->sum_ns) / 1e9);
+  md_buf_printf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+                (unsigned long long)load(&h->count));
+}
+
+static void format_metric(struct md_buf *out, const char *name,
+                          const char *type, const char *help, double v) {
+  md_buf_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help,
+                name, type, name, v);
+}
+
+static double ratio(uint64_t hits, uint64_t misses) {
+  return hits + misses ? (double)hits / (double)(hits + misses) : 0;
+}
+
+void stats_format(struct stats *s, const struct render_cache_stats *rc,
+                  struct md_buf *out) {
+  if (!s)
+    return;
+  md_buf_printf(out, "# HELP mdserve_request_duration_seconds Time from a "
+                     "complete request head to the end of its response.\n"
+                     "# TYPE mdserve_request_duration_seconds summary\n");
+  for (int r = 0; r < STATS_NROUTES; r++) {
+    char labels[64];
+    snprintf(labels, sizeof(labels), "route=\"%s\"",
+             stats_route_name((enum stats_route)r));
+    format_summary(out, "mdserve_request_duration_seconds", labels,
+                   &s->routes[r]);
+  }
+  md_buf_printf(out, "# HELP mdserve_parser_duration_seconds Wall time of "
+                     "Markdown renders, cache misses only.\n"
+                     "# TYPE mdserve_parser_duration_seconds summary\n");
+  format_summary(out, "mdserve_parser_duration_seconds", "", &s->parser);
+
+  format_metric(out, "mdserve_sent_bytes_total", "counter",
+                "Response bytes written to clients.",
+                (double)load(&s->bytes_sent));
+  format_metric(
+      out, "mdserve_connections_active", "gauge",
+      "Client connections open now.",
+      (double)__atomic_load_n(&s->connections_active, __ATOMIC_RELAXED));
+  format_metric(out, "mdserve_connections_total", "counter",
+                "Client connections accepted.",
+                (double)load(&s->connections_total));
+
+  if (rc) {
+    format_metric(out, "mdserve_render_cache_hits_total", "counter",
+                  "Rendered pages served from the cache.", (double)rc->hits);
+    format_metric(out, "mdserve_render_cache_misses_total", "counter",
+                  "Render cache lookups that had to render.",
+                  (double)rc->misses);
+    format_metric(out, "mdserve_render_cache_evictions_total", "counter",
+                  "Render cache entries evicted for space.",
+                  (double)rc->evictions);
+    format_metric(out, "mdserve_render_cache_bytes", "gauge",
+                  "Bytes held by the render cache.", (double)rc->bytes);
+    format_metric(out, "mdserve_render_cache_hit_ratio", "gauge",
+                  "Render cache hits over lookups since start.",
+                  ratio(rc->hits, rc->misses));
+  }
+  uint64_t fh = load(&s->file_hits), fm = load(&s->file_misses);
+  format_metric(out, "mdserve_file_cache_hits_total", "counter",
+                "Static files served from the open file cache.", (double)fh);
+  format_metric(out, "mdserve_file_cache_misses_total", "counter",
+                "Static file lookups that had to open the file.",
+                (double)fm);
+  format_metric(out, "mdserve_file_cache_hit_ratio", "gauge",
+                "File cache hits over lookups since start.", ratio(fh, fm));
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mdparse.h"
+#include "render_cache.h"
+
+/* Server metrics in a shared anonymous mapping, so forked handlers and
+ * prefork workers all count into the one set the /__stats endpoint
+ * reports. Updates are lock-free atomic adds. Latencies go into log-linear
+ * (HDR-style) histograms with 16 buckets per power of two microseconds,
+ * which bounds the error of a reported percentile to 1/16. Every function
+ * accepts a NULL set and then does nothing. */
+struct stats;
+
+/* What a response was for. Responses with a 4xx or 5xx status are
+ * counted under the error classes instead of their route. */
+enum stats_route {
+  STATS_MARKDOWN, /* rendered page */
+  STATS_RAW,      /* file sent as is */
+  STATS_LISTING,  /* directory listing or its trailing-slash redirect */
+  STATS_GO,       /* /go date redirect */
+  STATS_SEARCH,   /* /search results */
+  STATS_METRICS,  /* the stats endpoint itself */
+  STATS_CLIENT_ERROR,
+  STATS_SERVER_ERROR,
+  STATS_NROUTES
+};
+
+/* The label a route is reported under, e.g. "markdown". */
+const char *stats_route_name(enum stats_route route);
+
+/* Returns NULL if the mapping cannot be made. */
+struct stats *stats_create(void);
+void stats_destroy(struct stats *s);
+
+uint64_t stats_now_ns(void);
+
+void stats_request(struct stats *s, enum stats_route route, int status,
+                   uint64_t ns, uint64_t bytes);
+void stats_parser(struct stats *s, uint64_t ns);
+void stats_connection(struct stats *s, int delta);
+void stats_file_cache(struct stats *s, bool hit);
+
+/* Appends every metric in the Prometheus text format to out. rc is the
+ * render cache's counters, or NULL. */
+void stats_format(struct stats *s, const struct render_cache_stats *rc,
+                  struct md_buf *out);
+
+#endif
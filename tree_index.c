@@ -0,0 +1,551 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mdparse.h"
+#include "tree_index.h"
+
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |      \
+   IN_MOVE_SELF)
+
+/* The front page lists the tree this many levels below its top level. */
+#define NAV_DEPTH 8
+
+struct tree_index {
+  pthread_rwlock_t lock;
+  char root[PATH_MAX];
+  struct tree_dir *top;
+  int ifd;
+  struct tree_dir **by_wd;
+  size_t by_wd_cap;
+  pthread_t watcher;
+  bool watching;
+  uint64_t generation; /* bumped after every batch of changes */
+};
+
+/* Fork-per-connection children inherit the index as a snapshot; make sure
+ * the watcher is not halfway through an update when one is forked. */
+static struct tree_index *forked_index;
+
+static void atfork_prepare(void) {
+  if (forked_index)
+    pthread_rwlock_rdlock(&forked_index->lock);
+}
+
+static void atfork_release(void) {
+  if (forked_index)
+    pthread_rwlock_unlock(&forked_index->lock);
+}
+
+static void register_atfork(void) {
+  pthread_atfork(atfork_prepare, atfork_release, atfork_release);
+}
+
+static char *dup_str(const char *s) {
+  size_t n = strlen(s) + 1;
+  char *p = malloc(n);
+  if (p)
+    memcpy(p, s, n);
+  return p;
+}
+
+static int push_ptr(void ***arr, size_t *n, size_t *cap, void *p) {
+  if (*n == *cap) {
+    size_t ncap = *cap ? *cap * 2 : 8;
+    void **na = realloc(*arr, ncap * sizeof(*na));
+    if (!na)
+      return -1;
+    *arr = na;
+    *cap = ncap;
+  }
+  (*arr)[(*n)++] = p;
+  return 0;
+}
+
+static void set_wd(struct tree_index *t, int wd, struct tree_dir *d) {
+  if (wd < 0)
+    return;
+  if ((size_t)wd >= t->by_wd_cap) {
+    size_t ncap = t->by_wd_cap ? t->by_wd_cap : 64;
+    while (ncap <= (size_t)wd)
+      ncap *= 2;
+    struct tree_dir **na = realloc(t->by_wd, ncap * sizeof(*na));
+    if (!na)
+      return;
+    memset(na + t->by_wd_cap, 0, (ncap - t->by_wd_cap) * sizeof(*na));
+    t->by_wd = na;
+    t->by_wd_cap = ncap;
+  }
+  t->by_wd[wd] = d;
+}
+
+static void free_pages(struct tree_dir *d) {
+  for (size_t i = 0; i < d->npages; i++)
+    free(d->pages[i]);
+  free(d->pages);
+  free(d->index_page);
+  d->pages = NULL;
+  d->npages = 0;
+  d->index_page = NULL;
+}
+
+static void free_subtree(struct tree_index *t, struct tree_dir *d) {
+  for (size_t i = 0; i < d->nsubdirs; i++)
+    free_subtree(t, d->subdirs[i]);
+  if (d->wd >= 0) {
+    if (t->ifd >= 0)
+      inotify_rm_watch(t->ifd, d->wd);
+    set_wd(t, d->wd, NULL);
+  }
+  free_pages(d);
+  free(d->subdirs);
+  free(d->nav);
+  free(d->tree_html);
+  free(d->name);
+  free(d->rel);
+  free(d);
+}
+
+static struct tree_dir *new_dir(struct tree_dir *parent, const char *name,
+                                bool is_link) {
+  struct tree_dir *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->wd = -1;
+  d->parent = parent;
+  d->depth = parent ? parent->depth + 1 : 0;
+  d->is_link = is_link;
+  d->name = dup_str(name);
+  size_t plen = parent ? strlen(parent->rel) : 0;
+  size_t nlen = strlen(name);
+  d->rel = malloc(plen + nlen + 2);
+  if (!d->name || !d->rel) {
+    free(d->name);
+    free(d->rel);
+    free(d);
+    return NULL;
+  }
+  if (parent) {
+    memcpy(d->rel, parent->rel, plen);
+    memcpy(d->rel + plen, name, nlen);
+    d->rel[plen + nlen] = '/';
+    d->rel[plen + nlen + 1] = '\0';
+  } else {
+    strcpy(d->rel, "/");
+  }
+  return d;
+}
+
+static void append_str(struct md_buf *b, const char *s) {
+  md_buf_append(b, s, strlen(s));
+}
+
+static void take_buf(struct md_buf *b, char **data, size_t *len) {
+  free(*data);
+  *data = b->data;
+  *len = b->len;
+}
+
+/* Rebuilds the nested list of d's subdirectories from the children's own
+ * lists. Below NAV_DEPTH it is empty, as the front page stops there. */
+static void build_tree(struct tree_dir *d) {
+  struct md_buf b = {0};
+  d->tree_mtime = d->mtime;
+  if (d->depth <= NAV_DEPTH && d->nsubdirs > 0) {
+    append_str(&b, "<ul>\n");
+    for (size_t i = 0; i < d->nsubdirs; i++) {
+      const struct tree_dir *sub = d->subdirs[i];
+      md_buf_printf(&b, "<li><a href=\"%s\">%s</a>", sub->rel, sub->name);
+      if (sub->tree_len)
+        md_buf_append(&b, sub->tree_html, sub->tree_len);
+      if (sub->tree_mtime > d->tree_mtime)
+        d->tree_mtime = sub->tree_mtime;
+      append_str(&b, "</li>\n");
+    }
+    append_str(&b, "</ul>\n");
+  }
+  take_buf(&b, &d->tree_html, &d->tree_len);
+}
+
+static void build_nav(struct tree_dir *d) {
+  struct md_buf b = {0};
+  if (!d->parent) {
+    append_str(&b, "<h2>Articoli</h2>\n");
+    if (d->tree_len)
+      md_buf_append(&b, d->tree_html, d->tree_len);
+  } else {
+    append_str(&b, "<h2>Articoli correlati</h2>\n<ul>\n");
+    for (size_t i = 0; i < d->nsubdirs; i++)
+      md_buf_printf(&b, "<li><a href=\"%s\">%s</a></li>\n",
+                    d->subdirs[i]->rel, d->subdirs[i]->name);
+    append_str(&b, "</ul>\n");
+  }
+  take_buf(&b, &d->nav, &d->nav_len);
+  d->nav_mtime = d->parent ? d->mtime : d->tree_mtime;
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < d->nav_len; i++) {
+    h ^= (unsigned char)d->nav[i];
+    h *= 1099511628211ULL;
+  }
+  d->nav_hash = h;
+}
+
+/* After d's subdirectories changed only the lists of its ancestors embed
+ * them: the nested tree up to the root. */
+static void update_ancestors(struct tree_dir *d) {
+  if (d->depth > NAV_DEPTH)
+    return;
+  for (struct tree_dir *p = d->parent; p; p = p->parent) {
+    build_tree(p);
+    if (!p->parent)
+      build_nav(p);
+  }
+}
+
+static void rebuild_all(struct tree_dir *d) {
+  for (size_t i = 0; i < d->nsubdirs; i++)
+    rebuild_all(d->subdirs[i]);
+  build_tree(d);
+  build_nav(d);
+}
+
+static int scan_dir(struct tree_index *t, struct tree_dir *d);
+
+/* Adds the inotify watch before reading, so no change can slip in between
+ * the scan and the watch. */
+static int attach_dir(struct tree_index *t, struct tree_dir *d) {
+  if (d->is_link) {
+    build_tree(d);
+    build_nav(d);
+    return 0;
+  }
+  if (t->ifd >= 0) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", t->root, d->rel) <
+        (int)sizeof(path)) {
+      d->wd = inotify_add_watch(t->ifd, path, WATCH_MASK | IN_ONLYDIR);
+      set_wd(t, d->wd, d);
+    }
+  }
+  return scan_dir(t, d);
+}
+
+static struct tree_dir *take_child(struct tree_dir *d, const char *name,
+                                   bool is_link, size_t *pos) {
+  for (size_t i = 0; i < d->nsubdirs; i++) {
+    struct tree_dir *c = d->subdirs[i];
+    if (c && c->is_link == is_link && strcmp(c->name, name) == 0) {
+      d->subdirs[i] = NULL;
+      *pos = i;
+      return c;
+    }
+  }
+  return NULL;
+}
+
+/* Re-reads one directory, keeping the subtrees of subdirectories that are
+ * still there and scanning new ones. Page choice follows pick_page():
+ * index.md, index.html, then the first .md, then the first .html.
+ * Returns 1 if the list of subdirectories changed, which is when the
+ * navigation fragments are rebuilt. */
+static int scan_dir(struct tree_index *t, struct tree_dir *d) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s%s", t->root, d->rel) >=
+      (int)sizeof(path))
+    return -1;
+  int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0)
+    return -1;
+  struct stat dst;
+  if (fstat(dfd, &dst) == 0)
+    d->mtime = (int64_t)dst.st_mtime;
+  DIR *dir = fdopendir(dfd);
+  if (!dir) {
+    close(dfd);
+    return -1;
+  }
+
+  char **pages = NULL;
+  size_t npages = 0, pages_cap = 0;
+  struct tree_dir **subdirs = NULL, **fresh = NULL;
+  size_t nsubdirs = 0, subdirs_cap = 0, nfresh = 0, fresh_cap = 0;
+  const char *first_md = NULL, *first_html = NULL;
+  bool has_index_md = false, has_index_html = false;
+  bool changed = false;
+
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    bool is_dir = ent->d_type == DT_DIR;
+    bool is_link = false;
+    if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dfd, ent->d_name, &st, 0) != 0)
+        continue;
+      is_dir = S_ISDIR(st.st_mode);
+      is_link = ent->d_type == DT_LNK;
+    }
+
+    if (is_dir) {
+      size_t pos = 0;
+      struct tree_dir *c = take_child(d, ent->d_name, is_link, &pos);
+      if (c && pos != nsubdirs)
+        changed = true;
+      if (!c) {
+        c = new_dir(d, ent->d_name, is_link);
+        if (c && push_ptr((void ***)&fresh, &nfresh, &fresh_cap, c) < 0) {
+          free_subtree(t, c);
+          c = NULL;
+        }
+      }
+      if (c && push_ptr((void ***)&subdirs, &nsubdirs, &subdirs_cap, c) < 0) {
+        if (nfresh && fresh[nfresh - 1] == c)
+          nfresh--;
+        free_subtree(t, c);
+      }
+      continue;
+    }
+
+    const char *dot = strrchr(ent->d_name, '.');
+    if (!dot || (strcmp(dot, ".md") != 0 && strcmp(dot, ".html") != 0))
+      continue;
+    char *name = dup_str(ent->d_name);
+    if (!name || push_ptr((void ***)&pages, &npages, &pages_cap, name) < 0) {
+      free(name);
+      continue;
+    }
+    if (strcmp(dot, ".md") == 0) {
+      if (strcmp(name, "index.md") == 0)
+        has_index_md = true;
+      else if (!first_md || strcmp(name, first_md) < 0)
+        first_md = name;
+    } else {
+      if (strcmp(name, "index.html") == 0)
+        has_index_html = true;
+      else if (!first_html || strcmp(name, first_html) < 0)
+        first_html = name;
+    }
+  }
+  closedir(dir);
+
+  /* Drop vanished subdirectories before watching new ones: a renamed
+   * directory keeps its inode, and inotify hands back the same wd. */
+  for (size_t i = 0; i < d->nsubdirs; i++) {
+    if (d->subdirs[i]) {
+      free_subtree(t, d->subdirs[i]);
+      changed = true;
+    }
+  }
+  free(d->subdirs);
+  d->subdirs = subdirs;
+  d->nsubdirs = nsubdirs;
+  for (size_t i = 0; i < nfresh; i++)
+    attach_dir(t, fresh[i]);
+  free(fresh);
+  if (nfresh > 0 || changed || !d->nav) {
+    build_tree(d);
+    build_nav(d);
+    changed = true;
+  }
+
+  const char *pick = NULL;
+  bool pick_md = false;
+  if (has_index_md) {
+    pick = "index.md";
+    pick_md = true;
+  } else if (has_index_html) {
+    pick = "index.html";
+  } else if (first_md) {
+    pick = first_md;
+    pick_md = true;
+  } else if (first_html) {
+    pick = first_html;
+  }
+  char *index_page = pick ? dup_str(pick) : NULL;
+  free_pages(d);
+  d->pages = pages;
+  d->npages = npages;
+  d->index_page = index_page;
+  d->index_is_markdown = pick_md;
+  return changed ? 1 : 0;
+}
+
+struct tree_index *tree_index_open(const char *root) {
+  struct tree_index *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NULL;
+  if (!realpath(root, t->root)) {
+    free(t);
+    return NULL;
+  }
+  /* Relative paths are appended to the root, which must not end in '/'. */
+  if (strcmp(t->root, "/") == 0)
+    t->root[0] = '\0';
+  pthread_rwlock_init(&t->lock, NULL);
+  t->ifd = inotify_init1(IN_CLOEXEC);
+  t->top = new_dir(NULL, "", false);
+  if (!t->top || attach_dir(t, t->top) < 0) {
+    tree_index_close(t);
+    return NULL;
+  }
+  return t;
+}
+
+static void rescan_tree(struct tree_index *t, struct tree_dir *d) {
+  scan_dir(t, d);
+  for (size_t i = 0; i < d->nsubdirs; i++)
+    if (!d->subdirs[i]->is_link)
+      rescan_tree(t, d->subdirs[i]);
+}
+
+static void *watch_main(void *arg) {
+  struct tree_index *t = arg;
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  int *dirty = NULL;
+  size_t ndirty = 0, dirty_cap = 0;
+
+  for (;;) {
+    ssize_t n = read(t->ifd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_rwlock_wrlock(&t->lock);
+    bool rescan_all = false;
+    ndirty = 0;
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        rescan_all = true;
+        continue;
+      }
+      if (ev->mask & IN_IGNORED || ev->wd < 0)
+        continue;
+      /* A directory that went away is dropped by its parent's rescan. */
+      int wd = ev->wd;
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if ((size_t)wd >= t->by_wd_cap || !t->by_wd[wd] ||
+            !t->by_wd[wd]->parent)
+          continue;
+        wd = t->by_wd[wd]->parent->wd;
+      }
+      bool seen = false;
+      for (size_t i = 0; i < ndirty; i++)
+        seen = seen || dirty[i] == wd;
+      if (!seen && ndirty == dirty_cap) {
+        size_t ncap = dirty_cap ? dirty_cap * 2 : 16;
+        int *nd = realloc(dirty, ncap * sizeof(*nd));
+        if (!nd) {
+          rescan_all = true;
+          continue;
+        }
+        dirty = nd;
+        dirty_cap = ncap;
+      }
+      if (!seen)
+        dirty[ndirty++] = wd;
+    }
+
+    if (rescan_all) {
+      rescan_tree(t, t->top);
+      rebuild_all(t->top);
+    } else {
+      /* Look each node up again: an earlier rescan may have freed it. */
+      for (size_t i = 0; i < ndirty; i++) {
+        if (dirty[i] < 0 || (size_t)dirty[i] >= t->by_wd_cap)
+          continue;
+        struct tree_dir *d = t->by_wd[dirty[i]];
+        if (d && scan_dir(t, d) > 0)
+          update_ancestors(d);
+      }
+    }
+    __atomic_add_fetch(&t->generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&t->lock);
+    pthread_setcancelstate(oldstate, NULL);
+  }
+  free(dirty);
+  return NULL;
+}
+
+int tree_index_watch(struct tree_index *t) {
+  if (t->ifd < 0 || t->watching)
+    return t->watching ? 0 : -1;
+  if (pthread_create(&t->watcher, NULL, watch_main, t) != 0)
+    return -1;
+  t->watching = true;
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, register_atfork);
+  forked_index = t;
+  return 0;
+}
+
+void tree_index_close(struct tree_index *t) {
+  if (!t)
+    return;
+  if (t->watching) {
+    pthread_cancel(t->watcher);
+    pthread_join(t->watcher, NULL);
+  }
+  if (forked_index == t)
+    forked_index = NULL;
+  if (t->top)
+    free_subtree(t, t->top);
+  if (t->ifd >= 0)
+    close(t->ifd);
+  free(t->by_wd);
+  pthread_rwlock_destroy(&t->lock);
+  free(t);
+}
+
+uint64_t tree_index_generation(const struct tree_index *t) {
+  return __atomic_load_n(&t->generation, __ATOMIC_ACQUIRE);
+}
+
+void tree_index_rdlock(struct tree_index *t) {
+  pthread_rwlock_rdlock(&t->lock);
+}
+
+void tree_index_unlock(struct tree_index *t) {
+  pthread_rwlock_unlock(&t->lock);
+}
+
+const struct tree_dir *tree_index_find(const struct tree_index *t,
+                                       const char *rel_dir) {
+  const struct tree_dir *d = t->top;
+  const char *p = rel_dir;
+  while (d && *p) {
+    while (*p == '/')
+      p++;
+    if (!*p)
+      break;
+    const char *end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    const struct tree_dir *next = NULL;
+    for (size_t i = 0; i < d->nsubdirs; i++) {
+      const struct tree_dir *c = d->subdirs[i];
+      if (strncmp(c->name, p, len) == 0 && c->name[len] == '\0') {
+        next = c;
+        break;
+      }
+    }
+    d = next;
+    p += len;
+  }
+  return d;
+}
@@ -0,0 +1,63 @@
+#ifndef TREE_INDEX_H
+#define TREE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* In-memory index of the content root: every directory with the page
+ * pick_page() would choose, its .md/.html files, its subdirectories in
+ * directory order and its prebuilt navigation HTML. A watcher thread keeps
+ * it current through inotify, so request handlers never call
+ * opendir/readdir/stat on the tree. */
+struct tree_index;
+
+struct tree_dir {
+  char *name; /* entry name, "" for the root */
+  char *rel;  /* "/" or "/a/b/", always with a trailing slash */
+  struct tree_dir *parent;
+  char *index_page; /* chosen page name, NULL if there is none */
+  bool index_is_markdown;
+  bool is_link; /* symlinked directory, listed but not descended */
+  char **pages; /* .md and .html files */
+  size_t npages;
+  struct tree_dir **subdirs;
+  size_t nsubdirs;
+  int depth; /* 0 for the root */
+  int wd;
+  /* Related-articles fragment served with this directory's pages:
+   * "Articoli" and the nested tree for the root, "Articoli correlati" and
+   * the immediate subdirectories elsewhere. */
+  char *nav;
+  size_t nav_len;
+  char *tree_html; /* nested <ul> of the subtree, spliced into the root's */
+  size_t tree_len;
+  /* Validators for pages that embed nav: a hash of it and the newest
+   * directory mtime it was built from. */
+  uint64_t nav_hash;
+  int64_t nav_mtime;
+  int64_t mtime;      /* of the directory itself */
+  int64_t tree_mtime; /* newest mtime within tree_html */
+};
+
+/* Scans root; returns NULL if it cannot be read. */
+struct tree_index *tree_index_open(const char *root);
+/* Starts the inotify watcher thread. Returns -1 if inotify is unavailable,
+ * in which case the index stays a startup snapshot. */
+int tree_index_watch(struct tree_index *t);
+void tree_index_close(struct tree_index *t);
+
+/* Changes whenever the watcher sees an entry created, deleted or renamed
+ * anywhere in the watched tree, so callers can tell whether what they
+ * resolved earlier may have moved. Hidden directories and symlinked
+ * subtrees are not watched. */
+uint64_t tree_index_generation(const struct tree_index *t);
+
+/* Nodes returned by tree_index_find() stay valid until the matching
+ * tree_index_unlock(). */
+void tree_index_rdlock(struct tree_index *t);
+void tree_index_unlock(struct tree_index *t);
+const struct tree_dir *tree_index_find(const struct tree_index *t,
+                                       const char *rel_dir);
+
+#endif
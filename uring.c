@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, const void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+int uring_init(struct uring *u, unsigned entries) {
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+  struct io_uring_params p = {0};
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * entries;
+  int fd = sys_setup(entries, &p);
+  if (fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  u->fd = fd;
+  u->features = p.features;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size)
+      u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      u->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_head = (unsigned *)(void *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(void *)(sq + p.sq_off.tail);
+  u->sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+  u->sq_mask = *(unsigned *)(void *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_local_tail = *u->sq_tail;
+  u->cq_head = (unsigned *)(void *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(void *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned *)(void *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+  /* Slot i of the indirection array always names entry i. */
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    u->sq_array[i] = i;
+  return 0;
+
+fail:
+  uring_exit(u);
+  return -1;
+}
+
+void uring_exit(struct uring *u) {
+  int saved = errno;
+  if (u->sqes)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring && u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_ring_size);
+  if (u->fd >= 0)
+    close(u->fd);
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+  errno = saved;
+}
+
+/* Makes the entries handed out so far visible to the kernel and returns
+ * how many that is. */
+static unsigned publish(struct uring *u) {
+  unsigned n = u->sq_local_tail - *u->sq_tail;
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  return n;
+}
+
+static int enter(struct uring *u, unsigned min_complete, int timeout_ms) {
+  unsigned to_submit = publish(u);
+  if (to_submit == 0 && min_complete == 0)
+    return 0;
+  struct __kernel_timespec ts = {timeout_ms / 1000,
+                                 (long long)(timeout_ms % 1000) * 1000000};
+  struct io_uring_getevents_arg arg = {
+      .sigmask = 0,
+      .sigmask_sz = _NSIG / 8,
+      .ts = timeout_ms >= 0 ? (unsigned long long)(uintptr_t)&ts : 0,
+  };
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (min_complete)
+    flags |= IORING_ENTER_GETEVENTS;
+  int rc = sys_enter(u->fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+  return rc < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->sq_local_tail - head >= u->sq_entries) {
+    if (enter(u, 0, -1) < 0)
+      return NULL;
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+  struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+  u->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit_and_wait(struct uring *u, int timeout_ms) {
+  if (uring_peek_cqe(u))
+    return enter(u, 0, -1);
+  return enter(u, 1, timeout_ms);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
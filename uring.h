@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A minimal io_uring, set up and driven with the raw system calls so that
+ * nothing beyond the kernel headers is needed. One thread owns the ring:
+ * it fills submission entries, submits them in batches and reaps the
+ * completions. */
+struct uring {
+  int fd;
+  unsigned features;
+  /* Submission queue. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; /* entries handed out but not yet published */
+  struct io_uring_sqe *sqes;
+  /* Completion queue. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Mappings, for uring_exit(). */
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+/* Sets up a ring of entries submission slots. Returns -1 with errno set
+ * when the kernel has no io_uring, it is disabled, or the features used
+ * here (waiting with a timeout) are missing. */
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+
+/* Returns a zeroed submission entry, publishing and submitting what is
+ * queued first if the ring is full. NULL only if that fails. */
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+
+/* Submits everything queued and waits up to timeout_ms (-1: forever) for
+ * at least one completion. Returns 0, or -1 with errno set (EINTR and
+ * ETIME are normal). */
+int uring_submit_and_wait(struct uring *u, int timeout_ms);
+
+/* The next completion, or NULL. Each one must be passed to
+ * uring_cqe_seen() before the next is peeked. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+#endif